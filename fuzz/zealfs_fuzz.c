@@ -0,0 +1,169 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * libFuzzer target, built with `make fuzz`. Each input is an image followed by a script of
+ * operations: the image is mounted through the embedding API, which checks its integrity and
+ * rejects it if it is corrupted, then the operations are run against it. Besides the crashes
+ * caught by the sanitizers, an operation following more than twice the number of pages of the
+ * image is reported: a corrupted chain made it loop.
+ *
+ * The file system is included to read the cost of the last operation, `t_op_hops`.
+ */
+#include "../src/zealfs_fuse.c"
+#include <sys/mman.h>
+
+/* Paths the operations are done on, nested to exercise the directories */
+static const char* const s_paths[] = {
+    "/a", "/b.txt", "/dir", "/dir/a", "/dir/sub", "/dir/sub/c", "/zealfs", "/missing/a",
+};
+#define PATHS_COUNT (sizeof(s_paths) / sizeof(*s_paths))
+
+static const int s_open_flags[] = {
+    O_RDONLY, O_WRONLY, O_RDWR, O_RDWR | O_CREAT, O_WRONLY | O_CREAT | O_TRUNC, O_RDWR | O_TRUNC,
+};
+#define OPEN_FLAGS_COUNT (sizeof(s_open_flags) / sizeof(*s_open_flags))
+
+/* Script being run, read byte by byte, zeros once it is consumed */
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+} fuzz_script;
+
+static uint8_t script_byte(fuzz_script* script)
+{
+    if (script->size == 0) {
+        return 0;
+    }
+    script->size--;
+    return *script->data++;
+}
+
+
+/**
+ * @brief Abort if the last operation followed too many pages, `open_image` bounds it.
+ */
+static void check_hops(void)
+{
+    if (t_op_hops > 2 * IMAGE_PAGES) {
+        fprintf(stderr, "operation followed %u pages, the image has %d\n",
+                t_op_hops, (int) IMAGE_PAGES);
+        abort();
+    }
+}
+
+
+/**
+ * @brief Write the image to an anonymous file, so that it is opened by path as any image.
+ *
+ * @return File descriptor on success, -1 on error.
+ */
+static int image_file(const uint8_t* image, size_t size, int size_kb, char* path)
+{
+    const int fd = memfd_create("zealfs-fuzz", 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, size_kb * 1024) != 0 || pwrite(fd, image, size, 0) != (ssize_t) size) {
+        close(fd);
+        return -1;
+    }
+    sprintf(path, "/proc/self/fd/%d", fd);
+    return fd;
+}
+
+
+static void run_script(fuzz_script* script)
+{
+    static uint8_t buf[VOLUME_MAX_SIZE];
+    int handles[4] = { -1, -1, -1, -1 };
+
+    while (script->size) {
+        const uint8_t op = script_byte(script);
+        const char* path = s_paths[script_byte(script) % PATHS_COUNT];
+        int* handle = &handles[script_byte(script) % 4];
+        const int size = script_byte(script) * 64;
+
+        switch (op % 11) {
+            case 0:
+                if (*handle >= 0) {
+                    zealfs_embed_close(*handle);
+                }
+                *handle = zealfs_embed_open(path, s_open_flags[op / 11 % OPEN_FLAGS_COUNT]);
+                break;
+            case 1:
+                if (*handle >= 0) {
+                    zealfs_embed_close(*handle);
+                    *handle = -1;
+                }
+                break;
+            case 2:
+                zealfs_embed_read(*handle, buf, size);
+                break;
+            case 3:
+                memset(buf, op, size);
+                zealfs_embed_write(*handle, buf, size);
+                break;
+            case 4:
+                zealfs_embed_seek(*handle, size, op / 11 % 3);
+                break;
+            case 5: {
+                const int dir = zealfs_embed_opendir(path);
+                zealfs_embed_dirent dirent;
+                while (dir >= 0 && zealfs_embed_readdir(dir, &dirent) > 0) {
+                    check_hops();
+                }
+                if (dir >= 0) {
+                    zealfs_embed_close(dir);
+                }
+                break;
+            }
+            case 6:
+                zealfs_embed_mkdir(path);
+                break;
+            case 7:
+                zealfs_embed_rmdir(path);
+                break;
+            case 8:
+                zealfs_embed_unlink(path);
+                break;
+            case 9:
+                zealfs_embed_rename(path, s_paths[op / 11 % PATHS_COUNT]);
+                break;
+            case 10:
+                zealfs_embed_truncate(path, size);
+                break;
+        }
+        check_hops();
+    }
+}
+
+
+/**
+ * @brief The first byte gives the size of the image in KB, minus 1, then come the bytes of the
+ *        image, padded with zeros, and the script of the operations.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    char path[32];
+    if (size == 0) {
+        return 0;
+    }
+    const int size_kb = data[0] % 64 + 1;
+    const size_t image_size = MIN(size - 1, (size_t) size_kb * 1024);
+    fuzz_script script = { data + 1 + image_size, size - 1 - image_size };
+
+    const int fd = image_file(data + 1, image_size, size_kb, path);
+    if (fd < 0) {
+        return 0;
+    }
+    /* Corrupted images are rejected by the integrity check */
+    if (zealfs_embed_mount(path, size_kb) == 0) {
+        run_script(&script);
+        zealfs_embed_unmount();
+    }
+    close(fd);
+    return 0;
+}
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
 
 /* The default name for the disk image can be provided from the Makefile or command
  * line. If it was not provided, define it here.
@@ -23,6 +24,10 @@
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
 #endif
 
+#ifndef MAX
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+
 /**
  * @brief Convert a pointer from the image cache to a page number
  */
@@ -30,6 +35,10 @@
 
 /* Bit 0 is 1 if is directory */
 #define IS_DIR (1 << 0)
+/* Bit 1 is 1 if the file content is packed in a page shared with other small files */
+#define IS_PACKED (1 << 1)
+/* Bit 2 is 1 if the file content is compressed */
+#define IS_COMPRESSED (1 << 2)
 /* Bit 7 is 1 if is entry occupied */
 #define IS_OCCUPIED (1 << 7)
 
@@ -39,6 +48,8 @@
 /* Type for table entry */
 typedef struct {
     /* Bit 0: 1 = directory, 0 = file
+     * Bit 1: 1 = packed file, 0 = regular file
+     * Bit 2: 1 = compressed file, 0 = raw content
      * bit n: reserved
      * Bit 7: 1 = occupied, 0 = free */
     uint8_t flags; /* IS_DIR, IS_FILE, etc... */
@@ -54,14 +65,31 @@ typedef struct {
     uint8_t  hours;
     uint8_t  minutes;
     uint8_t  seconds;
+    /* For packed files, index of the first slot in the shared page */
+    uint8_t slot;
+    /* For compressed files, size of the decompressed content, little-endian!
+     * In that case, `size` is the size of the compressed data. */
+    uint16_t raw_size;
     /* Reserved for future use */
-    uint8_t reserved[4];
+    uint8_t reserved[1];
 } __attribute__((packed)) ZealFileEntry;
 
 _Static_assert(sizeof(ZealFileEntry) == 32, "ZealFileEntry must be smaller than 32 bytes");
 
 #define BITMAP_SIZE     32
-#define RESERVED_SIZE   28
+#define RESERVED_SIZE   27
+
+/*
+ * Pages are (256 << page_order) bytes big, `page_order` being a field of the header set when the
+ * image is formatted. Page numbers remain 8-bit values, so bigger pages allow bigger images, and
+ * make the chains of pages shorter.
+ */
+#define PAGE_ORDER_MAX  2
+
+/**
+ * @brief Size of the pages of the mounted image, in bytes.
+ */
+#define PAGE_BYTES      (1 << g_page_shift)
 
 /* Type for partition header */
 typedef struct {
@@ -76,6 +104,8 @@ typedef struct {
   uint8_t free_pages;
   /* Bitmap for the free pages. A used page is marked as 1, else 0 */
   uint8_t pages_bitmap[BITMAP_SIZE];   /* 256 pages/8-bit = 32 */
+  /* Pages are (256 << page_order) bytes big, 0 in the images formatted before it existed */
+  uint8_t page_order;
   /* Reserved bytes, to align the entries and for future use, such as
    * extended root directory, volume name, extra bitmap, etc... */
   uint8_t reserved[RESERVED_SIZE];
@@ -90,10 +120,45 @@ _Static_assert(offsetof(ZealFSHeader, entries) % sizeof(ZealFileEntry) == 0,
  * As the root directory has less available space for the entries, it will have less than
  * regular directories. Define the following macro to simply the calculation.
  */
-#define ROOT_MAX_ENTRIES ((256 - sizeof(ZealFSHeader)) / sizeof(ZealFileEntry))
+#define ROOT_MAX_ENTRIES ((PAGE_BYTES - sizeof(ZealFSHeader)) / sizeof(ZealFileEntry))
 
 /* Entries count for regular directories (i.e. not root) */
-#define DIR_MAX_ENTRIES (256 / sizeof(ZealFileEntry))
+#define DIR_MAX_ENTRIES (PAGE_BYTES / sizeof(ZealFileEntry))
+
+/*
+ * Small files can be packed together in a shared page, only in images with 256-byte pages.
+ * Such a page is split into 32-byte slots, the first slot is reserved: its first byte is the
+ * bitmap of the allocated slots (bit n is 1 if slot n is allocated, bit 0 is always 1).
+ * A packed file occupies `(size + 31) / 32` contiguous slots, starting at its entry's `slot`
+ * field.
+ */
+#define PACK_SLOT_SIZE  32
+#define PACK_SLOT_COUNT (256 / PACK_SLOT_SIZE)
+/* Files bigger than this are stored in a regular chain of pages */
+#define PACK_MAX_SLOTS  4
+#define PACK_MAX_SIZE   (PACK_MAX_SLOTS * PACK_SLOT_SIZE)
+
+/**
+ * @brief Get the number of slots needed by a packed file of the given size.
+ */
+static inline int packedSlots(int size) {
+    return (size + PACK_SLOT_SIZE - 1) / PACK_SLOT_SIZE;
+}
+
+/**
+ * @brief Look for `count` contiguous free slots in a shared page bitmap.
+ *
+ * @return Index of the first slot on success, 0 if there is not enough room.
+ */
+static inline int packedFindSlots(uint8_t bitmap, int count) {
+    const uint8_t mask = (1 << count) - 1;
+    for (int slot = 1; slot + count <= PACK_SLOT_COUNT; slot++) {
+        if ((bitmap & (mask << slot)) == 0) {
+            return slot;
+        }
+    }
+    return 0;
+}
 
 
 /**
@@ -111,6 +176,25 @@ static inline uint8_t toBCD(int value) {
     return (((value / 10) % 10) << 4) | (value % 10);
 }
 
+/**
+ * @brief Set the date of an entry, in BCD, from a time in local time.
+ *
+ * @param entry Entry to update.
+ * @param rawtime Time to set, as returned by `time`.
+ */
+static inline void setDate(ZealFileEntry* entry, time_t rawtime) {
+    struct tm timest;
+    localtime_r(&rawtime, &timest);
+    entry->year[0] = toBCD((1900 + timest.tm_year) / 100);   /* 20 first */
+    entry->year[1] = toBCD(timest.tm_year);                  /* 22 then */
+    entry->month = toBCD(timest.tm_mon + 1);
+    entry->day = toBCD(timest.tm_mday);
+    entry->date = toBCD(timest.tm_wday);
+    entry->hours = toBCD(timest.tm_hour);
+    entry->minutes = toBCD(timest.tm_min);
+    entry->seconds = toBCD(timest.tm_sec);
+}
+
 /**
  * @brief Free a page in the header bitmap.
  *
@@ -132,7 +216,7 @@ static inline void freePage(ZealFSHeader* header, uint8_t page) {
  *
  * @return Page number on success, 0 on error.
  */
-static uint8_t allocatePage(ZealFSHeader* header) {
+static inline uint8_t allocatePage(ZealFSHeader* header) {
   const int size = header->bitmap_size;
   int i = 0;
   uint8_t value = 0;
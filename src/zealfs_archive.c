@@ -0,0 +1,290 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "zealfs_archive.h"
+
+#define ALIGN_UP(value, align)  (((value) + (align) - 1) / (align) * (align))
+
+uint64_t archive_hash(const uint8_t* data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+
+int archive_open(zealfs_archive* archive, const char* path, int writable)
+{
+    ZealArchiveHeader header;
+    struct stat st;
+
+    memset(archive, 0, sizeof(*archive));
+    archive->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (archive->fd < 0) {
+        return -errno;
+    }
+
+    int err = -EINVAL;
+    if (fstat(archive->fd, &st) != 0 ||
+        pread(archive->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != ARCHIVE_VERSION) {
+        goto error;
+    }
+
+    /* The index must be entirely in the file */
+    archive->mapped = header.index_offset + (uint64_t) header.count * sizeof(ZealArchiveEntry);
+    if (header.index_offset < sizeof(header) || archive->mapped > (uint64_t) st.st_size) {
+        goto error;
+    }
+
+    void* map = mmap(NULL, archive->mapped, PROT_READ, MAP_SHARED, archive->fd, 0);
+    if (map == MAP_FAILED) {
+        err = -errno;
+        goto error;
+    }
+    archive->header = map;
+    archive->entries = (const ZealArchiveEntry*) ((const uint8_t*) map + header.index_offset);
+    return 0;
+
+error:
+    close(archive->fd);
+    archive->fd = -1;
+    return err;
+}
+
+
+void archive_close(zealfs_archive* archive)
+{
+    if (archive->header) {
+        munmap((void*) archive->header, archive->mapped);
+        archive->header = NULL;
+    }
+    if (archive->fd >= 0) {
+        close(archive->fd);
+        archive->fd = -1;
+    }
+}
+
+
+const ZealArchiveEntry* archive_find(const zealfs_archive* archive, const char* name)
+{
+    int low = 0;
+    int high = (int) archive->header->count - 1;
+
+    if (strlen(name) > ARCHIVE_NAME_LEN) {
+        return NULL;
+    }
+    while (low <= high) {
+        const int middle = low + (high - low) / 2;
+        const int cmp = strncmp(name, archive->entries[middle].name, ARCHIVE_NAME_LEN);
+        if (cmp == 0) {
+            return &archive->entries[middle];
+        } else if (cmp <= 0) {
+            high = middle - 1;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
+
+
+int archive_set_hash(zealfs_archive* archive, const ZealArchiveEntry* entry, uint64_t hash)
+{
+    const off_t offset = (const uint8_t*) &entry->hash - (const uint8_t*) archive->header;
+    if (pwrite(archive->fd, &hash, sizeof(hash), offset) != sizeof(hash)) {
+        return -EIO;
+    }
+    return 0;
+}
+
+
+/* Image to store in an archive being built */
+typedef struct {
+    ZealArchiveEntry entry;
+    const char* path;
+} build_item;
+
+/* State shared by the threads building an archive */
+typedef struct {
+    build_item* items;
+    int count;
+    int fd;
+    /* Next item to process */
+    atomic_int next;
+    atomic_int error;
+} build_context;
+
+
+static int compare_items(const void* a, const void* b)
+{
+    return strncmp(((const build_item*) a)->entry.name, ((const build_item*) b)->entry.name,
+                   ARCHIVE_NAME_LEN);
+}
+
+
+/**
+ * @brief Copy an image in the archive and compute its hash.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int build_copy(build_context* ctx, build_item* item)
+{
+    int err = 0;
+    uint8_t* content = malloc(item->entry.size ? item->entry.size : 1);
+    int fd = open(item->path, O_RDONLY);
+    if (content == NULL || fd < 0) {
+        err = content ? -errno : -ENOMEM;
+        goto end;
+    }
+
+    size_t done = 0;
+    while (done < item->entry.size) {
+        const ssize_t rd = read(fd, content + done, item->entry.size - done);
+        if (rd <= 0) {
+            err = -EIO;
+            goto end;
+        }
+        done += rd;
+    }
+    if (pwrite(ctx->fd, content, item->entry.size, item->entry.offset) != (ssize_t) item->entry.size) {
+        err = -EIO;
+        goto end;
+    }
+    item->entry.hash = archive_hash(content, item->entry.size);
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(content);
+    return err;
+}
+
+
+static void* build_thread(void* arg)
+{
+    build_context* ctx = arg;
+    int i;
+
+    while (atomic_load(&ctx->error) == 0 && (i = atomic_fetch_add(&ctx->next, 1)) < ctx->count) {
+        int err = build_copy(ctx, &ctx->items[i]);
+        if (err) {
+            printf("Error: could not copy %s into the archive\n", ctx->items[i].path);
+            atomic_store(&ctx->error, err);
+        }
+    }
+    return NULL;
+}
+
+
+int archive_build(const char* path, char* const* images, int count, int jobs)
+{
+    build_context ctx = { .count = count, .fd = -1 };
+    pthread_t threads[jobs];
+    int started = 0;
+    int err = 0;
+
+    ctx.items = calloc(count ? count : 1, sizeof(build_item));
+    if (ctx.items == NULL) {
+        return -ENOMEM;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        char* copy = strdup(images[i]);
+        const char* name = basename(copy);
+        const size_t len = strlen(name);
+        if (len <= ARCHIVE_NAME_LEN) {
+            memcpy(ctx.items[i].entry.name, name, len);
+        }
+        free(copy);
+        if (len > ARCHIVE_NAME_LEN) {
+            printf("Error: name of %s is too long\n", images[i]);
+            err = -ENAMETOOLONG;
+            goto end;
+        }
+        if (stat(images[i], &st) != 0 || st.st_size > UINT32_MAX) {
+            printf("Error: could not get the size of %s\n", images[i]);
+            err = -EINVAL;
+            goto end;
+        }
+        ctx.items[i].path = images[i];
+        ctx.items[i].entry.size = st.st_size;
+    }
+
+    /* The index is sorted by name, the images are stored in the same order */
+    qsort(ctx.items, count, sizeof(build_item), compare_items);
+    uint64_t offset = ALIGN_UP(sizeof(ZealArchiveHeader) + count * sizeof(ZealArchiveEntry), ARCHIVE_ALIGN);
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && compare_items(&ctx.items[i - 1], &ctx.items[i]) == 0) {
+            printf("Error: %s and %s have the same name\n", ctx.items[i - 1].path, ctx.items[i].path);
+            err = -EEXIST;
+            goto end;
+        }
+        ctx.items[i].entry.offset = offset;
+        offset = ALIGN_UP(offset + ctx.items[i].entry.size, ARCHIVE_ALIGN);
+    }
+
+    ctx.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (ctx.fd < 0 || ftruncate(ctx.fd, offset) != 0) {
+        err = -errno;
+        goto end;
+    }
+
+    /* Images are independent, copy and hash them in parallel */
+    for (started = 0; started < jobs - 1; started++) {
+        if (pthread_create(&threads[started], NULL, build_thread, &ctx) != 0) {
+            break;
+        }
+    }
+    build_thread(&ctx);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    err = atomic_load(&ctx.error);
+    if (err) {
+        goto end;
+    }
+
+    /* Write the index once all the hashes are known, and the header last */
+    ZealArchiveHeader header = {
+        .version = ARCHIVE_VERSION,
+        .count = count,
+        .index_offset = sizeof(ZealArchiveHeader),
+    };
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    for (int i = 0; i < count; i++) {
+        const off_t index = sizeof(ZealArchiveHeader) + i * sizeof(ZealArchiveEntry);
+        if (pwrite(ctx.fd, &ctx.items[i].entry, sizeof(ZealArchiveEntry), index) != sizeof(ZealArchiveEntry)) {
+            err = -EIO;
+            goto end;
+        }
+    }
+    if (pwrite(ctx.fd, &header, sizeof(header), 0) != sizeof(header)) {
+        err = -EIO;
+    }
+
+end:
+    if (ctx.fd >= 0) {
+        close(ctx.fd);
+    }
+    free(ctx.items);
+    return err;
+}
@@ -0,0 +1,106 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * An archive bundles many disk images in a single file. It starts with a header, followed by an
+ * index of all the images, sorted by name, followed by the content of the images. Each image
+ * starts on a 256-byte boundary, so its pages are aligned in the archive too.
+ *
+ * The header and the index are meant to be memory-mapped: an image is found with a binary search
+ * in the index, without reading anything else. All the fields are little-endian.
+ */
+#define ARCHIVE_MAGIC       "ZEALARCH"
+#define ARCHIVE_VERSION     1
+#define ARCHIVE_NAME_LEN    40
+#define ARCHIVE_ALIGN       256
+
+typedef struct {
+    /* Must be ARCHIVE_MAGIC, without the NULL-terminator */
+    char magic[8];
+    uint32_t version;
+    /* Number of images in the archive */
+    uint32_t count;
+    /* Offset of the first index entry, entries are contiguous */
+    uint64_t index_offset;
+    uint8_t reserved[40];
+} __attribute__((packed)) ZealArchiveHeader;
+
+_Static_assert(sizeof(ZealArchiveHeader) == 64, "ZealArchiveHeader must be 64 bytes big");
+
+typedef struct {
+    /* Name of the image, padded with 0s, not NULL-terminated if ARCHIVE_NAME_LEN long */
+    char name[ARCHIVE_NAME_LEN];
+    /* Offset of the image content in the archive, multiple of ARCHIVE_ALIGN */
+    uint64_t offset;
+    /* Size of the image in bytes */
+    uint32_t size;
+    uint32_t reserved;
+    /* Hash of the image content, see `archive_hash` */
+    uint64_t hash;
+} __attribute__((packed)) ZealArchiveEntry;
+
+_Static_assert(sizeof(ZealArchiveEntry) == 64, "ZealArchiveEntry must be 64 bytes big");
+
+/* Opened archive, its header and index are mapped in memory */
+typedef struct {
+    int fd;
+    const ZealArchiveHeader* header;
+    const ZealArchiveEntry* entries;
+    /* Size of the mapping, starting at the beginning of the file */
+    size_t mapped;
+} zealfs_archive;
+
+
+/**
+ * @brief Hash some content with 64-bit FNV-1a.
+ */
+uint64_t archive_hash(const uint8_t* data, size_t size);
+
+/**
+ * @brief Open an archive and map its index in memory.
+ *
+ * @param archive Archive to initialize.
+ * @param path Path of the archive file.
+ * @param writable 1 to open the archive for reading and writing, 0 for reading only.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int archive_open(zealfs_archive* archive, const char* path, int writable);
+
+/**
+ * @brief Unmap and close an archive.
+ */
+void archive_close(zealfs_archive* archive);
+
+/**
+ * @brief Look for an image in the archive.
+ *
+ * @return Entry of the image, NULL if not found.
+ */
+const ZealArchiveEntry* archive_find(const zealfs_archive* archive, const char* name);
+
+/**
+ * @brief Store the new hash of an image that was modified. The archive must be writable.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int archive_set_hash(zealfs_archive* archive, const ZealArchiveEntry* entry, uint64_t hash);
+
+/**
+ * @brief Create an archive out of image files. The images are named after their basename.
+ *
+ * @param path Path of the archive to create, overwritten if it exists.
+ * @param images Paths of the image files to bundle.
+ * @param count Number of images.
+ * @param jobs Number of threads reading, hashing and writing the images.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int archive_build(const char* path, char* const* images, int count, int jobs);
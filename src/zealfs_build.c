@@ -0,0 +1,829 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "zealfs.h"
+#include "zealfs_build.h"
+
+/* Image being built, the helpers of zealfs.h refer to these */
+static uint8_t* g_image;
+static int g_page_shift;
+
+#define PAGE_PAYLOAD    (PAGE_BYTES - 1)
+#define IMAGE_PAGES     (g_size >> g_page_shift)
+#define PAGE_PTR(page)  (g_image + ((page) << g_page_shift))
+
+static int g_size;
+
+/* New page of each shared page of the laid out image, 0 if not placed yet */
+static uint8_t g_shared[256];
+
+/* Entry of the manifest, or file of the image being laid out again */
+typedef struct {
+    /* Line in the manifest, 0 when laying out an image */
+    int line;
+    char path[PATH_MAX];
+    /* 0 if the file can be stored anywhere */
+    int pin;
+    int contiguous;
+    int is_dir;
+    uint8_t* content;
+    int size;
+    time_t mtime;
+    /* Number of pages and first page of the content, for the files */
+    int pages;
+    int start;
+    /* Entry in the former image when laying it out again, everything but its pages is kept */
+    const ZealFileEntry* origin;
+    /* For packed files, former shared page, whose copy is `content` */
+    uint8_t shared;
+    /* Number of reads and of bytes read, given by the hotness file */
+    unsigned reads;
+    unsigned long bytes;
+} build_entry;
+
+/* Growing array of entries */
+typedef struct {
+    build_entry* entries;
+    int count;
+    int capacity;
+} build_list;
+
+
+/**
+ * @brief Append a zeroed entry to a list.
+ *
+ * @return The new entry, NULL if there is no memory left.
+ */
+static build_entry* list_append(build_list* list)
+{
+    if (list->count == list->capacity) {
+        const int capacity = list->capacity ? list->capacity * 2 : 32;
+        build_entry* grown = realloc(list->entries, capacity * sizeof(build_entry));
+        if (grown == NULL) {
+            return NULL;
+        }
+        list->entries = grown;
+        list->capacity = capacity;
+    }
+    build_entry* entry = &list->entries[list->count++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+
+static void list_free(build_list* list)
+{
+    for (int i = 0; i < list->count; i++) {
+        free(list->entries[i].content);
+    }
+    free(list->entries);
+    list->entries = NULL;
+    list->count = 0;
+}
+
+
+/**
+ * @brief Report an entry that cannot be placed, with its line in the manifest if any.
+ */
+static void placement_error(const build_entry* build, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (build->line) {
+        printf("Error: line %d: ", build->line);
+    } else {
+        printf("Error: ");
+    }
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+}
+
+
+static int is_allocated(int page)
+{
+    const ZealFSHeader* header = (ZealFSHeader*) g_image;
+    return (header->pages_bitmap[page / 8] >> (page % 8)) & 1;
+}
+
+
+static void mark_allocated(int page)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    header->pages_bitmap[page / 8] |= 1 << (page % 8);
+    header->free_pages--;
+}
+
+
+/**
+ * @brief Check whether `count` pages starting at `first` are all free.
+ */
+static int range_is_free(int first, int count)
+{
+    for (int i = first; i < first + count; i++) {
+        if (is_allocated(i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * @brief Look for the first run of `count` free and contiguous pages.
+ *
+ * @return First page of the run, 0 if there is none.
+ */
+static int find_free_run(int count)
+{
+    for (int first = 1; first + count <= IMAGE_PAGES; first++) {
+        if (range_is_free(first, count)) {
+            return first;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Read the content of a source file, at most UINT16_MAX bytes.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int load_source(build_entry* entry, const char* source)
+{
+    struct stat st;
+    int fd = open(source, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        int err = -errno;
+        printf("Error: line %d: could not open %s: %s\n", entry->line, source, strerror(-err));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return err;
+    }
+    int err = 0;
+    if (!S_ISREG(st.st_mode) || st.st_size > UINT16_MAX) {
+        printf("Error: line %d: %s must be a regular file of at most %d bytes\n",
+               entry->line, source, UINT16_MAX);
+        err = -EFBIG;
+    } else {
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtime;
+        entry->content = malloc(entry->size ? entry->size : 1);
+        if (entry->content == NULL) {
+            err = -ENOMEM;
+        } else if (read(fd, entry->content, entry->size) != entry->size) {
+            printf("Error: line %d: could not read %s\n", entry->line, source);
+            err = -EIO;
+        }
+    }
+    close(fd);
+    return err;
+}
+
+
+/**
+ * @brief Parse one line of the manifest, its source is loaded.
+ *
+ * @return 1 if the entry was filled, 0 if the line is empty, negative error code else.
+ */
+static int parse_line(char* line, int number, build_entry* entry)
+{
+    const char* separators = " \t\r\n";
+    char* saveptr = NULL;
+    char* path = strtok_r(line, separators, &saveptr);
+    if (path == NULL || path[0] == '#') {
+        return 0;
+    }
+    entry->line = number;
+
+    const char* source = strtok_r(NULL, separators, &saveptr);
+    if (source == NULL) {
+        printf("Error: line %d: missing source for %s\n", number, path);
+        return -EINVAL;
+    }
+    if (path[0] != '/' || strlen(path) < 2 || strlen(path) >= sizeof(entry->path)) {
+        printf("Error: line %d: invalid path %s\n", number, path);
+        return -EINVAL;
+    }
+    strcpy(entry->path, path);
+
+    char* option;
+    while ((option = strtok_r(NULL, separators, &saveptr)) != NULL) {
+        char* end = NULL;
+        if (strncmp(option, "pin=", 4) == 0) {
+            entry->pin = strtol(option + 4, &end, 0);
+            if (*end != 0 || end == option + 4 || entry->pin <= 0) {
+                printf("Error: line %d: invalid page in %s\n", number, option);
+                return -EINVAL;
+            }
+        } else if (strcmp(option, "contiguous") == 0) {
+            entry->contiguous = 1;
+        } else {
+            printf("Error: line %d: unknown option %s\n", number, option);
+            return -EINVAL;
+        }
+    }
+
+    const size_t length = strlen(entry->path);
+    if (entry->path[length - 1] == '/') {
+        entry->path[length - 1] = 0;
+        entry->is_dir = 1;
+        entry->mtime = time(NULL);
+        if (strcmp(source, "-") != 0 || entry->pin || entry->contiguous) {
+            printf("Error: line %d: directories have no source and no placement\n", number);
+            return -EINVAL;
+        }
+        return 1;
+    }
+    /* The pinned files are read by a loader which doesn't follow the chain */
+    if (entry->pin) {
+        entry->contiguous = 1;
+    }
+    int err = load_source(entry, source);
+    if (err) {
+        return err;
+    }
+    entry->pages = entry->size ? (entry->size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD : 1;
+    return 1;
+}
+
+
+/**
+ * @brief Parse the whole manifest, its entries are appended to the list.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int parse_manifest(const char* manifest, build_list* list)
+{
+    char line[PATH_MAX * 2 + 64];
+    int err = 0;
+
+    FILE* file = fopen(manifest, "r");
+    if (file == NULL) {
+        err = -errno;
+        printf("Error: could not open %s: %s\n", manifest, strerror(-err));
+        return err;
+    }
+    for (int number = 1; err == 0 && fgets(line, sizeof(line), file) != NULL; number++) {
+        build_entry* entry = list_append(list);
+        if (entry == NULL) {
+            err = -ENOMEM;
+            break;
+        }
+        const int ret = parse_line(line, number, entry);
+        if (ret < 0) {
+            err = ret;
+        }
+        /* Drop the empty lines, the failing entry may have loaded its source already */
+        if (ret == 0) {
+            list->count--;
+        }
+    }
+    fclose(file);
+    return err;
+}
+
+
+/**
+ * @brief Reserve the pages of the pinned files, before any other file is placed.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int reserve_pinned(build_entry* entries, int count)
+{
+    for (int i = 0; i < count; i++) {
+        build_entry* entry = &entries[i];
+        if (entry->pin == 0) {
+            continue;
+        }
+        if (entry->pin + entry->pages > IMAGE_PAGES) {
+            printf("Error: line %d: %s needs pages %d to %d, the image has %d pages\n",
+                   entry->line, entry->path, entry->pin, entry->pin + entry->pages - 1, IMAGE_PAGES);
+            return -ENOSPC;
+        }
+        if (!range_is_free(entry->pin, entry->pages)) {
+            printf("Error: line %d: %s overlaps another pinned file\n", entry->line, entry->path);
+            return -EEXIST;
+        }
+        for (int page = entry->pin; page < entry->pin + entry->pages; page++) {
+            mark_allocated(page);
+        }
+        entry->start = entry->pin;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Look for an entry in a directory, or create it.
+ *
+ * @param dir First entry of the directory.
+ * @param max_entries Capacity of the directory.
+ * @param created Set to 1 if the entry was created.
+ *
+ * @return The entry, NULL if the directory is full.
+ */
+static ZealFileEntry* get_entry(ZealFileEntry* dir, int max_entries, const char* name, int* created)
+{
+    ZealFileEntry* free_entry = NULL;
+    *created = 0;
+    for (int i = 0; i < max_entries; i++) {
+        ZealFileEntry* entry = &dir[i];
+        if ((entry->flags & IS_OCCUPIED) == 0) {
+            free_entry = free_entry ? free_entry : entry;
+        } else if (strncmp(entry->name, name, NAME_MAX_LEN) == 0) {
+            return entry;
+        }
+    }
+    if (free_entry) {
+        memset(free_entry, 0, sizeof(*free_entry));
+        strncpy(free_entry->name, name, NAME_MAX_LEN);
+        *created = 1;
+    }
+    return free_entry;
+}
+
+
+/**
+ * @brief Create the entry of a manifest line in the tree, with its parent directories.
+ *
+ * @return The entry of the file or directory, NULL on error.
+ */
+static ZealFileEntry* create_entry(const build_entry* build)
+{
+    char path[PATH_MAX];
+    char* saveptr = NULL;
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    ZealFileEntry* dir = header->entries;
+    int max_entries = ROOT_MAX_ENTRIES;
+    ZealFileEntry* entry = NULL;
+    int created = 0;
+
+    strcpy(path, build->path);
+    char* name = strtok_r(path, "/", &saveptr);
+    while (name != NULL) {
+        char* next = strtok_r(NULL, "/", &saveptr);
+        const int is_dir = next != NULL || build->is_dir;
+        if (strlen(name) > NAME_MAX_LEN) {
+            placement_error(build, "%s is longer than %d characters", name, NAME_MAX_LEN);
+            return NULL;
+        }
+        entry = get_entry(dir, max_entries, name, &created);
+        if (entry == NULL) {
+            placement_error(build, "no room left in the directory of %s", name);
+            return NULL;
+        }
+        if (!created && (next == NULL || (entry->flags & IS_DIR) == 0)) {
+            /* Listing a directory which was already created by a file inside it is fine */
+            if (next == NULL && build->is_dir && (entry->flags & IS_DIR)) {
+                return entry;
+            }
+            placement_error(build, "%s already exists", build->path);
+            return NULL;
+        }
+        if (created && is_dir) {
+            const uint8_t page = allocatePage(header);
+            if (page == 0) {
+                placement_error(build, "no space left for directory %s", name);
+                return NULL;
+            }
+            if (next == NULL && build->origin) {
+                *entry = *build->origin;
+            } else {
+                entry->flags = IS_OCCUPIED | IS_DIR;
+                entry->size = PAGE_BYTES;
+                setDate(entry, build->mtime);
+            }
+            entry->start_page = page;
+        }
+        dir = (ZealFileEntry*) PAGE_PTR(entry->start_page);
+        max_entries = DIR_MAX_ENTRIES;
+        name = next;
+    }
+    return entry;
+}
+
+
+/**
+ * @brief Place a packed file of the laid out image: its shared page is copied as-is, once, and
+ *        the file keeps its slots.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int place_packed(build_entry* build)
+{
+    if (build->shared == 0) {
+        /* Packed files don't own any slot until data is written to them */
+        build->start = 0;
+        return 0;
+    }
+    if (g_shared[build->shared] == 0) {
+        const uint8_t page = allocatePage((ZealFSHeader*) g_image);
+        if (page == 0) {
+            placement_error(build, "no space left for %s", build->path);
+            return -ENOSPC;
+        }
+        memcpy(PAGE_PTR(page), build->content, PAGE_BYTES);
+        g_shared[build->shared] = page;
+    }
+    build->start = g_shared[build->shared];
+    return 0;
+}
+
+
+/**
+ * @brief Allocate the pages of a file which is not pinned.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int place_file(build_entry* build)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+
+    if (build->origin && (build->origin->flags & IS_PACKED)) {
+        return place_packed(build);
+    }
+    if (build->contiguous) {
+        build->start = find_free_run(build->pages);
+        if (build->start == 0) {
+            placement_error(build, "no %d contiguous free pages for %s", build->pages, build->path);
+            return -ENOSPC;
+        }
+        for (int page = build->start; page < build->start + build->pages; page++) {
+            mark_allocated(page);
+        }
+        return 0;
+    }
+    if (header->free_pages < build->pages) {
+        placement_error(build, "no space left for %s", build->path);
+        return -ENOSPC;
+    }
+    /* Always take the lowest free page, the files end up packed after the pinned ones */
+    int previous = 0;
+    for (int i = 0; i < build->pages; i++) {
+        const uint8_t page = allocatePage(header);
+        if (previous) {
+            PAGE_PTR(previous)[0] = page;
+        } else {
+            build->start = page;
+        }
+        previous = page;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Store the content of a placed file in its chain of pages, and fill its entry.
+ */
+static void write_content(const build_entry* build, ZealFileEntry* entry)
+{
+    int page = build->start;
+    for (int i = 0; i < build->pages; i++) {
+        uint8_t* ptr = PAGE_PTR(page);
+        const int offset = i * PAGE_PAYLOAD;
+        /* The chain of the other files was already linked when allocating it */
+        const int next = i == build->pages - 1 ? 0 : build->contiguous ? page + 1 : ptr[0];
+        ptr[0] = next;
+        memcpy(ptr + 1, build->content + offset, MIN(build->size - offset, PAGE_PAYLOAD));
+        page = next;
+    }
+    if (build->origin) {
+        *entry = *build->origin;
+    } else {
+        entry->flags = IS_OCCUPIED;
+        entry->size = build->size;
+        setDate(entry, build->mtime);
+    }
+    entry->start_page = build->start;
+}
+
+
+/**
+ * @brief Allocate an empty image, only its header is initialized.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int new_image(int size, int page_size)
+{
+    g_page_shift = __builtin_ctz(page_size);
+    g_size = size;
+    if (page_size < 256 || page_size > (256 << PAGE_ORDER_MAX) || (page_size & (page_size - 1)) ||
+        size % page_size || IMAGE_PAGES < 8 || IMAGE_PAGES > 256 || IMAGE_PAGES % 8) {
+        printf("Error: invalid image size %d for %d-byte pages\n", size, page_size);
+        return -EINVAL;
+    }
+    g_image = calloc(1, size);
+    if (g_image == NULL) {
+        return -ENOMEM;
+    }
+    memset(g_shared, 0, sizeof(g_shared));
+
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    header->magic = 'Z';
+    header->version = 1;
+    header->page_order = g_page_shift - 8;
+    header->bitmap_size = IMAGE_PAGES / 8;
+    header->free_pages = IMAGE_PAGES - 1;
+    header->pages_bitmap[0] = 1;
+    return 0;
+}
+
+
+/**
+ * @brief Place all the entries in the image, in the order of the list, after the pinned ones.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int place_entries(build_list* list)
+{
+    int err = reserve_pinned(list->entries, list->count);
+    for (int i = 0; i < list->count && err == 0; i++) {
+        build_entry* build = &list->entries[i];
+        ZealFileEntry* entry = create_entry(build);
+        if (entry == NULL) {
+            err = -ENOSPC;
+        } else if (!build->is_dir) {
+            err = build->pin ? 0 : place_file(build);
+            if (err == 0) {
+                write_content(build, entry);
+            }
+        }
+    }
+    return err;
+}
+
+
+/**
+ * @brief Write the image, and free it.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int save_image(const char* image)
+{
+    int err = 0;
+    int fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, g_image, g_size) != g_size) {
+        err = fd < 0 ? -errno : -EIO;
+        printf("Error: could not write %s: %s\n", image, strerror(-err));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return err;
+}
+
+
+int build_image(const char* manifest, const char* image, int size, int page_size)
+{
+    build_list list = { 0 };
+
+    int err = new_image(size, page_size);
+    if (err) {
+        return err;
+    }
+    err = parse_manifest(manifest, &list);
+    if (err == 0) {
+        err = place_entries(&list);
+    }
+    /* Only write the image once all the constraints are met */
+    if (err == 0) {
+        err = save_image(image);
+    }
+    list_free(&list);
+    free(g_image);
+    g_image = NULL;
+    return err;
+}
+
+
+/**
+ * @brief Read the content of a file of the former image, by following its chain.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int read_chain(const uint8_t* src, int src_pages, build_entry* build)
+{
+    const ZealFileEntry* origin = build->origin;
+    build->size = origin->size;
+    if (origin->flags & IS_PACKED) {
+        /* The whole shared page is moved, the slots of the file don't change */
+        build->shared = origin->start_page;
+        if (build->shared == 0) {
+            return 0;
+        }
+        if (build->shared >= src_pages || g_page_shift != 8) {
+            return -EINVAL;
+        }
+        build->content = malloc(PAGE_BYTES);
+        if (build->content == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(build->content, src + (build->shared << g_page_shift), PAGE_BYTES);
+        return 0;
+    }
+    build->content = malloc(build->size ? build->size : 1);
+    if (build->content == NULL) {
+        return -ENOMEM;
+    }
+    build->pages = build->size ? (build->size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD : 1;
+    int page = origin->start_page;
+    for (int i = 0; i < build->pages; i++) {
+        if (page == 0 || page >= src_pages) {
+            return -EINVAL;
+        }
+        const uint8_t* ptr = src + (page << g_page_shift);
+        const int offset = i * PAGE_PAYLOAD;
+        memcpy(build->content + offset, ptr + 1, MIN(build->size - offset, PAGE_PAYLOAD));
+        page = ptr[0];
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Append the entries of a directory of the former image to the lists, recursively. The
+ *        directories are appended in the order of the tree, so that parents come first.
+ *
+ * @param visited Bitmap of the directory pages already collected, a directory referenced several
+ *                times is a corrupted image.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int collect_directory(const uint8_t* src, int src_pages, const ZealFileEntry* entries,
+                             int max_entries, const char* dir, build_list* dirs, build_list* files,
+                             uint8_t* visited)
+{
+    char path[PATH_MAX];
+    for (int i = 0; i < max_entries; i++) {
+        const ZealFileEntry* entry = &entries[i];
+        if ((entry->flags & IS_OCCUPIED) == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%.*s", dir, NAME_MAX_LEN, entry->name) >= (int) sizeof(path)) {
+            printf("Error: path %s too long, corrupted image?\n", path);
+            return -EINVAL;
+        }
+        const int is_dir = (entry->flags & IS_DIR) != 0;
+        build_entry* build = list_append(is_dir ? dirs : files);
+        if (build == NULL) {
+            return -ENOMEM;
+        }
+        build->origin = entry;
+        build->is_dir = is_dir;
+        strcpy(build->path, path);
+        /* The lists may be reallocated while browsing the subdirectory, don't use `build` after */
+        int err = 0;
+        if (!is_dir) {
+            err = read_chain(src, src_pages, build);
+        } else if (entry->start_page == 0 || entry->start_page >= src_pages ||
+                   (visited[entry->start_page / 8] >> (entry->start_page % 8)) & 1) {
+            err = -EINVAL;
+        } else {
+            visited[entry->start_page / 8] |= 1 << (entry->start_page % 8);
+            const ZealFileEntry* content = (ZealFileEntry*) (src + (entry->start_page << g_page_shift));
+            err = collect_directory(src, src_pages, content, DIR_MAX_ENTRIES, path, dirs, files,
+                                    visited);
+        }
+        if (err == -EINVAL) {
+            printf("Error: invalid content for %s, corrupted image?\n", path);
+        }
+        if (err) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Assign the counters of the hotness file to the files of the list.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int load_hotness(const char* hotness, build_list* files)
+{
+    char line[PATH_MAX + 64];
+    char path[PATH_MAX];
+    unsigned reads;
+    unsigned long bytes;
+
+    FILE* in = fopen(hotness, "r");
+    if (in == NULL) {
+        int err = -errno;
+        printf("Error: could not open %s: %s\n", hotness, strerror(-err));
+        return err;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "%u %lu %[^\n]", &reads, &bytes, path) != 3) {
+            continue;
+        }
+        for (int i = 0; i < files->count; i++) {
+            if (strcmp(files->entries[i].path, path) == 0) {
+                files->entries[i].reads = reads;
+                files->entries[i].bytes = bytes;
+                break;
+            }
+        }
+    }
+    fclose(in);
+    return 0;
+}
+
+
+/**
+ * @brief Order the files by decreasing number of reads, then bytes read, then position in the
+ *        former image.
+ */
+static int compare_hotness(const void* a, const void* b)
+{
+    const build_entry* first = a;
+    const build_entry* second = b;
+    if (first->reads != second->reads) {
+        return first->reads < second->reads ? 1 : -1;
+    }
+    if (first->bytes != second->bytes) {
+        return first->bytes < second->bytes ? 1 : -1;
+    }
+    return first->origin < second->origin ? -1 : first->origin > second->origin;
+}
+
+
+int relayout_image(const char* image, const char* hotness, const char* output)
+{
+    build_list dirs = { 0 };
+    build_list files = { 0 };
+    struct stat st;
+    uint8_t* src = NULL;
+
+    int fd = open(image, O_RDONLY);
+    int err = fd < 0 || fstat(fd, &st) != 0 ? -errno : 0;
+    if (err == 0 && (st.st_size < 256 || st.st_size > (256 << PAGE_ORDER_MAX) * 256)) {
+        err = -EINVAL;
+    }
+    if (err == 0) {
+        src = malloc(st.st_size);
+        if (src == NULL) {
+            err = -ENOMEM;
+        } else if (read(fd, src, st.st_size) != st.st_size) {
+            err = -EIO;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    const ZealFSHeader* header = (ZealFSHeader*) src;
+    if (err == 0 && (header->magic != 'Z' || header->page_order > PAGE_ORDER_MAX ||
+                     header->bitmap_size == 0 || header->bitmap_size > BITMAP_SIZE ||
+                     (header->bitmap_size * 8) << (header->page_order + 8) > st.st_size)) {
+        err = -EINVAL;
+    }
+    if (err) {
+        printf("Error: could not load image %s: %s\n", image, strerror(-err));
+        free(src);
+        return err;
+    }
+
+    /* The laid out image has the same geometry */
+    err = new_image((header->bitmap_size * 8) << (header->page_order + 8), 256 << header->page_order);
+    if (err == 0) {
+        uint8_t visited[BITMAP_SIZE] = { 0 };
+        err = collect_directory(src, header->bitmap_size * 8, header->entries, ROOT_MAX_ENTRIES, "",
+                                &dirs, &files, visited);
+    }
+    if (err == 0 && hotness) {
+        err = load_hotness(hotness, &files);
+    }
+    /* The directories are browsed on every lookup, place them first, then the hottest files */
+    if (err == 0) {
+        qsort(files.entries, files.count, sizeof(build_entry), compare_hotness);
+        err = place_entries(&dirs);
+    }
+    if (err == 0) {
+        err = place_entries(&files);
+    }
+    if (err == 0) {
+        err = save_image(output);
+    }
+    list_free(&dirs);
+    list_free(&files);
+    free(g_image);
+    g_image = NULL;
+    free(src);
+    return err;
+}
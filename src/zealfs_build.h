@@ -0,0 +1,51 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+/*
+ * An image can be built out of a manifest listing its content, one entry per line:
+ *
+ *     <path in the image> <source file> [pin=<page>] [contiguous]
+ *
+ * Empty lines and lines starting with '#' are ignored. A path ending with '/' designates a
+ * directory, its source must be '-'. The parent directories are created when needed.
+ *
+ * The files pinned to a page are stored first, in contiguous pages starting at that page, so
+ * that a boot loader can read them without following the chain. Then all the entries are
+ * stored in the order of the manifest, each one in the first free pages, so that the content
+ * is packed at the beginning of the image. A file marked `contiguous` is stored in the first
+ * free pages that are contiguous.
+ *
+ * An existing image can also be laid out again, with its most read files first, according to the
+ * hotness file saved by the driver with `--hotness`: one line per file, giving its number of
+ * reads, the number of bytes read, and its path.
+ */
+
+/**
+ * @brief Build an image out of a manifest. The image is only written once all the entries were
+ *        successfully placed.
+ *
+ * @param manifest Path of the manifest, the sources are relative to the current directory.
+ * @param image Path of the image to create, overwritten if it exists.
+ * @param size Size of the image in bytes.
+ * @param page_size Size of the pages of the image: 256, 512 or 1024.
+ *
+ * @return 0 on success, negative error code else. The error is described on the standard output.
+ */
+int build_image(const char* manifest, const char* image, int size, int page_size);
+
+/**
+ * @brief Lay out an image again: the directories are stored first, then the files, from the most
+ *        read to the least read, each one in contiguous pages. The entries are kept as-is, only
+ *        their pages change, packed files keep sharing the same pages.
+ *
+ * @param image Path of the image to lay out, with the same geometry.
+ * @param hotness Path of the hotness file, NULL to keep the files in the order of their entries.
+ * @param output Path of the new image, overwritten if it exists.
+ *
+ * @return 0 on success, negative error code else. The error is described on the standard output.
+ */
+int relayout_image(const char* image, const char* hotness, const char* output);
@@ -0,0 +1,272 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "zealfs_container.h"
+#include "zealfs_lz.h"
+
+/* Images are at most 64KB, and so are the chunks */
+#define IMAGE_MAX_SIZE      (UINT16_MAX + 1)
+
+int container_detect(const char* path)
+{
+    char magic[8];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    const int found = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                      memcmp(magic, CONTAINER_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return found;
+}
+
+
+int container_open(zealfs_container* container, const char* path, int writable)
+{
+    ZealContainerHeader* header = &container->header;
+    struct stat st;
+
+    memset(container, 0, sizeof(*container));
+    container->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (container->fd < 0) {
+        return -errno;
+    }
+    container->path = strdup(path);
+
+    int err = -EINVAL;
+    if (container->path == NULL) {
+        err = -ENOMEM;
+        goto error;
+    }
+    if (fstat(container->fd, &st) != 0 || st.st_size > UINT32_MAX ||
+        pread(container->fd, header, sizeof(*header), 0) != sizeof(*header) ||
+        memcmp(header->magic, CONTAINER_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CONTAINER_VERSION) {
+        goto error;
+    }
+    const int pages = header->size / 256;
+    if (header->size == 0 || header->size % 256 || header->size > IMAGE_MAX_SIZE ||
+        header->chunk_pages == 0 || header->chunk_pages * 256 > IMAGE_MAX_SIZE ||
+        header->chunks != (pages + header->chunk_pages - 1) / header->chunk_pages) {
+        goto error;
+    }
+
+    const size_t index_size = header->chunks * sizeof(ZealContainerChunk);
+    container->chunks = malloc(index_size);
+    if (container->chunks == NULL) {
+        err = -ENOMEM;
+        goto error;
+    }
+    if (pread(container->fd, container->chunks, index_size, sizeof(*header)) != (ssize_t) index_size) {
+        goto error;
+    }
+    container->end = st.st_size;
+    return 0;
+
+error:
+    free(container->chunks);
+    container->chunks = NULL;
+    free(container->path);
+    container->path = NULL;
+    close(container->fd);
+    container->fd = -1;
+    return err;
+}
+
+
+void container_close(zealfs_container* container)
+{
+    free(container->chunks);
+    container->chunks = NULL;
+    free(container->path);
+    container->path = NULL;
+    if (container->fd >= 0) {
+        close(container->fd);
+        container->fd = -1;
+    }
+}
+
+
+int container_read_chunk(const zealfs_container* container, int chunk, uint8_t* dst)
+{
+    const ZealContainerChunk* entry = &container->chunks[chunk];
+    const int length = container_chunk_length(container, chunk);
+    uint8_t stored[IMAGE_MAX_SIZE];
+
+    if (entry->size == 0) {
+        memset(dst, 0, length);
+        return 0;
+    }
+    if (entry->size > (uint32_t) length || (uint64_t) entry->offset + entry->size > container->end) {
+        return -EINVAL;
+    }
+    /* Chunks that don't compress are stored as-is */
+    uint8_t* buffer = entry->size == (uint32_t) length ? dst : stored;
+    if (pread(container->fd, buffer, entry->size, entry->offset) != (ssize_t) entry->size) {
+        return -EIO;
+    }
+    if (buffer == stored && lz_decompress(stored, entry->size, dst, length) != length) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Rewrite the container with only the current content of each chunk. The new file is
+ *        written next to the container, then replaces it and takes its file descriptor.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int container_rewrite(zealfs_container* container)
+{
+    const int chunks = container->header.chunks;
+    const size_t index_size = chunks * sizeof(ZealContainerChunk);
+    char tmp[PATH_MAX + 4];
+    uint8_t stored[IMAGE_MAX_SIZE];
+
+    ZealContainerChunk* index = malloc(index_size);
+    if (index == NULL) {
+        return -ENOMEM;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.new", container->path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(index);
+        return -errno;
+    }
+
+    int err = 0;
+    uint32_t end = sizeof(ZealContainerHeader) + index_size;
+    for (int i = 0; i < chunks && err == 0; i++) {
+        const ZealContainerChunk* entry = &container->chunks[i];
+        index[i] = (ZealContainerChunk) { .offset = entry->size ? end : 0, .size = entry->size };
+        if (entry->size > 0 &&
+            (pread(container->fd, stored, entry->size, entry->offset) != (ssize_t) entry->size ||
+             pwrite(fd, stored, entry->size, end) != (ssize_t) entry->size)) {
+            err = -EIO;
+        }
+        end += entry->size;
+    }
+    if (err == 0 &&
+        (pwrite(fd, &container->header, sizeof(ZealContainerHeader), 0) != sizeof(ZealContainerHeader) ||
+         pwrite(fd, index, index_size, sizeof(ZealContainerHeader)) != (ssize_t) index_size ||
+         fsync(fd) != 0)) {
+        err = -EIO;
+    }
+    /* The descriptor of the container may be used elsewhere, it designates the new file */
+    if (err == 0 && rename(tmp, container->path) != 0) {
+        err = -errno;
+    }
+    if (err == 0 && dup2(fd, container->fd) < 0) {
+        err = -errno;
+    }
+    if (err) {
+        unlink(tmp);
+    } else {
+        memcpy(container->chunks, index, index_size);
+        container->end = end;
+    }
+    close(fd);
+    free(index);
+    return err;
+}
+
+
+int container_write_chunk(zealfs_container* container, int chunk, const uint8_t* src)
+{
+    ZealContainerChunk* entry = &container->chunks[chunk];
+    const int length = container_chunk_length(container, chunk);
+    uint8_t stored[IMAGE_MAX_SIZE];
+    ZealContainerChunk updated = { 0 };
+
+    /* Keep the compressed content only if it is smaller than the original */
+    int size = lz_compress(src, length, stored, length - 1);
+    const uint8_t* content = stored;
+    if (size < 0) {
+        size = length;
+        content = src;
+    }
+    if (src[0] == 0 && memcmp(src, src + 1, length - 1) == 0) {
+        size = 0;
+    }
+
+    /* Append the new content, the entry keeps designating the former one until it is written */
+    updated.size = size;
+    if (size > 0) {
+        if ((uint64_t) container->end + size > UINT32_MAX) {
+            return -EFBIG;
+        }
+        updated.offset = container->end;
+        if (pwrite(container->fd, content, size, updated.offset) != size) {
+            return -EIO;
+        }
+        container->end += size;
+    }
+    const off_t index = sizeof(ZealContainerHeader) + chunk * sizeof(ZealContainerChunk);
+    if (pwrite(container->fd, &updated, sizeof(updated), index) != sizeof(updated)) {
+        return -EIO;
+    }
+    *entry = updated;
+
+    /* Reclaim the former contents once they take more room than an image */
+    if (container->path == NULL) {
+        return 0;
+    }
+    uint32_t used = sizeof(ZealContainerHeader) + container->header.chunks * sizeof(ZealContainerChunk);
+    for (int i = 0; i < container->header.chunks; i++) {
+        used += container->chunks[i].size;
+    }
+    return container->end - used > IMAGE_MAX_SIZE ? container_rewrite(container) : 0;
+}
+
+
+int container_create(const char* path, const uint8_t* image, int size, int chunk_pages)
+{
+    zealfs_container container = { .fd = -1 };
+    ZealContainerHeader* header = &container.header;
+    int err = 0;
+
+    if (size <= 0 || size % 256 || size > IMAGE_MAX_SIZE ||
+        chunk_pages <= 0 || chunk_pages * 256 > IMAGE_MAX_SIZE) {
+        return -EINVAL;
+    }
+    memcpy(header->magic, CONTAINER_MAGIC, sizeof(header->magic));
+    header->version = CONTAINER_VERSION;
+    header->size = size;
+    header->chunk_pages = chunk_pages;
+    header->chunks = (size / 256 + chunk_pages - 1) / chunk_pages;
+    container.end = sizeof(ZealContainerHeader) + header->chunks * sizeof(ZealContainerChunk);
+
+    container.chunks = calloc(header->chunks, sizeof(ZealContainerChunk));
+    container.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (container.chunks == NULL || container.fd < 0) {
+        err = container.chunks ? -errno : -ENOMEM;
+        goto end;
+    }
+    if (ftruncate(container.fd, container.end) != 0) {
+        err = -errno;
+        goto end;
+    }
+    for (int i = 0; i < header->chunks && err == 0; i++) {
+        err = container_write_chunk(&container, i, image + i * chunk_pages * 256);
+    }
+    /* Write the header last, the file is not a valid container until then */
+    if (err == 0 && pwrite(container.fd, header, sizeof(*header), 0) != sizeof(*header)) {
+        err = -EIO;
+    }
+
+end:
+    container_close(&container);
+    return err;
+}
@@ -0,0 +1,122 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A container holds a single disk image in compressed form. The image is split into chunks of
+ * `chunk_pages` pages, each compressed independently with the LZ codec, so that any chunk can be
+ * read without the others. The file starts with a header, followed by the index of the chunks,
+ * followed by the content of the chunks, in any order.
+ *
+ * A chunk whose stored size equals its uncompressed size is stored as-is, a chunk of size 0 only
+ * contains zeros and is not stored at all. When a chunk is rewritten, it is appended to the file
+ * and only then its index entry is updated, so the entry always designates a complete chunk. The
+ * space of the former contents is reclaimed by rewriting the whole container once it exceeds the
+ * size of an image, see `container_write_chunk`. All the fields are little-endian.
+ */
+#define CONTAINER_MAGIC         "ZEALCIMG"
+#define CONTAINER_VERSION       1
+#define CONTAINER_CHUNK_PAGES   16
+
+typedef struct {
+    /* Must be CONTAINER_MAGIC, without the NULL-terminator */
+    char magic[8];
+    uint32_t version;
+    /* Size of the image in bytes, multiple of 256 */
+    uint32_t size;
+    /* Number of pages per chunk, the last chunk can be smaller */
+    uint16_t chunk_pages;
+    /* Number of chunks, the index follows the header */
+    uint16_t chunks;
+    uint8_t reserved[12];
+} __attribute__((packed)) ZealContainerHeader;
+
+_Static_assert(sizeof(ZealContainerHeader) == 32, "ZealContainerHeader must be 32 bytes big");
+
+typedef struct {
+    /* Offset of the chunk content in the file */
+    uint32_t offset;
+    /* Size of the stored content */
+    uint32_t size;
+} __attribute__((packed)) ZealContainerChunk;
+
+/* Opened container, its index is loaded in memory */
+typedef struct {
+    int fd;
+    /* Path of the file, to rewrite it, NULL while it is created */
+    char* path;
+    ZealContainerHeader header;
+    ZealContainerChunk* chunks;
+    /* End of the file, where the chunks that grew are appended */
+    uint32_t end;
+} zealfs_container;
+
+
+/**
+ * @brief Check whether a file is a container.
+ *
+ * @return 1 if the file starts with CONTAINER_MAGIC, 0 else.
+ */
+int container_detect(const char* path);
+
+/**
+ * @brief Open a container and load its index.
+ *
+ * @param container Container to initialize.
+ * @param path Path of the container file.
+ * @param writable 1 to open the container for reading and writing, 0 for reading only.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int container_open(zealfs_container* container, const char* path, int writable);
+
+/**
+ * @brief Close a container.
+ */
+void container_close(zealfs_container* container);
+
+/**
+ * @brief Get the uncompressed size of a chunk, in bytes.
+ */
+static inline int container_chunk_length(const zealfs_container* container, int chunk) {
+    const int length = container->header.chunk_pages * 256;
+    const int remaining = container->header.size - chunk * length;
+    return remaining < length ? remaining : length;
+}
+
+/**
+ * @brief Read and decompress a chunk.
+ *
+ * @param dst Buffer of `container_chunk_length` bytes.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int container_read_chunk(const zealfs_container* container, int chunk, uint8_t* dst);
+
+/**
+ * @brief Compress and write a chunk, its index entry is updated. When the former contents of the
+ *        chunks take more room than an image, the container is rewritten without them and
+ *        replaces the former file, under the same file descriptor.
+ *
+ * @param src Content of the chunk, `container_chunk_length` bytes.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int container_write_chunk(zealfs_container* container, int chunk, const uint8_t* src);
+
+/**
+ * @brief Create a container out of an image.
+ *
+ * @param path Path of the container to create, overwritten if it exists.
+ * @param image Content of the image.
+ * @param size Size of the image, must be a multiple of 256.
+ * @param chunk_pages Number of pages per chunk.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int container_create(const char* path, const uint8_t* image, int size, int chunk_pages);
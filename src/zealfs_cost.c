@@ -0,0 +1,299 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdarg.h>
+#include <pthread.h>
+#include "zealfs_cost.h"
+
+__thread uint32_t t_op_hops;
+__thread uint32_t t_op_allocs;
+__thread uint8_t t_op_written[32];
+__thread uint64_t t_op_phase_ns[COST_PHASES];
+__thread int t_op_phase = COST_PHASES;
+__thread uint64_t t_op_phase_start;
+
+uint32_t cost_slow_us;
+
+/* List of the operations that completed at least once */
+static _Atomic(op_cost*) s_costs;
+
+/* Changed when an image is resized, while the operations check them */
+static _Atomic uint32_t s_max_hops = UINT32_MAX;
+static _Atomic uint32_t s_max_us = DEFAULT_COST_MAX_US;
+
+/* Number of entries queued for the log of the slow operations, a power of two. The operations
+ * never wait for the log to be written, the entries that don't fit are dropped. */
+#define SLOW_QUEUE_SIZE 256
+/* Longest description of the arguments of an operation, longer ones are truncated */
+#define SLOW_ARGS_LEN   256
+
+static const char* const s_phase_names[COST_PHASES] = {
+    "lookup", "walk", "alloc", "copy", "flush",
+};
+
+/* Entry of the log of the slow operations */
+typedef struct {
+    const char* name;
+    struct timespec time;
+    uint64_t us;
+    uint32_t phase_us[COST_PHASES];
+    char args[SLOW_ARGS_LEN];
+} slow_entry;
+
+/* Slot of the queue, its sequence number tells whether it is free or filled, see `slow_push` */
+typedef struct {
+    atomic_uint_fast64_t seq;
+    slow_entry entry;
+} slow_slot;
+
+static struct {
+    slow_slot slots[SLOW_QUEUE_SIZE];
+    /* Next slot to fill by the operations, and next slot to write by the thread */
+    atomic_uint_fast64_t head;
+    uint64_t tail;
+    atomic_uint_fast64_t dropped;
+    FILE* out;
+    pthread_t thread;
+    atomic_int stop;
+} s_slow;
+
+/* Arguments of the operation running on the current thread, see `cost_args` */
+static __thread char t_op_args[SLOW_ARGS_LEN];
+
+
+void cost_init(uint32_t max_hops, uint32_t max_us)
+{
+    s_max_hops = max_hops;
+    s_max_us = max_us;
+}
+
+
+/**
+ * @brief Atomically raise a maximum.
+ *
+ * @return 1 if `value` is the new maximum, 0 else.
+ */
+static int atomic_raise(atomic_uint_fast64_t* max, uint64_t value)
+{
+    uint_fast64_t current = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > current) {
+        if (atomic_compare_exchange_weak_explicit(max, &current, value,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Queue an entry for the log of the slow operations, without ever waiting: several
+ *        operations can complete at once, each one takes a slot by moving the head, and the
+ *        slot is marked as filled once written. The entry is dropped if the queue is full.
+ */
+static void slow_push(const char* name, uint64_t us)
+{
+    uint_fast64_t pos = atomic_load_explicit(&s_slow.head, memory_order_relaxed);
+    slow_slot* slot;
+    for (;;) {
+        slot = &s_slow.slots[pos % SLOW_QUEUE_SIZE];
+        const uint_fast64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        const int64_t diff = (int64_t) (seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&s_slow.head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&s_slow.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&s_slow.head, memory_order_relaxed);
+        }
+    }
+
+    slow_entry* entry = &slot->entry;
+    entry->name = name;
+    clock_gettime(CLOCK_REALTIME, &entry->time);
+    entry->us = us;
+    for (int i = 0; i < COST_PHASES; i++) {
+        entry->phase_us[i] = t_op_phase_ns[i] / 1000;
+    }
+    memcpy(entry->args, t_op_args, SLOW_ARGS_LEN);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+
+/**
+ * @brief Write the entries queued for the log of the slow operations.
+ *
+ * @return Number of entries written.
+ */
+static int slow_drain(void)
+{
+    int count = 0;
+    for (;;) {
+        slow_slot* slot = &s_slow.slots[s_slow.tail % SLOW_QUEUE_SIZE];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != s_slow.tail + 1) {
+            break;
+        }
+        const slow_entry* entry = &slot->entry;
+        char date[32];
+        struct tm tm;
+        localtime_r(&entry->time.tv_sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+        fprintf(s_slow.out, "%s.%03ld %s %luus", date, entry->time.tv_nsec / 1000000, entry->name,
+                (unsigned long) entry->us);
+        for (int i = 0; i < COST_PHASES; i++) {
+            fprintf(s_slow.out, " %s=%u", s_phase_names[i], entry->phase_us[i]);
+        }
+        fprintf(s_slow.out, " %s\n", entry->args);
+        /* The slot can be filled again */
+        atomic_store_explicit(&slot->seq, s_slow.tail + SLOW_QUEUE_SIZE, memory_order_release);
+        s_slow.tail++;
+        count++;
+    }
+    const uint_fast64_t dropped = atomic_exchange(&s_slow.dropped, 0);
+    if (dropped) {
+        fprintf(s_slow.out, "%lu slow operations were not logged, the queue was full\n",
+                (unsigned long) dropped);
+    }
+    if (count || dropped) {
+        fflush(s_slow.out);
+    }
+    return count;
+}
+
+
+/**
+ * @brief Body of the thread writing the log of the slow operations. The operations don't signal
+ *        it, so that they never wait for it, it checks the queue periodically instead.
+ */
+static void* slow_run(void* arg)
+{
+    (void) arg;
+    const struct timespec period = { .tv_sec = 0, .tv_nsec = 50 * 1000000 };
+    while (!atomic_load(&s_slow.stop)) {
+        if (slow_drain() == 0) {
+            nanosleep(&period, NULL);
+        }
+    }
+    slow_drain();
+    return NULL;
+}
+
+
+int cost_slow_log_start(FILE* out, uint32_t threshold_us)
+{
+    for (uint64_t i = 0; i < SLOW_QUEUE_SIZE; i++) {
+        atomic_init(&s_slow.slots[i].seq, i);
+    }
+    s_slow.out = out;
+    atomic_store(&s_slow.stop, 0);
+    if (pthread_create(&s_slow.thread, NULL, slow_run, NULL) != 0) {
+        return -1;
+    }
+    /* At least 1, 0 means not logging */
+    cost_slow_us = threshold_us ? threshold_us : 1;
+    return 0;
+}
+
+
+void cost_slow_log_stop(void)
+{
+    if (s_slow.out == NULL) {
+        return;
+    }
+    cost_slow_us = 0;
+    atomic_store(&s_slow.stop, 1);
+    pthread_join(s_slow.thread, NULL);
+    fclose(s_slow.out);
+    s_slow.out = NULL;
+}
+
+
+void cost_args(const char* fmt, ...)
+{
+    if (cost_slow_us == 0) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(t_op_args, sizeof(t_op_args), fmt, ap);
+    va_end(ap);
+}
+
+
+void cost_end(op_cost_scope* scope)
+{
+    op_cost* cost = scope->cost;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const uint64_t us = (end.tv_sec - scope->start.tv_sec) * 1000000ull
+                      + (end.tv_nsec - scope->start.tv_nsec) / 1000;
+    const uint32_t hops = t_op_hops;
+    const uint32_t allocs = t_op_allocs;
+    uint32_t written = 0;
+    for (int i = 0; i < (int) sizeof(t_op_written); i++) {
+        written += __builtin_popcount(t_op_written[i]);
+    }
+
+    if (atomic_exchange(&cost->registered, 1) == 0) {
+        cost->next = atomic_load(&s_costs);
+        while (!atomic_compare_exchange_weak(&s_costs, &cost->next, cost)) {
+        }
+    }
+
+    atomic_fetch_add_explicit(&cost->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cost->total_hops, hops, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cost->total_us, us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cost->total_allocs, allocs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cost->total_written, written, memory_order_relaxed);
+    atomic_raise(&cost->max_allocs, allocs);
+    atomic_raise(&cost->max_written, written);
+    const int worst = atomic_raise(&cost->max_hops, hops) | atomic_raise(&cost->max_us, us);
+
+    /* The time waiting for the volume is not part of the cost, but it is part of the delay */
+    const uint32_t slow_us = cost_slow_us;
+    if (slow_us) {
+        const uint64_t delay = us + t_op_phase_ns[COST_FLUSH] / 1000;
+        if (delay > slow_us) {
+            slow_push(cost->name, delay);
+        }
+        t_op_args[0] = 0;
+    }
+
+    if (hops > s_max_hops || us > s_max_us) {
+        atomic_fetch_add_explicit(&cost->over_bound, 1, memory_order_relaxed);
+        /* Only report the operations that are worse than all the previous ones */
+        if (worst) {
+            fprintf(stderr, "Warning: %s followed %u pages and took %luus\n",
+                    cost->name, hops, (unsigned long) us);
+        }
+    }
+}
+
+
+const op_cost* cost_list(void)
+{
+    return atomic_load(&s_costs);
+}
+
+
+void cost_print_stats(FILE* out)
+{
+    for (op_cost* cost = atomic_load(&s_costs); cost != NULL; cost = cost->next) {
+        fprintf(out, "op.%s.count %lu\n", cost->name, (unsigned long) cost->count);
+        fprintf(out, "op.%s.over_bound %lu\n", cost->name, (unsigned long) cost->over_bound);
+        fprintf(out, "op.%s.total_hops %lu\n", cost->name, (unsigned long) cost->total_hops);
+        fprintf(out, "op.%s.max_hops %lu\n", cost->name, (unsigned long) cost->max_hops);
+        fprintf(out, "op.%s.total_allocs %lu\n", cost->name, (unsigned long) cost->total_allocs);
+        fprintf(out, "op.%s.max_allocs %lu\n", cost->name, (unsigned long) cost->max_allocs);
+        fprintf(out, "op.%s.total_written %lu\n", cost->name, (unsigned long) cost->total_written);
+        fprintf(out, "op.%s.max_written %lu\n", cost->name, (unsigned long) cost->max_written);
+        fprintf(out, "op.%s.total_us %lu\n", cost->name, (unsigned long) cost->total_us);
+        fprintf(out, "op.%s.max_us %lu\n", cost->name, (unsigned long) cost->max_us);
+    }
+}
@@ -0,0 +1,205 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <string.h>
+
+/* Default maximum time, in microseconds, an operation is expected to take */
+#ifndef DEFAULT_COST_MAX_US
+#define DEFAULT_COST_MAX_US 10000
+#endif
+
+/* Cost of one kind of operation, there is one such structure per operation implementation.
+ * They are registered the first time the operation completes. */
+typedef struct op_cost {
+    const char* name;
+    struct op_cost* next;
+    atomic_int registered;
+    /* Number of operations completed, and those which exceeded the bounds */
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t over_bound;
+    /* Pages followed, pages allocated, pages written and time spent, in total and for the worst
+     * operation */
+    atomic_uint_fast64_t total_hops;
+    atomic_uint_fast64_t max_hops;
+    atomic_uint_fast64_t total_allocs;
+    atomic_uint_fast64_t max_allocs;
+    atomic_uint_fast64_t total_written;
+    atomic_uint_fast64_t max_written;
+    atomic_uint_fast64_t total_us;
+    atomic_uint_fast64_t max_us;
+} op_cost;
+
+/* Phases of an operation, the time spent in each of them is given in the log of the slow
+ * operations */
+typedef enum {
+    /* Looking up the path in the directories */
+    COST_LOOKUP,
+    /* Following a chain of pages up to an offset */
+    COST_WALK,
+    /* Allocating, or releasing, the pages and slots of a file */
+    COST_ALLOC,
+    /* Copying the content of a file */
+    COST_COPY,
+    /* Waiting for the volume, locked while the modified pages are written, or by other writers */
+    COST_FLUSH,
+    COST_PHASES,
+} cost_phase;
+
+/* Number of pages followed and allocated by the operation running on the current thread */
+extern __thread uint32_t t_op_hops;
+extern __thread uint32_t t_op_allocs;
+/* Bitmap of the pages written by the operation running on the current thread */
+extern __thread uint8_t t_op_written[32];
+/* Time spent in each phase by the operation running on the current thread, in nanoseconds, the
+ * phase it is in, COST_PHASES if none, and since when. Only measured when logging. */
+extern __thread uint64_t t_op_phase_ns[COST_PHASES];
+extern __thread int t_op_phase;
+extern __thread uint64_t t_op_phase_start;
+
+/* Time, in microseconds, above which the operations are logged, 0 when they are not */
+extern uint32_t cost_slow_us;
+
+
+/**
+ * @brief Set the bounds above which an operation is reported.
+ *
+ * @param max_hops Maximum number of pages an operation can follow.
+ * @param max_us Maximum time, in microseconds, an operation can take.
+ */
+void cost_init(uint32_t max_hops, uint32_t max_us);
+
+/**
+ * @brief Print the cost of the operations, one `key value` pair per line.
+ */
+void cost_print_stats(FILE* out);
+
+/**
+ * @brief Get the costs of the operations completed at least once, linked by their `next` field.
+ */
+const op_cost* cost_list(void);
+
+/**
+ * @brief Start logging the operations taking longer than a threshold, with the time spent in each
+ *        phase. The operations only queue their entry, a background thread writes them.
+ *
+ * @param out File to write the entries to, closed by `cost_slow_log_stop`.
+ * @param threshold_us Time above which an operation is logged, in microseconds.
+ *
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int cost_slow_log_start(FILE* out, uint32_t threshold_us);
+
+/**
+ * @brief Write the entries still queued and stop logging the slow operations.
+ */
+void cost_slow_log_stop(void);
+
+/**
+ * @brief Describe the arguments of the operation running on the current thread, such as its path,
+ *        for its entry in the log of the slow operations. Nothing is done when not logging.
+ */
+void cost_args(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+
+typedef struct {
+    op_cost* cost;
+    struct timespec start;
+} op_cost_scope;
+
+/**
+ * @brief Start measuring an operation on the current thread.
+ */
+static inline void cost_begin(op_cost_scope* scope) {
+    t_op_hops = 0;
+    t_op_allocs = 0;
+    memset(t_op_written, 0, sizeof(t_op_written));
+    if (cost_slow_us) {
+        memset(t_op_phase_ns, 0, sizeof(t_op_phase_ns));
+        t_op_phase = COST_PHASES;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &scope->start);
+}
+
+/**
+ * @brief Get the time used to measure the phases, in nanoseconds, 0 when not logging.
+ */
+static inline uint64_t cost_clock(void) {
+    if (cost_slow_us == 0) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * @brief Account the time waited for the volume since `start`, given by `cost_clock`.
+ */
+static inline void cost_waited(uint64_t start) {
+    if (start) {
+        t_op_phase_ns[COST_FLUSH] += cost_clock() - start;
+    }
+}
+
+/**
+ * @brief Enter a phase, the time is accounted to the phase the operation was in until now.
+ *
+ * @return Phase to go back to, -1 when not logging.
+ */
+static inline int cost_phase_enter(int phase) {
+    const uint64_t now = cost_clock();
+    if (now == 0) {
+        return -1;
+    }
+    if (t_op_phase < COST_PHASES) {
+        t_op_phase_ns[t_op_phase] += now - t_op_phase_start;
+    }
+    const int previous = t_op_phase;
+    t_op_phase = phase;
+    t_op_phase_start = now;
+    return previous;
+}
+
+/**
+ * @brief Leave the current phase, to use with `__attribute__((cleanup))`.
+ */
+static inline void cost_phase_leave(int* previous) {
+    if (*previous < 0) {
+        return;
+    }
+    const uint64_t now = cost_clock();
+    t_op_phase_ns[t_op_phase] += now - t_op_phase_start;
+    t_op_phase = *previous;
+    t_op_phase_start = now;
+}
+
+/**
+ * @brief Account a page written by the operation running on the current thread.
+ */
+static inline void cost_write(int page) {
+    t_op_written[page / 8] |= 1 << (page % 8);
+}
+
+/**
+ * @brief Account the cost of the operation measured by `scope`, to use with `__attribute__((cleanup))`.
+ */
+void cost_end(op_cost_scope* scope);
+
+/* Measure the operation until the end of the current scope, accounted under the function name */
+#define OP_COST_SCOPE() \
+    static op_cost _op_cost = { .name = __func__ }; \
+    op_cost_scope _op_cost_scope __attribute__((cleanup(cost_end))) = { .cost = &_op_cost }; \
+    cost_begin(&_op_cost_scope)
+
+/* Account the time until the end of the current scope to a phase of the operation. Nested
+ * phases are not accounted to the outer ones. */
+#define COST_PHASE_SCOPE(phase) \
+    int _cost_phase __attribute__((cleanup(cost_phase_leave))) = cost_phase_enter(phase)
@@ -0,0 +1,201 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * API to embed the file system in another program, such as an emulator servicing the file
+ * syscalls of Zeal 8-bit OS directly against a disk image. Files and directories are designated
+ * by handles, and all the data goes through buffers provided by the caller: reading, writing,
+ * seeking and browsing a directory never allocate memory.
+ *
+ * The functions are meant to be called from a single thread, except from the callbacks described
+ * below. They return a negative error code on failure, as the FUSE operations do.
+ *
+ * Reading or writing may have to wait for the image to be loaded, when it is compressed, or for
+ * another user of the volume, such as the page server. The asynchronous variants never wait:
+ * they return -EWOULDBLOCK instead, the operation is then carried out by a background thread
+ * and the result is given to a callback. A handle cannot be used until its pending operation
+ * completes.
+ *
+ * The callbacks run on the background thread, concurrently with the caller's thread. From a
+ * callback, only `zealfs_embed_read`, `zealfs_embed_write`, `zealfs_embed_seek` and their
+ * asynchronous variants can be called, and only on the handle given to the callback, which the
+ * caller's thread must not use meanwhile. The other functions, opening and closing in particular,
+ * modify the table of the handles or wait for the background thread: they must not be called from
+ * a callback.
+ */
+#define ZEALFS_EMBED_HANDLES    16
+#define ZEALFS_EMBED_NAME_LEN   16
+
+/* Entry of a directory, returned by `zealfs_embed_readdir` */
+typedef struct {
+    /* NULL-terminated name of the entry */
+    char name[ZEALFS_EMBED_NAME_LEN + 1];
+    uint8_t is_dir;
+    /* Size of the file in bytes, 0 for a directory */
+    uint32_t size;
+} zealfs_embed_dirent;
+
+/**
+ * @brief Function called, from the background thread, when an asynchronous operation completes.
+ *        See above for the functions it can call.
+ *
+ * @param handle Handle of the file the operation was issued on.
+ * @param result Number of bytes transferred, negative error code on failure.
+ * @param arg Argument given when issuing the operation.
+ */
+typedef void (*zealfs_embed_cb)(int handle, int result, void* arg);
+
+
+/**
+ * @brief Open a disk image, it is created and formatted if it doesn't exist. Only one image can
+ *        be opened at a time.
+ *
+ * @param image Path of the image file, it can be a compressed image.
+ * @param size_kb Size of the image to create, in KB, at most 64.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int zealfs_embed_mount(const char* image, int size_kb);
+
+/* Options of an image, see `zealfs_embed_mount_options` */
+typedef struct {
+    /* Size of the pages of a new image: 256, 512 or 1024 bytes, 0 for 256. The size of an
+     * existing image is given by its header. */
+    int page_size;
+    /* Pack the new small files together in shared pages, only with 256-byte pages */
+    int pack;
+    /* Compress the files written, when it saves space */
+    int compress;
+} zealfs_embed_options;
+
+/**
+ * @brief Same as `zealfs_embed_mount`, with options. The image can be bigger when its pages
+ *        are: it has at most 256 pages.
+ *
+ * @param opts Options of the image, NULL for the default ones.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int zealfs_embed_mount_options(const char* image, int size_kb, const zealfs_embed_options* opts);
+
+/**
+ * @brief Close all the handles, wait for the pending operations and flush the image.
+ */
+void zealfs_embed_unmount(void);
+
+/**
+ * @brief Open a file.
+ *
+ * @param flags O_RDONLY, O_WRONLY or O_RDWR, optionally with O_CREAT and O_TRUNC.
+ *
+ * @return Handle of the file on success, negative error code else. -EMFILE if all the
+ *         ZEALFS_EMBED_HANDLES handles are used.
+ */
+int zealfs_embed_open(const char* path, int flags);
+
+/**
+ * @brief Open a directory.
+ *
+ * @return Handle of the directory on success, negative error code else.
+ */
+int zealfs_embed_opendir(const char* path);
+
+/**
+ * @brief Close a file or a directory. The content of a file is stored if needed.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int zealfs_embed_close(int handle);
+
+/**
+ * @brief Read from a file at its current position, which is then advanced.
+ *
+ * @return Number of bytes read, 0 at the end of the file, negative error code else.
+ */
+int zealfs_embed_read(int handle, void* buf, int size);
+
+/**
+ * @brief Write to a file at its current position, which is then advanced.
+ *
+ * @return Number of bytes written, negative error code else.
+ */
+int zealfs_embed_write(int handle, const void* buf, int size);
+
+/**
+ * @brief Change the current position of a file.
+ *
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END.
+ *
+ * @return New position on success, negative error code else.
+ */
+int zealfs_embed_seek(int handle, int offset, int whence);
+
+/**
+ * @brief Get the next entry of a directory.
+ *
+ * @return 1 if `dirent` was filled, 0 at the end of the directory, negative error code else.
+ */
+int zealfs_embed_readdir(int handle, zealfs_embed_dirent* dirent);
+
+/**
+ * @brief Asynchronous variants of `zealfs_embed_read` and `zealfs_embed_write`. When the
+ *        operation can be done without waiting, it is done immediately and `callback` is not
+ *        called. Else, -EWOULDBLOCK is returned and `callback` is called once it completes,
+ *        `buf` must remain valid until then. `callback` can be NULL when the result is not
+ *        needed: the handle can be used again once the operation completed, -EBUSY is returned
+ *        until then.
+ *
+ * @return Same as the synchronous variants, or -EWOULDBLOCK. -EBUSY if an operation is already
+ *         pending on the handle.
+ */
+int zealfs_embed_read_async(int handle, void* buf, int size, zealfs_embed_cb callback, void* arg);
+int zealfs_embed_write_async(int handle, const void* buf, int size, zealfs_embed_cb callback, void* arg);
+
+/**
+ * @brief Create an empty directory.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int zealfs_embed_mkdir(const char* path);
+
+/**
+ * @brief Remove an empty directory.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int zealfs_embed_rmdir(const char* path);
+
+/**
+ * @brief Remove a file.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int zealfs_embed_unlink(const char* path);
+
+/**
+ * @brief Rename or move a file or a directory, the file `to` is replaced if it exists.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int zealfs_embed_rename(const char* from, const char* to);
+
+/**
+ * @brief Change the size of a file, it is extended with zeros.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int zealfs_embed_truncate(const char* path, int size);
+
+/**
+ * @brief Check the integrity of the image, as done when mounting it.
+ *
+ * @return Number of pages allocated but used by no file or directory, -EIO if the image is
+ *         corrupted.
+ */
+int zealfs_embed_check(void);
@@ -3,10 +3,17 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
-#define FUSE_USE_VERSION 31
+/* The Makefile selects the most recent API supported by the installed libfuse */
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 32
+#endif
+
+/* For CPU affinity functions */
+#define _GNU_SOURCE
 
 #include <libgen.h>
 #include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -18,28 +25,295 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdint.h>
+#include <limits.h>
 #include <time.h>
 #include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <poll.h>
 /* For RENAME_* macros  */
 #include <linux/fs.h>
 #include "zealfs.h"
+#include "zealfs_lz.h"
+#include "zealfs_volume.h"
+#include "zealfs_server.h"
+#include "zealfs_sched.h"
+#include "zealfs_cost.h"
+#include "zealfs_archive.h"
+#include "zealfs_store.h"
+#include "zealfs_container.h"
+#include "zealfs_embed.h"
+#include "zealfs_ioctl.h"
+
+/* Archive containing the image, when mounted with --archive, and the entry of the image */
+static zealfs_archive g_archive = { .fd = -1 };
+static const ZealArchiveEntry* g_archive_entry;
+
+/* Store containing the image, when mounted with --store, and the stored pages of the image */
+static zealfs_store g_store = { .lock_fd = -1, .pages_fd = -1 };
+static store_image g_store_image;
+
+/* Container of the image, when the image file is compressed, its chunks are loaded on demand */
+static zealfs_container g_container = { .fd = -1 };
+
+/**
+ * Data stored in a page of a chain, the first byte being the number of the next page.
+ */
+#define PAGE_PAYLOAD    (PAGE_BYTES - 1)
+
+/**
+ * Macro to help converting a page number into an address in the cache. The page is loaded first
+ * when the image is compressed.
+ */
+#define CONTENT_FROM_PAGE(page) ( volume_page(&g_volume, (int) (page)) )
+
+/**
+ * Macro to mark the page containing the given cache address as modified, and account it to the
+ * current operation.
+ */
+#define MARK_DIRTY(ptr) do { \
+        cost_write(PTR_TO_IDX(ptr) >> g_page_shift); \
+        volume_mark_dirty(&g_volume, PTR_TO_IDX(ptr) >> g_page_shift); \
+    } while (0)
+
+/**
+ * Number of pages in the image, no chain of pages can be longer than that.
+ */
+#define IMAGE_PAGES     (g_volume.size >> g_page_shift)
+
+/**
+ * Each FUSE operation starts with one of these macros. The worker thread is prepared, the
+ * request waits for the scheduler to admit it according to its class, and the volume is
+ * locked, for reading or writing, until the operation returns. The cost of the operation,
+ * once admitted, is accounted under the name of the function, the time waited for the volume
+ * is only part of its entry in the log of the slow operations.
+ */
+#define BEGIN_READ_OP(cls)  worker_setup(); SCHED_SCOPE(&g_sched, cls); \
+                            const uint64_t _lock_start = cost_clock(); VOLUME_READ_LOCK(&g_volume); \
+                            OP_COST_SCOPE(); cost_waited(_lock_start)
+#define BEGIN_WRITE_OP(cls) worker_setup(); SCHED_SCOPE(&g_sched, cls); \
+                            const uint64_t _lock_start = cost_clock(); VOLUME_WRITE_LOCK(&g_volume); \
+                            OP_COST_SCOPE(); cost_waited(_lock_start)
+
+/* Directory containing the virtual files, which give access to the internal state of the file
+ * system. It is not listed in the root directory and cannot be created in the disk image. */
+#define VIRTUAL_DIR     "/.zealfs"
+
+/* Content of an opened virtual file, generated when the file is opened. The change feed is
+ * generated while it is read instead, one event at a time. */
+typedef struct virtual_file {
+    char* data;
+    size_t size;
+    /* Change feed only: position in the event being read, sequence number of the next event to
+     * read, poll handle to notify when an event is recorded, and next opened feed */
+    int feed;
+    size_t pos;
+    unsigned long seq;
+    struct fuse_pollhandle* poll;
+    struct virtual_file* next;
+} virtual_file;
+
+/* Number of events kept in the change feed, a reader that falls behind misses the older ones */
+#define CHANGES_MAX     1024
+/* Bytes kept for the paths of the events, in a ring: an event whose path is overwritten is
+ * dropped, as if the event itself was */
+#define CHANGES_PATHS_SIZE  (64 * 1024)
+/* Readers of the change feed waiting for an event, each one holds a worker thread. The others
+ * get -EAGAIN, as with O_NONBLOCK, and wait with poll. */
+#define CHANGES_WAITERS_MAX 4
+
+/* Modification of an entry or of the content of a file, see `change_record` */
+typedef struct {
+    unsigned long seq;
+    const char* op;
+    /* New size of the file or directory, 0 once removed */
+    int size;
+    /* Bitmap of the pages written by the modification */
+    uint8_t pages[BITMAP_SIZE];
+    /* Position of the path in the ring of the paths, counted from the first path ever recorded,
+     * and its length. Recording an event never allocates memory. */
+    unsigned long path_start;
+    int path_len;
+} change_event;
+
+/* Decompressed content of an opened file, shared by all the opens of that file. Compressed files
+ * are always accessed through it, as well as the files opened for writing when compression is
+ * enabled. The content is compressed back when the file is flushed. */
+typedef struct zealfs_cache {
+    ZealFileEntry* entry;
+    int refs;
+    int dirty;
+    int size;
+    struct zealfs_cache* next;
+    uint8_t data[UINT16_MAX];
+} zealfs_cache;
+
+/* Opened regular file, designated by the handle given to FUSE. The entry of the file moves when
+ * it is renamed to another directory and is cleared when the file is removed, so the handles of
+ * the partition are kept in a list to follow it, see `open_follow`. */
+typedef struct open_file {
+    /* Entry of the file, NULL once the file is removed */
+    ZealFileEntry* entry;
+    /* Cache referenced by this open, released when the file is closed, NULL if none was taken */
+    zealfs_cache* cache;
+    /* Content of a virtual file, which is not in the list */
+    struct virtual_file* virtual;
+    /* Path of a file opened with the embedding API, which gives it to the operations, kept up to
+     * date on renames, see `open_rename`. NULL for FUSE, which gives the path on each operation. */
+    char* path;
+    struct open_file* prev;
+    struct open_file* next;
+} open_file;
+
+/* Number of reads of a file, and bytes read, since it was created. Used to place the most read
+ * files first when the image is laid out again, see `zealfs-tool relayout`. */
+typedef struct {
+    atomic_uint reads;
+    atomic_ulong bytes;
+} file_hotness;
+
+#define HOTNESS_OF(entry)   (&g_hotness[PTR_TO_IDX(entry) / sizeof(ZealFileEntry)])
+
+/* Hash of the content of a file, given by the `user.zealfs.hash` extended attribute. It is
+ * computed on the first request and kept until the file is modified, 0 when not computed. */
+#define DIGEST_OF(entry)    (&g_digests[PTR_TO_IDX(entry) / sizeof(ZealFileEntry)])
+
+/* Extended attributes of the files, the pages are also given for the directories */
+#define XATTR_HASH      "user.zealfs.hash"
+#define XATTR_PAGES     "user.zealfs.pages"
+
+/* An image file can contain several volumes back to back, the partitions, when mounted with
+ * --partitions. Each one has its own header, geometry and cache, and is mounted on its own mount
+ * point, served by its own worker threads. */
+#define PARTITIONS_MAX  16
 
-/* File descriptor for the opened image */
-static int g_fimg;
+/* State of a mounted volume */
+typedef struct {
+    /* Opened image and its cache, shared with the page server */
+    zealfs_volume volume;
+    /* Scheduler of the requests received on the mount point */
+    zealfs_sched sched;
+    /* Cache for the image, as the disk image is at most 256KB, we can allocate it from
+     * the heap without a problem. Alias of the volume's cache. */
+    uint8_t* image;
+    /* Pages of the image are (1 << page_shift) bytes big, given by the header, see PAGE_BYTES */
+    int page_shift;
+    /* List of the caches of opened files */
+    zealfs_cache* caches;
+    /* List of the opened regular files */
+    open_file* open_files;
+    /* Hotness of the files, indexed by the position of their entry in the image */
+    file_hotness* hotness;
+    /* Hash of the content of the files, indexed like the hotness, see DIGEST_OF */
+    atomic_ulong* digests;
+    /* Number of opened files and directories, other than the root directory. Their handles
+     * designate content of the cache, the directories cannot be moved while it is not 0. */
+    atomic_int open_handles;
+    /* Position and size of the volume in the image file, for partitions */
+    off_t offset;
+    int size;
+    /* Instance serving the mount point, NULL while not mounted */
+    struct fuse* fuse;
+    /* Incremented each time entries are modified, see `metadata_changed` */
+    atomic_uint meta_generation;
+    /* Snapshot of the whole tree, content of the `tree` virtual file, regenerated when
+     * `meta_generation` differs from the generation it was made at */
+    pthread_mutex_t tree_lock;
+    char* tree;
+    size_t tree_size;
+    int tree_entries;
+    unsigned tree_generation;
+    /* Change feed, the last CHANGES_MAX events in a ring, read from the `changes` virtual file.
+     * `changes_seq` is the sequence number of the next event, the first one is 1, and
+     * `changes_first` the oldest one whose path was not overwritten. */
+    pthread_mutex_t changes_lock;
+    pthread_cond_t changes_cond;
+    change_event* changes;
+    unsigned long changes_seq;
+    unsigned long changes_first;
+    /* Ring of the paths of the events, and position of the end of the last one */
+    char* change_paths;
+    unsigned long change_paths_end;
+    /* Readers blocked in `changes_read` */
+    int changes_waiters;
+    virtual_file* feeds;
+} zealfs_partition;
+
+static zealfs_partition g_partitions[PARTITIONS_MAX] = {
+    [0 ... PARTITIONS_MAX - 1] = {
+        .page_shift = 8,
+        .tree_lock = PTHREAD_MUTEX_INITIALIZER,
+        .changes_lock = PTHREAD_MUTEX_INITIALIZER,
+        .changes_cond = PTHREAD_COND_INITIALIZER,
+        .changes_seq = 1,
+        .changes_first = 1,
+    }
+};
 
-/* Cache for the image, as the disk image is at most 64KB, we can allocate it from
- * the heap without a problem. */
-static uint8_t *g_image;
+/* Number of volumes in the image file, 1 unless mounted with --partitions */
+static int g_partition_count = 1;
+
+/* Image file containing the partitions */
+static int g_partition_fd = -1;
+
+/* Partition accessed by the current thread, see `current_partition` */
+static __thread zealfs_partition* t_partition;
 
 /**
- * Macro to help converting a page number into an address in the cache.
+ * @brief Get the partition accessed by the current thread. The worker threads of a mount point
+ *        only serve that mount point, so the partition is looked up in the FUSE context on the
+ *        first access, and kept. The other threads access the first partition unless they
+ *        select another one.
  */
-#define CONTENT_FROM_PAGE(page) ( g_image + (((int) page) << 8) )
+static inline zealfs_partition* current_partition(void)
+{
+    if (t_partition == NULL) {
+        struct fuse_context* context = g_partition_count > 1 ? fuse_get_context() : NULL;
+        t_partition = context && context->private_data ? context->private_data : &g_partitions[0];
+    }
+    return t_partition;
+}
+
+/* State of the partition of the current operation, the whole image when not partitioned */
+#define g_volume        (current_partition()->volume)
+#define g_sched         (current_partition()->sched)
+#define g_image         (current_partition()->image)
+#define g_page_shift    (current_partition()->page_shift)
+#define g_caches        (current_partition()->caches)
+#define g_open_files    (current_partition()->open_files)
+#define g_hotness       (current_partition()->hotness)
+#define g_digests       (current_partition()->digests)
+#define g_open_handles  (current_partition()->open_handles)
+#define g_meta_generation (current_partition()->meta_generation)
 
 /* Options used with FUSE to parse the parameters given from the command line. */
 static struct options {
     const char *imagefile;
     int size;
+    int pack;
+    int compress;
+    const char *serve;
+    int io_uring;
+    int io_uring_depth;
+    int max_threads;
+    int idle_threads;
+    int pin_workers;
+    int sched_delay;
+    int op_time_bound;
+    const char* slow_log;
+    int fsck;
+    int count;
+    const char* archive;
+    const char* store;
+    int sparse;
+    int page_size;
+    const char* hotness;
+    int partitions;
+    int flush_period;
+    int cache_timeout;
+    const char *mountpoint;
     int show_help;
 } options;
 
@@ -48,12 +322,241 @@ static struct options {
 static const struct fuse_opt option_spec[] = {
     OPTION("--image=%s", imagefile),
     OPTION("--size=%d", size),
+    OPTION("--pack", pack),
+    OPTION("--compress", compress),
+    OPTION("--serve=%s", serve),
+    OPTION("--io-uring", io_uring),
+    OPTION("--io-uring-depth=%d", io_uring_depth),
+    OPTION("--max-threads=%d", max_threads),
+    OPTION("--idle-threads=%d", idle_threads),
+    OPTION("--pin-workers", pin_workers),
+    OPTION("--sched-delay=%d", sched_delay),
+    OPTION("--op-time-bound=%d", op_time_bound),
+    OPTION("--slow-log=%s", slow_log),
+    OPTION("--fsck", fsck),
+    OPTION("--count=%d", count),
+    OPTION("--archive=%s", archive),
+    OPTION("--store=%s", store),
+    OPTION("--sparse", sparse),
+    OPTION("--page-size=%d", page_size),
+    OPTION("--hotness=%s", hotness),
+    OPTION("--partitions", partitions),
+    OPTION("--flush-period=%d", flush_period),
+    OPTION("--cache-timeout=%d", cache_timeout),
     OPTION("-h", show_help),
     OPTION("--help", show_help),
     FUSE_OPT_END
 };
 
 
+/**
+ * @brief Prepare the worker thread executing a FUSE operation. The first time a worker runs an
+ *        operation, it is pinned to a CPU if requested, the CPUs being assigned in turn.
+ */
+static void worker_setup(void)
+{
+    static __thread int ready = 0;
+    static atomic_int next_cpu = 0;
+
+    if (ready || !options.pin_workers) {
+        return;
+    }
+    ready = 1;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+    /* Look for the n-th allowed CPU */
+    int n = atomic_fetch_add(&next_cpu, 1) % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+
+/* Path whose attributes and content must be dropped from the kernel cache */
+typedef struct inval_request {
+    struct inval_request* next;
+    struct fuse* fuse;
+    char path[];
+} inval_request;
+
+/* The kernel cache is invalidated by a background thread, once the operations that modified the
+ * paths are over, as the kernel may wait for these operations while invalidating. */
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Pending invalidations, in the order they were requested */
+    inval_request* head;
+    inval_request** tail;
+    int running;
+    int stop;
+} g_invalidator = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .tail = &g_invalidator.head,
+};
+
+
+/**
+ * @brief Record that entries of the current partition were modified: created, removed, renamed,
+ *        resized or moved. The volume must be locked for writing.
+ */
+static inline void metadata_changed(void)
+{
+    atomic_fetch_add(&g_meta_generation, 1);
+}
+
+
+/**
+ * @brief Request the invalidation of a path of the current partition in the kernel cache. Nothing
+ *        is done while the partition is not mounted.
+ *
+ * @param path Absolute path, not necessarily terminated by a NUL byte.
+ * @param len Length of the path.
+ */
+static void invalidate_path(const char* path, int len)
+{
+    /* The paths changing for the kernel change in the tree too */
+    metadata_changed();
+    struct fuse* fuse = current_partition()->fuse;
+    if (fuse == NULL || path == NULL) {
+        return;
+    }
+    inval_request* request = malloc(sizeof(inval_request) + len + 1);
+    if (request == NULL) {
+        /* The kernel cache still expires after --cache-timeout */
+        return;
+    }
+    request->next = NULL;
+    request->fuse = fuse;
+    memcpy(request->path, path, len);
+    request->path[len] = 0;
+
+    pthread_mutex_lock(&g_invalidator.lock);
+    if (g_invalidator.running) {
+        *g_invalidator.tail = request;
+        g_invalidator.tail = &request->next;
+        pthread_cond_signal(&g_invalidator.cond);
+        request = NULL;
+    }
+    pthread_mutex_unlock(&g_invalidator.lock);
+    free(request);
+}
+
+
+/**
+ * @brief Request the invalidation of an entry created, removed or renamed: the entry itself and
+ *        its parent directory, which lists it.
+ */
+static void invalidate_entry(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    invalidate_path(path, strlen(path));
+    invalidate_path(path, slash == path ? 1 : slash - path);
+}
+
+
+/**
+ * @brief Body of the invalidator thread, until stopped.
+ */
+static void* invalidator_run(void* arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&g_invalidator.lock);
+    while (!g_invalidator.stop) {
+        inval_request* request = g_invalidator.head;
+        if (request == NULL) {
+            pthread_cond_wait(&g_invalidator.cond, &g_invalidator.lock);
+            continue;
+        }
+        g_invalidator.head = request->next;
+        if (g_invalidator.head == NULL) {
+            g_invalidator.tail = &g_invalidator.head;
+        }
+        pthread_mutex_unlock(&g_invalidator.lock);
+        /* Fails when the kernel doesn't know the path, there is nothing to invalidate then */
+        fuse_invalidate_path(request->fuse, request->path);
+        free(request);
+        pthread_mutex_lock(&g_invalidator.lock);
+    }
+    pthread_mutex_unlock(&g_invalidator.lock);
+    return NULL;
+}
+
+
+/**
+ * @brief Start the invalidator thread, once the partitions are mounted.
+ */
+static void invalidator_start(void)
+{
+    g_invalidator.stop = 0;
+    g_invalidator.running = pthread_create(&g_invalidator.thread, NULL, invalidator_run, NULL) == 0;
+    if (!g_invalidator.running) {
+        perror("Could not start the invalidator thread");
+    }
+}
+
+
+/**
+ * @brief Stop the invalidator thread. The pending invalidations are dropped, as the mount points
+ *        are gone.
+ */
+static void invalidator_stop(void)
+{
+    pthread_mutex_lock(&g_invalidator.lock);
+    const int running = g_invalidator.running;
+    g_invalidator.running = 0;
+    g_invalidator.stop = 1;
+    pthread_cond_signal(&g_invalidator.cond);
+    pthread_mutex_unlock(&g_invalidator.lock);
+    if (running) {
+        pthread_join(g_invalidator.thread, NULL);
+    }
+    while (g_invalidator.head) {
+        inval_request* request = g_invalidator.head;
+        g_invalidator.head = request->next;
+        free(request);
+    }
+    g_invalidator.tail = &g_invalidator.head;
+}
+
+
+/**
+ * @brief Look for the decompressed content of a file in the list of opened ones.
+ *
+ * @return Cache of the file, NULL if the file doesn't have one.
+ */
+static zealfs_cache* cache_find(ZealFileEntry* entry)
+{
+    for (zealfs_cache* cache = g_caches; cache != NULL; cache = cache->next) {
+        if (entry && cache->entry == entry) {
+            return cache;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Get the size of a file as seen by the users: the size of its cache when it is opened,
+ *        else its decompressed size.
+ */
+static int entry_size(ZealFileEntry* entry)
+{
+    zealfs_cache* cache = cache_find(entry);
+    return cache ? cache->size : (entry->flags & IS_COMPRESSED) ? entry->raw_size : entry->size;
+}
+
+
 /**
  * @brief Get the stat structure of an entry in the file system.
  *
@@ -63,7 +566,9 @@ static const struct fuse_opt option_spec[] = {
 static void stat_from_entry(ZealFileEntry* entry, struct stat* st)
 {
     const uint8_t flags = entry->flags;
-    st->st_size = entry->size;
+    st->st_size = entry_size(entry);
+    /* Space actually taken by the content in the disk image */
+    st->st_blocks = (entry->size + 511) / 512;
     if (flags & IS_DIR) {
         st->st_nlink = 2;
         st->st_mode = S_IFDIR | 0777;
@@ -88,6 +593,64 @@ static void stat_from_entry(ZealFileEntry* entry, struct stat* st)
 }
 
 
+/**
+ * @brief Check that a page number read from the image designates one of its pages, other than
+ *        the header. The images can come from anywhere, no page number can be trusted.
+ */
+static inline int page_valid(uint8_t page)
+{
+    return page != 0 && page < IMAGE_PAGES;
+}
+
+
+/**
+ * @brief Check whether a page is marked as allocated in the header's bitmap.
+ */
+static inline int page_allocated(uint8_t page)
+{
+    const ZealFSHeader* header = (ZealFSHeader*) g_image;
+    return (header->pages_bitmap[page / 8] >> (page % 8)) & 1;
+}
+
+
+/**
+ * @brief Follow the link of a page in a chain. The hop is accounted to the current operation.
+ *
+ * @param page Content of the current page, its first byte is the number of the next page.
+ *
+ * @return Content of the next page, NULL if the link is not valid.
+ */
+static uint8_t* chain_next(const uint8_t* page)
+{
+    t_op_hops++;
+    return page_valid(*page) ? CONTENT_FROM_PAGE(*page) : NULL;
+}
+
+
+/**
+ * @brief Check that the content described by an entry lies within the image, before accessing it.
+ *
+ * @return 0 if the entry can be used, -EIO if the image is corrupted.
+ */
+static int entry_check(const ZealFileEntry* entry)
+{
+    if ((entry->flags & IS_PACKED) == 0 || (entry->flags & IS_DIR)) {
+        return page_valid(entry->start_page) ? 0 : -EIO;
+    }
+    const int count = packedSlots(entry->size);
+    if (entry->size > PACK_MAX_SIZE) {
+        return -EIO;
+    }
+    if (entry->start_page == 0) {
+        return count == 0 ? 0 : -EIO;
+    }
+    if (!page_valid(entry->start_page) || entry->slot == 0 || entry->slot + count > PACK_SLOT_COUNT) {
+        return -EIO;
+    }
+    return 0;
+}
+
+
 /**
  * @brief Function that goes through the absolute path given as a parameter and verifies
  *        that each sub-directory does exist in the disk image.
@@ -104,6 +667,7 @@ static void stat_from_entry(ZealFileEntry* entry, struct stat* st)
  */
 static uint64_t browse_path(const char * path, ZealFileEntry* entries, int root, ZealFileEntry** free_entry)
 {
+    COST_PHASE_SCOPE(COST_LOOKUP);
     /* Store the current directory that is followed by '/' */
     char tmp_name[NAME_MAX_LEN + 1] = { 0 };
     const int max_entries = root ? ROOT_MAX_ENTRIES : DIR_MAX_ENTRIES;
@@ -136,8 +700,12 @@ static uint64_t browse_path(const char * path, ZealFileEntry* entries, int root,
                 return (uint64_t) &entries[i];
             } else {
                 /* Get the page of the current directory */
-                int page = entries[i].start_page << 8;
-                return browse_path(slash + 1, (ZealFileEntry*) (g_image + page), 0, free_entry);
+                const uint8_t page = entries[i].start_page;
+                if ((entries[i].flags & IS_DIR) == 0 || !page_valid(page)) {
+                    return 0;
+                }
+                t_op_hops++;
+                return browse_path(slash + 1, (ZealFileEntry*) CONTENT_FROM_PAGE(page), 0, free_entry);
             }
         }
     }
@@ -146,576 +714,3965 @@ static uint64_t browse_path(const char * path, ZealFileEntry* entries, int root,
 }
 
 /**
- * Small helper to simplify functions that need to fill `info` with a ZealFS entry address
- * before returning.
+ * @brief Allocate a page in the header's bitmap, both the header and the new page are marked as
+ *        modified.
+ *
+ * @return Page number on success, 0 if the disk is full.
  */
-static int fill_info(struct fuse_file_info * info, uint64_t addr)
+static uint8_t alloc_page(void)
 {
-    info->fh = addr;
-    return 0;
+    COST_PHASE_SCOPE(COST_ALLOC);
+    uint8_t page = allocatePage((ZealFSHeader*) g_image);
+    if (page >= IMAGE_PAGES) {
+        /* The bitmap doesn't match the image size, don't go past its end */
+        freePage((ZealFSHeader*) g_image, page);
+        return 0;
+    }
+    if (page != 0) {
+        t_op_allocs++;
+        MARK_DIRTY(g_image);
+        MARK_DIRTY(CONTENT_FROM_PAGE(page));
+    }
+    return page;
 }
 
 
 /**
- * @brief Format the disk image.
- *
- * The file system header, in cache, will be formatted.
+ * @brief Free a page in the header's bitmap, the header is marked as modified.
+ *        In a sparse image, the page is also zeroed, so that it is punched out of the file
+ *        when flushed.
+ */
+static void free_page(uint8_t page)
+{
+    freePage((ZealFSHeader*) g_image, page);
+    MARK_DIRTY(g_image);
+    if (options.sparse) {
+        memset(CONTENT_FROM_PAGE(page), 0, PAGE_BYTES);
+        MARK_DIRTY(CONTENT_FROM_PAGE(page));
+    }
+}
+
+
+/**
+ * @brief Look for a page, shared by packed files, that has enough contiguous free slots.
  *
- * @param file File descriptor of the opened disk image. It will be truncated to the image size.
+ * @param entries Entries array of the directory to search in, recursively.
+ * @param max_entries Number of entries in the `entries` array.
+ * @param count Number of contiguous slots needed.
+ * @param slot Filled with the index of the first free slot when a page is found.
+ * @param visited Bitmap of the directory pages already searched, a directory referenced several
+ *                times in a corrupted image is only searched once.
  *
- * @return 0 on success, error else
+ * @return Page number on success, 0 if no shared page has enough room.
  */
-static int format(int file) {
-    int err = ftruncate(g_fimg, options.size);
-    if (err) {
-        return err;
+static uint8_t find_packed_page(ZealFileEntry* entries, int max_entries, int count, uint8_t* slot,
+                                uint8_t* visited)
+{
+    for (int i = 0; i < max_entries; i++) {
+        const uint8_t flags = entries[i].flags;
+        const uint8_t start = entries[i].start_page;
+        if ((flags & IS_OCCUPIED) == 0) {
+            continue;
+        }
+        if (flags & IS_DIR) {
+            if (!page_valid(start) || (visited[start / 8] & (1 << (start % 8)))) {
+                continue;
+            }
+            visited[start / 8] |= 1 << (start % 8);
+            t_op_hops++;
+            uint8_t page = find_packed_page((ZealFileEntry*) CONTENT_FROM_PAGE(start),
+                                            DIR_MAX_ENTRIES, count, slot, visited);
+            if (page) {
+                return page;
+            }
+        } else if ((flags & IS_PACKED) && page_valid(start)) {
+            int first = packedFindSlots(*CONTENT_FROM_PAGE(start), count);
+            if (first) {
+                *slot = first;
+                return start;
+            }
+        }
     }
+    return 0;
+}
 
-    /* Initialize image header */
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
-    header->magic = 'Z';
-    header->version = 1;
-    /* Do not count the first page */
-    header->bitmap_size = options.size / 256 / 8;
-    /* Do not count the first page */
-    header->free_pages = options.size / 256 - 1;
-    /* All the pages are free (0), mark the first one as occupied */
-    header->pages_bitmap[0] = 1;
-    memset(header->reserved, 0, sizeof(header->reserved));
 
-    /* Flush the cache to the file. */
-    lseek(g_fimg, 0, SEEK_SET);
-    write(g_fimg, g_image, options.size);
+/**
+ * @brief Get the address of a packed file content in the cache.
+ */
+static uint8_t* packed_content(ZealFileEntry* entry)
+{
+    return CONTENT_FROM_PAGE(entry->start_page) + entry->slot * PACK_SLOT_SIZE;
+}
+
 
-    return 0;
+/**
+ * @brief Release the slots of a packed file. The shared page is freed when its last slot is released.
+ *        The entry size is not modified.
+ */
+static void packed_free(ZealFileEntry* entry)
+{
+    const int count = packedSlots(entry->size);
+    if (entry->start_page == 0 || count == 0) {
+        entry->start_page = 0;
+        MARK_DIRTY(entry);
+        return;
+    }
+
+    uint8_t* bitmap = CONTENT_FROM_PAGE(entry->start_page);
+    *bitmap &= ~(((1 << count) - 1) << entry->slot);
+    MARK_DIRTY(bitmap);
+    if (*bitmap == 1) {
+        free_page(entry->start_page);
+    }
+    entry->start_page = 0;
+    entry->slot = 0;
+    MARK_DIRTY(entry);
 }
 
 
-/* @brief Check the integrity of the image file loaded in `image` variable
+/**
+ * @brief Allocate slots for a packed file, in an existing shared page if possible, else in a new one.
+ *        The newly allocated slots are zeroed.
  *
- * @return 0 on success, 1 on error
+ * @return 0 on success, -ENOSPC if the disk is full.
  */
-int check_integrity(void)
+static int packed_alloc(ZealFileEntry* entry, int count)
 {
     ZealFSHeader* header = (ZealFSHeader*) g_image;
-    /* Size of the file according to the bitmap */
-    const int image_size = header->bitmap_size * 8 * 256;
+    uint8_t slot = 1;
+    uint8_t visited[BITMAP_SIZE] = { 0 };
+    uint8_t page = find_packed_page(header->entries, ROOT_MAX_ENTRIES, count, &slot, visited);
 
-    if (header->magic != 'Z') {
-        printf("Error: invalid magic header in the image. Corrupted file?\n");
-        return 1;
+    if (page == 0) {
+        page = alloc_page();
+        if (page == 0) {
+            return -ENOSPC;
+        }
+        memset(CONTENT_FROM_PAGE(page), 0, PAGE_BYTES);
+        *CONTENT_FROM_PAGE(page) = 1;
     }
 
-    if (header->bitmap_size == 0) {
-        printf("Error: invalid 0 size for bitmap. Corrupted file?\n");
-        return 1;
-    }
+    *CONTENT_FROM_PAGE(page) |= ((1 << count) - 1) << slot;
+    MARK_DIRTY(CONTENT_FROM_PAGE(page));
+    entry->start_page = page;
+    entry->slot = slot;
+    MARK_DIRTY(entry);
+    memset(packed_content(entry), 0, count * PACK_SLOT_SIZE);
+    return 0;
+}
 
-    if (image_size > options.size) {
-        printf("Error: invalid bitmap size. Header says the image is %d bytes but actual file size is %d\n",
-                image_size, options.size);
-        return 1;
-    }
 
-    if (image_size < options.size) {
-        printf("Warning: image size according to the bitmap is smaller than file size, "
-               "some part of the image will be unreachable.\n");
-    }
+/**
+ * @brief Resize a packed file. The new size must not be bigger than PACK_MAX_SIZE.
+ *        The content is moved to another shared page if the current one is too crowded to grow.
+ *
+ * @return 0 on success, -ENOSPC if the disk is full.
+ */
+static int packed_resize(ZealFileEntry* entry, int new_size)
+{
+    const int have = packedSlots(entry->size);
+    const int need = packedSlots(new_size);
+    uint8_t save[PACK_MAX_SIZE] = { 0 };
 
-    /* Count the number of free pages in the bitmap compared to the field in the header */
-    int count = 0;
-    for (int i = 0; i < header->bitmap_size; i++) {
-        uint8_t map = header->pages_bitmap[i];
-        /* Count the numbers of 1 and subtract it to 8 */
-        count += 8 - __builtin_popcount(map);
-    }
+    assert(new_size <= PACK_MAX_SIZE);
 
-    if (count < header->free_pages) {
-        printf("Warning: the number of pages marked free is smaller than the actual count, "
-               "some pages may be unreachable.\n");
+    if (need == 0) {
+        packed_free(entry);
+    } else if (have == 0) {
+        int err = packed_alloc(entry, need);
+        if (err) {
+            return err;
+        }
+    } else if (need < have) {
+        *CONTENT_FROM_PAGE(entry->start_page) &= ~(((1 << (have - need)) - 1) << (entry->slot + need));
+    } else if (need > have) {
+        const uint8_t bitmap = *CONTENT_FROM_PAGE(entry->start_page);
+        const uint8_t extra = ((1 << (need - have)) - 1) << (entry->slot + have);
+        if (entry->slot + need <= PACK_SLOT_COUNT && (bitmap & extra) == 0) {
+            /* Grow in place */
+            *CONTENT_FROM_PAGE(entry->start_page) |= extra;
+            memset(packed_content(entry) + have * PACK_SLOT_SIZE, 0, (need - have) * PACK_SLOT_SIZE);
+        } else {
+            /* Not enough room after the current slots, move the content */
+            memcpy(save, packed_content(entry), entry->size);
+            packed_free(entry);
+            int err = packed_alloc(entry, need);
+            if (err) {
+                /* The former slots are still intact, allocate them back */
+                packed_alloc(entry, have);
+                memcpy(packed_content(entry), save, entry->size);
+                return err;
+            }
+            memcpy(packed_content(entry), save, entry->size);
+        }
     }
 
-    if (count > header->free_pages) {
-        printf("Error: the number of pages marked free is bigger than the actual count. Corrupted file?\n");
-        return 1;
+    /* Make sure the bytes after the end of the file are 0 */
+    if (new_size < entry->size && need > 0) {
+        memset(packed_content(entry) + new_size, 0, need * PACK_SLOT_SIZE - new_size);
     }
-
+    if (entry->start_page) {
+        MARK_DIRTY(CONTENT_FROM_PAGE(entry->start_page));
+    }
+    entry->size = new_size;
+    MARK_DIRTY(entry);
     return 0;
 }
 
 
 /**
- * @brief Initialize the FUSE subsystem with our file system.
+ * @brief Resize a file stored as a chain of pages. Pages are allocated (zeroed) or freed accordingly,
+ *        the chain always keeps at least one page.
+ *
+ * @return 0 on success, -ENOSPC if there are not enough free pages, -EIO if the bitmap has fewer
+ *         free pages than the header claims.
  */
-static void *zealfs_init(struct fuse_conn_info *conn,
-            struct fuse_config *cfg)
-{
-    (void) conn;
-    cfg->kernel_cache = 1;
-    return NULL;
-}
-
-/**
- * @brief Get the attributes of a file or directory. (path)
- *        Underneath, this function will call `stat_from_entry`.
-*/
-static int zealfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+static int chain_resize(ZealFileEntry* entry, int new_size)
 {
-    (void) fi;
+    const ZealFSHeader* header = (ZealFSHeader*) g_image;
+    const int have = entry->size == 0 ? 1 : (entry->size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+    const int need = new_size == 0 ? 1 : (new_size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
 
-    memset(stbuf, 0, sizeof(struct stat));
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        /* Directory size is a page size */
-        stbuf->st_size = 256;
-        return 0;
+    if (need - have > header->free_pages) {
+        return -ENOSPC;
     }
 
-    /* Not '/' */
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    /* Go to the last page that will be kept */
+    uint8_t* page = CONTENT_FROM_PAGE(entry->start_page);
+    for (int i = 1; i < MIN(have, need) && page != NULL; i++) {
+        page = chain_next(page);
+    }
+    if (page == NULL) {
+        return -EIO;
+    }
 
-    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
-    ZealFileEntry* entry = (ZealFileEntry*) index;
-    if (index > 0) {
-        stat_from_entry(entry, stbuf);
-        return 0;
+    if (need < have) {
+        uint8_t next = *page;
+        *page = 0;
+        /* A page already freed means the chain loops */
+        while (page_valid(next) && page_allocated(next)) {
+            const uint8_t current = next;
+            next = *CONTENT_FROM_PAGE(current);
+            free_page(current);
+            t_op_hops++;
+        }
+    } else {
+        uint8_t* last = page;
+        for (int i = have; i < need; i++) {
+            uint8_t next = alloc_page();
+            if (next == 0) {
+                /* The header is corrupted, give back the pages taken so far */
+                uint8_t added = *last;
+                for (int j = have; j < i; j++) {
+                    const uint8_t current = added;
+                    added = *CONTENT_FROM_PAGE(current);
+                    free_page(current);
+                }
+                if (i > have) {
+                    *last = 0;
+                    MARK_DIRTY(last);
+                }
+                return -EIO;
+            }
+            memset(CONTENT_FROM_PAGE(next), 0, PAGE_BYTES);
+            *page = next;
+            MARK_DIRTY(page);
+            page = CONTENT_FROM_PAGE(next);
+        }
     }
 
-    return -ENOENT;
+    /* When shrinking, make sure the bytes after the end of the file are 0 */
+    if (new_size < entry->size) {
+        const int used = new_size - (need - 1) * PAGE_PAYLOAD;
+        memset(page + 1 + used, 0, PAGE_PAYLOAD - used);
+    }
+    MARK_DIRTY(page);
+    entry->size = new_size;
+    MARK_DIRTY(entry);
+    return 0;
 }
 
+
 /**
- * @brief Open the file or directory given as a parameter.
+ * @brief Convert a packed file into a regular file, stored in its own chain of pages.
+ *
+ * @return 0 on success, -ENOSPC if the disk is full.
  */
-static int zealfs_open(const char *path, struct fuse_file_info *info)
+static int packed_promote(ZealFileEntry* entry)
 {
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
-
-    if (strcmp(path, "/") == 0) {
-        return -EISDIR;
+    uint8_t page = alloc_page();
+    if (page == 0) {
+        return -ENOSPC;
     }
 
-    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
-    ZealFileEntry* entry = (ZealFileEntry*) index;
-    if (entry) {
-        if (entry->flags & 1) {
-            return -ENOTDIR;
-        }
-        return fill_info(info, index);
+    uint8_t* content = CONTENT_FROM_PAGE(page);
+    memset(content, 0, PAGE_BYTES);
+    if (entry->size) {
+        memcpy(content + 1, packed_content(entry), entry->size);
     }
-    return -ENOENT;
+    packed_free(entry);
+    entry->flags &= ~IS_PACKED;
+    entry->start_page = page;
+    MARK_DIRTY(entry);
+    return 0;
 }
 
 
 /**
- * @brief Remove a file (and only a file!) from the disk image.
+ * @brief Convert a small regular file into a packed file.
+ *
+ * @return 0 on success, -ENOSPC if the disk is full.
  */
-static int zealfs_unlink(const char* path)
+static int packed_demote(ZealFileEntry* entry)
 {
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    const uint8_t page = entry->start_page;
+    const int size = entry->size;
 
-    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
-    ZealFileEntry* entry = (ZealFileEntry*) index;
-    if (index == 0) {
-        return -ENOENT;
-    }
-    if (entry->flags & IS_DIR) {
-        return -EISDIR;
+    assert(size <= PACK_MAX_SIZE);
+    /* Detach the page first, it must not be seen as a shared page while looking for free slots */
+    entry->flags |= IS_PACKED;
+    entry->start_page = 0;
+    entry->size = 0;
+    if (size > 0 && packed_alloc(entry, packedSlots(size))) {
+        entry->flags &= ~IS_PACKED;
+        entry->start_page = page;
+        entry->size = size;
+        return -ENOSPC;
     }
-
-    uint8_t page = entry->start_page;
-    while (page != 0) {
-        freePage(header, page);
-        page = g_image[page << 8];
+    if (size > 0) {
+        memcpy(packed_content(entry), CONTENT_FROM_PAGE(page) + 1, size);
     }
-    /* Clear the flags of the file entry */
-    entry->flags = 0;
-
+    entry->size = size;
+    MARK_DIRTY(entry);
+    free_page(page);
     return 0;
 }
 
 
 /**
- * @brief Rename an entry, file or directory, in the disk image.
- *        The content will not be altered nor modified, only the entries headers will.
+ * @brief Set the size of a file, packed or not, promoting it to a regular file if it becomes too big
+ *        to be packed. New bytes are zeroed.
+ *
+ * @return 0 on success, negative error code else.
  */
-static int zealfs_rename(const char* from, const char* to, unsigned int flags)
+static int resize_file(ZealFileEntry* entry, int new_size)
 {
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
-    ZealFileEntry* free_entry = NULL;
-    ZealFileEntry* fentry = (ZealFileEntry*) browse_path(from + 1, header->entries, 1, NULL);
-    ZealFileEntry* tentry = (ZealFileEntry*) browse_path(to + 1, header->entries, 1, &free_entry);
-
-    if (fentry == 0 || (tentry == 0 && flags == RENAME_EXCHANGE)) {
-        return -ENOENT;
+    COST_PHASE_SCOPE(COST_ALLOC);
+    if (new_size > UINT16_MAX) {
+        return -EFBIG;
     }
-
-    if (flags == RENAME_NOREPLACE && tentry) {
-        return -EEXIST;
+    if (entry_check(entry)) {
+        return -EIO;
     }
 
-    if (flags == RENAME_EXCHANGE) {
-        return -EFAULT;
+    if (entry->flags & IS_PACKED) {
+        if (new_size <= PACK_MAX_SIZE) {
+            return packed_resize(entry, new_size);
+        }
+        ZealFSHeader* header = (ZealFSHeader*) g_image;
+        /* Make sure the whole chain fits before giving up the slots */
+        if (header->free_pages < (new_size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD) {
+            return -ENOSPC;
+        }
+        int err = packed_promote(entry);
+        if (err) {
+            return err;
+        }
     }
 
-    char* from_mod = strdup(from);
-    const char* from_dir = dirname(from_mod);
-    char* to_mod = strdup(to);
-    const char* to_dir = dirname(to_mod);
-    char* to_mod_name = strdup(to);
-    const char* newname = basename(to_mod_name);
+    return chain_resize(entry, new_size);
+}
 
-    /* Check if the new name is valid */
-    const int len = strlen(newname);
-    if (len > NAME_MAX_LEN)
-    {
-        free(to_mod);
-        free(from_mod);
-        free(to_mod_name);
-        return -ENAMETOOLONG;
+
+/**
+ * @brief Read the content of a file, as stored in the disk image.
+ *
+ * @param entry Entry of the file to read.
+ * @param buf Buffer to fill with file's data.
+ * @param size Size of the buffer.
+ * @param offset Offset in the file to start reading from.
+ * @param payload Data stored in each page of the chain, PAGE_PAYLOAD. Given as a constant by
+ *                the instances of this function, see DEFINE_CHAIN_IO.
+ *
+ * @return number of bytes read from the file.
+ */
+static inline __attribute__((always_inline))
+int file_read_paged(ZealFileEntry* entry, uint8_t* buf, size_t size, off_t offset, const int payload)
+{
+    int jump_pages = offset / payload;
+    int offset_in_page = offset % payload;
+
+    if (offset >= entry->size) {
+        return 0;
+    }
+    if (entry_check(entry)) {
+        return -EIO;
     }
+    size = MIN(size, entry->size - offset);
+    const int total = size;
 
-    /* In all cases, if the destination file already exists, remove it! */
-    if (tentry) {
-        zealfs_unlink(to);
-        free_entry = tentry;
+    if (entry->flags & IS_PACKED) {
+        COST_PHASE_SCOPE(COST_COPY);
+        memcpy(buf, packed_content(entry) + offset, size);
+        return total;
     }
-    /* And rename the source file in its own directory */
-    memset(fentry->name, 0, NAME_MAX_LEN);
-    strncpy(fentry->name, newname, NAME_MAX_LEN);
 
-    /* Check if the source and destination are in the same directory */
-    int same_dir = strcmp(from_dir, to_dir) == 0;
-    free(to_mod);
-    free(from_mod);
-    free(to_mod_name);
+    uint8_t* page = CONTENT_FROM_PAGE(entry->start_page);
+    {
+        COST_PHASE_SCOPE(COST_WALK);
+        while (jump_pages && page != NULL) {
+            page = chain_next(page);
+            jump_pages--;
+        }
+    }
 
-    if (!same_dir) {
-        /* Not in the same directory, move the header if we have a free entry */
-        if (!free_entry) {
-            return -ENOMEM;
+    COST_PHASE_SCOPE(COST_COPY);
+    while (size && page != NULL) {
+        int count = MIN(payload - offset_in_page, size);
+        memcpy(buf, page + 1 + offset_in_page, count);
+        buf += count;
+        if (size != count) {
+            page = chain_next(page);
         }
-        memcpy(free_entry, fentry, sizeof(ZealFileEntry));
-        /* Mark the former one as empty */
-        memset(fentry, 0, sizeof(ZealFileEntry));
+        size -= count;
+        offset_in_page = 0;
     }
 
-    return 0;
+    /* The chain is shorter than the file */
+    return page == NULL ? -EIO : total;
 }
 
 
 /**
- * @brief Remove an empty directory from the disk image.
+ * @brief Write data to a file, as stored in the disk image. Pages or slots are allocated if needed.
+ *
+ * @param entry Entry of the file to write.
+ * @param buf Buffer containing the data to write to file.
+ * @param size Size of the buffer.
+ * @param offset Offset in the file to start writing from.
+ * @param payload Data stored in each page of the chain, see `file_read_paged`.
+ *
+ * @return number of bytes written to the file, negative error code else.
  */
-static int zealfs_rmdir(const char* path)
+static inline __attribute__((always_inline))
+int file_write_paged(ZealFileEntry* entry, const uint8_t* buf, size_t size, off_t offset, const int payload)
 {
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    int jump_pages = offset / payload;
+    int offset_in_page = offset % payload;
 
-    if (strcmp(path, "/") == 0) {
-        return -EACCES;
+    const int total = size;
+    const off_t end = offset + size;
+
+    if (end > UINT16_MAX) {
+        return -EFBIG;
     }
 
-    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
-    ZealFileEntry* entry = (ZealFileEntry*) index;
-    if (index == 0) {
-        return -ENOENT;
+    if (entry_check(entry)) {
+        return -EIO;
     }
-    if ((entry->flags & IS_DIR) == 0) {
-        return -ENOTDIR;
+
+    /* Allocate the pages or slots before writing, the file may be promoted to a chain of pages */
+    if (end > entry->size) {
+        int err = resize_file(entry, end);
+        if (err) {
+            return err;
+        }
     }
 
-    /* Check that the directory is empty */
-    uint8_t page = entry->start_page;
-    ZealFileEntry* entries = (ZealFileEntry*) CONTENT_FROM_PAGE(page);
+    if (entry->flags & IS_PACKED) {
+        COST_PHASE_SCOPE(COST_COPY);
+        memcpy(packed_content(entry) + offset, buf, size);
+        MARK_DIRTY(packed_content(entry));
+        return total;
+    }
 
-    for (int i = 0; i < DIR_MAX_ENTRIES; i++) {
-        if (entries[i].flags & IS_OCCUPIED) {
-            return -ENOTEMPTY;
+    uint8_t* page = CONTENT_FROM_PAGE(entry->start_page);
+    {
+        COST_PHASE_SCOPE(COST_WALK);
+        while (jump_pages && page != NULL) {
+            page = chain_next(page);
+            jump_pages--;
         }
     }
-    /* Clear the flags of the entry */
-    entry->flags = 0;
 
-    return 0;
+    COST_PHASE_SCOPE(COST_COPY);
+    while (size && page != NULL) {
+        int count = MIN(payload - offset_in_page, size);
+        memcpy(page + 1 + offset_in_page, buf, count);
+        MARK_DIRTY(page);
+        buf += count;
+        size -= count;
+        if (size) {
+            page = chain_next(page);
+        }
+        offset_in_page = 0;
+    }
+
+    return page == NULL ? -EIO : total;
 }
 
 
 /**
- * @brief Private function used to create either a directory of a file in the disk image.
- *
- * @param isdir 1 to create a directory, 0 to create a file.
- * @param path Absolute path of the entry to create.
- * @param mode Unused.
- * @param info When not NULL, filled with the newly allocated ZealFS Entry address.
- *
- * @return 0 on success, error else.
+ * Reading and writing chains of pages are the hot paths, they are instantiated for each page
+ * size: the payload of the pages is then a constant, the divisions by it are cheap.
  */
-static int zealfs_create_both(int isdir, const char * path, mode_t mode, struct fuse_file_info *info)
-{
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
-    ZealFileEntry* empty = NULL;
-
-    uint64_t index = browse_path(path + 1, header->entries, 1, &empty);
-    if (index) {
-        return -EEXIST;
-    }
-    if (!empty) {
-        return -ENFILE;
+#define DEFINE_CHAIN_IO(bytes) \
+    static int file_read_##bytes(ZealFileEntry* entry, uint8_t* buf, size_t size, off_t offset) { \
+        return file_read_paged(entry, buf, size, offset, bytes - 1); \
+    } \
+    static int file_write_##bytes(ZealFileEntry* entry, const uint8_t* buf, size_t size, off_t offset) { \
+        return file_write_paged(entry, buf, size, offset, bytes - 1); \
     }
 
-    char* path_mod = strdup(path);
-    const char* filename = basename(path_mod);
-    const int len = strlen(filename);
+DEFINE_CHAIN_IO(256)
+DEFINE_CHAIN_IO(512)
+DEFINE_CHAIN_IO(1024)
 
-    if (len > NAME_MAX_LEN) {
-        free(path_mod);
-        return -ENAMETOOLONG;
-    }
 
-    if (info) {
-        info->fh = (uint64_t) empty;
+/**
+ * @brief Read the content of a file with the instance matching the page size of the image.
+ */
+static int file_read(ZealFileEntry* entry, uint8_t* buf, size_t size, off_t offset)
+{
+    switch (g_page_shift) {
+        case 9:  return file_read_512(entry, buf, size, offset);
+        case 10: return file_read_1024(entry, buf, size, offset);
+        default: return file_read_256(entry, buf, size, offset);
     }
+}
 
-    /* Populate the entry */
-    uint8_t newp = allocatePage((ZealFSHeader*) g_image);
-    if (newp == 0) {
-        free(path_mod);
-        return -EFBIG;
+
+/**
+ * @brief Write the content of a file with the instance matching the page size of the image.
+ */
+static int file_write(ZealFileEntry* entry, const uint8_t* buf, size_t size, off_t offset)
+{
+    switch (g_page_shift) {
+        case 9:  return file_write_512(entry, buf, size, offset);
+        case 10: return file_write_1024(entry, buf, size, offset);
+        default: return file_write_256(entry, buf, size, offset);
     }
-    empty->flags = IS_OCCUPIED | isdir;
-    empty->start_page = newp;
-    memset(&empty->name, 0, 16);
-    memcpy(&empty->name, filename, len);
-    empty->size = isdir ? 256 : 0;
-    /* Set the date in the structure */
-    time_t rawtime;
-    time(&rawtime);
-    struct tm* timest = localtime(&rawtime);
-    /* Got the time, populate it in the structure */
-    empty->year[0] = toBCD((1900 + timest->tm_year) / 100);   /* 20 first */
-    empty->year[1] = toBCD(timest->tm_year);         /* 22 then */
-    empty->month = toBCD(timest->tm_mon + 1);
-    empty->day = toBCD(timest->tm_mday);
-    empty->date = toBCD(timest->tm_wday);
-    empty->hours = toBCD(timest->tm_hour);
-    empty->minutes = toBCD(timest->tm_min);
-    empty->seconds = toBCD(timest->tm_sec);
+}
 
-    /* Empty the page */
-    uint8_t* content = CONTENT_FROM_PAGE(newp);
-    memset(content, 0, 256);
 
-    free(path_mod);
-    return 0;
+/**
+ * @brief Get the storage cost of some content, in 32-byte slots.
+ */
+static int storage_slots(int size)
+{
+    if (options.pack && size <= PACK_MAX_SIZE) {
+        return packedSlots(size);
+    }
+    return MAX(1, (size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD) * (PAGE_BYTES / PACK_SLOT_SIZE);
 }
 
 
 /**
- * @brief Create an empty file in the disk image.
+ * @brief Read the whole content of a file, decompressed if needed.
  *
- * @note Underneath, this function calls `zealfs_create_both`
+ * @param entry Entry of the file, compressed or not.
+ * @param data Buffer of UINT16_MAX bytes filled with the content.
+ *
+ * @return Size of the content on success, -EIO if the data cannot be read or decompressed,
+ *         -ENOMEM if it cannot be read in memory.
  */
-static int zealfs_create(const char * path, mode_t mode, struct fuse_file_info *info)
+static int file_load(ZealFileEntry* entry, uint8_t* data)
 {
-    return zealfs_create_both(0, path, mode, info);
+    if ((entry->flags & IS_COMPRESSED) == 0) {
+        const int size = file_read(entry, data, entry->size, 0);
+        return size < 0 ? -EIO : size;
+    }
+    uint8_t* compressed = malloc(MAX(1, entry->size));
+    if (compressed == NULL) {
+        return -ENOMEM;
+    }
+    const int read = file_read(entry, compressed, entry->size, 0);
+    const int size = read < 0 ? -1 : lz_decompress(compressed, entry->size, data, entry->raw_size);
+    free(compressed);
+    return size == entry->raw_size ? size : -EIO;
 }
 
 
 /**
- * @brief Create an empty directory in the disk image.
+ * @brief Get the decompressed content of a file, or load it in a new cache.
+ *        Each call must be balanced with `cache_put`.
  *
- * @note Underneath, this function calls `zealfs_create_both`
+ * @param entry Entry of the file, compressed or not.
+ * @param ret Filled with the cache address on success.
+ *
+ * @return 0 on success, -EIO if the compressed data is invalid, -ENOMEM if the cache cannot be
+ *         allocated.
  */
-static int zealfs_mkdir(const char * path, mode_t mode)
+static int cache_get(ZealFileEntry* entry, zealfs_cache** ret)
 {
-    return zealfs_create_both(1, path, mode, NULL);
+    zealfs_cache* cache = cache_find(entry);
+    if (cache) {
+        cache->refs++;
+        *ret = cache;
+        return 0;
+    }
+
+    cache = calloc(1, sizeof(zealfs_cache));
+    if (cache == NULL) {
+        return -ENOMEM;
+    }
+    cache->entry = entry;
+    cache->refs = 1;
+
+    cache->size = file_load(entry, cache->data);
+    if (cache->size < 0) {
+        const int err = cache->size;
+        free(cache);
+        return err;
+    }
+
+    cache->next = g_caches;
+    g_caches = cache;
+    *ret = cache;
+    return 0;
 }
 
 
 /**
- * @brief Read data from an opened file.
- *
- * @param path Path of the file to read. (unused)
- * @param buf Buffer to fill with file's data.
- * @param size Size of the buffer.
- * @param offset Offset in the file to start reading from.
- * @param fi File info containing the ZealFS Entry address of the opened file.
+ * @brief Store the content of a cache in the disk image if it has been modified.
+ *        The content is compressed only if it makes the file take less space.
  *
- * @return number of bytes read from the file.
+ * @return 0 on success, -ENOSPC if the disk is full, -ENOMEM if the content cannot be
+ *         compressed. The cache stays dirty on error.
  */
-static int zealfs_read(const char *path, char *buf, size_t size, off_t offset,
-              struct fuse_file_info *fi)
+static int cache_store(zealfs_cache* cache)
 {
-    ZealFileEntry* entry = (ZealFileEntry*) fi->fh;
-    int jump_pages = offset / 255;
-    int offset_in_page = offset % 255;
+    ZealFileEntry* entry = cache->entry;
+    if (!cache->dirty || entry == NULL) {
+        return 0;
+    }
+
+    uint8_t* compressed = malloc(MAX(1, cache->size));
+    if (compressed == NULL) {
+        return -ENOMEM;
+    }
+    int length = lz_compress(cache->data, cache->size, compressed, cache->size);
+    const int use_compression = length > 0 && storage_slots(length) < storage_slots(cache->size);
+    const uint8_t* content = use_compression ? compressed : cache->data;
+    if (!use_compression) {
+        length = cache->size;
+    }
+
+    int err = resize_file(entry, length);
+    if (err == 0 && length > 0) {
+        err = file_write(entry, content, length, 0);
+        err = err < 0 ? err : 0;
+    }
+    free(compressed);
+    if (err) {
+        return err;
+    }
+
+    if (use_compression) {
+        entry->flags |= IS_COMPRESSED;
+        entry->raw_size = cache->size;
+    } else {
+        entry->flags &= ~IS_COMPRESSED;
+        entry->raw_size = 0;
+    }
+    MARK_DIRTY(entry);
+    if (options.pack && length <= PACK_MAX_SIZE && (entry->flags & IS_PACKED) == 0) {
+        packed_demote(entry);
+    }
+    metadata_changed();
+    cache->dirty = 0;
+    return 0;
+}
+
+
+/**
+ * @brief Release a reference to a cache, the content is stored in the disk image and the
+ *        cache is freed when the last reference is released.
+ *
+ * @return 0 on success, -ENOSPC or -ENOMEM if the content could not be stored.
+ */
+static int cache_put(zealfs_cache* cache)
+{
+    int err = cache_store(cache);
+    if (--cache->refs > 0) {
+        return err;
+    }
+
+    zealfs_cache** prev = &g_caches;
+    while (*prev != cache) {
+        prev = &(*prev)->next;
+    }
+    *prev = cache->next;
+    free(cache);
+    return err;
+}
+
+
+/**
+ * @brief Generate the content of the `stats` virtual file.
+ */
+static void stats_generate(FILE* out)
+{
+    sched_print_stats(&g_sched, out);
+    cost_print_stats(out);
+    if (g_store_image.refs) {
+        /* The index of the store is modified when the volume is flushed */
+        VOLUME_READ_LOCK(&g_volume);
+        store_print_stats(&g_store, out);
+    }
+    if (g_volume.fault) {
+        int loaded = 0;
+        for (int i = 0; i < VOLUME_MAX_PAGES / 8; i++) {
+            loaded += __builtin_popcount(atomic_load(&g_volume.loaded[i]));
+        }
+        fprintf(out, "container.loaded_pages %d\ncontainer.pages %d\n", loaded, IMAGE_PAGES);
+    }
+}
+
+
+/**
+ * @brief Write the hotness of the files of a directory, recursively, one line per file that was
+ *        read: the number of reads, the number of bytes read, and the path. The volume must be
+ *        locked.
+ *
+ * @param visited Bitmap of the directory pages already written, in case the image is corrupted.
+ */
+static void hotness_write(FILE* out, const ZealFileEntry* entries, int max_entries, const char* dir,
+                          uint8_t* visited)
+{
+    char path[PATH_MAX];
+    for (int i = 0; i < max_entries; i++) {
+        const ZealFileEntry* entry = &entries[i];
+        if ((entry->flags & IS_OCCUPIED) == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%.*s", dir, NAME_MAX_LEN, entry->name);
+        if (entry->flags & IS_DIR) {
+            const uint8_t page = entry->start_page;
+            if (page_valid(page) && ((visited[page / 8] >> (page % 8)) & 1) == 0) {
+                visited[page / 8] |= 1 << (page % 8);
+                hotness_write(out, (ZealFileEntry*) CONTENT_FROM_PAGE(page), DIR_MAX_ENTRIES,
+                              path, visited);
+            }
+            continue;
+        }
+        const file_hotness* hotness = HOTNESS_OF(entry);
+        const unsigned reads = atomic_load(&hotness->reads);
+        if (reads) {
+            fprintf(out, "%u %lu %s\n", reads, atomic_load(&hotness->bytes), path);
+        }
+    }
+}
+
+
+/**
+ * @brief Move the hotness of a file whose entry was moved.
+ */
+static void hotness_move(const ZealFileEntry* to, const ZealFileEntry* from)
+{
+    atomic_store(&HOTNESS_OF(to)->reads, atomic_exchange(&HOTNESS_OF(from)->reads, 0));
+    atomic_store(&HOTNESS_OF(to)->bytes, atomic_exchange(&HOTNESS_OF(from)->bytes, 0));
+}
+
+
+/**
+ * @brief Generate the content of the `hotness` virtual file, same format as the --hotness file.
+ */
+static void hotness_generate(FILE* out)
+{
+    VOLUME_READ_LOCK(&g_volume);
+    uint8_t visited[BITMAP_SIZE] = { 0 };
+    hotness_write(out, ((ZealFSHeader*) g_image)->entries, ROOT_MAX_ENTRIES, "", visited);
+}
+
+
+/**
+ * @brief Load the hotness of the files from the --hotness file, if it exists. The files that don't
+ *        exist anymore are ignored.
+ */
+static void hotness_load(void)
+{
+    char line[PATH_MAX + 64];
+    char path[PATH_MAX];
+    unsigned reads;
+    unsigned long bytes;
+
+    FILE* in = fopen(options.hotness, "r");
+    if (in == NULL) {
+        return;
+    }
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "%u %lu %[^\n]", &reads, &bytes, path) != 3 || path[0] != '/') {
+            continue;
+        }
+        ZealFileEntry* entry = (ZealFileEntry*) browse_path(path + 1, header->entries, 1, NULL);
+        if (entry && (entry->flags & IS_DIR) == 0) {
+            atomic_store(&HOTNESS_OF(entry)->reads, reads);
+            atomic_store(&HOTNESS_OF(entry)->bytes, bytes);
+        }
+    }
+    fclose(in);
+}
+
+
+/**
+ * @brief Save the hotness of the files to the --hotness file. The volume must be locked.
+ */
+static void hotness_save(void)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", options.hotness);
+    FILE* out = fopen(tmp, "w");
+    if (out == NULL) {
+        perror("Could not save the hotness of the files");
+        return;
+    }
+    uint8_t visited[BITMAP_SIZE] = { 0 };
+    hotness_write(out, ((ZealFSHeader*) g_image)->entries, ROOT_MAX_ENTRIES, "", visited);
+    /* Replace the former file only once the new one is complete */
+    if (fclose(out) != 0 || rename(tmp, options.hotness) != 0) {
+        perror("Could not save the hotness of the files");
+    }
+}
+
+
+/**
+ * @brief Move the hash of a file whose entry was moved.
+ */
+static void digest_move(const ZealFileEntry* to, const ZealFileEntry* from)
+{
+    atomic_store(DIGEST_OF(to), atomic_exchange(DIGEST_OF(from), 0));
+}
+
+
+/**
+ * @brief Get the hash of the content of a file, computed when not known yet. The content of an
+ *        opened file is hashed as it will be stored. The volume must be locked.
+ *
+ * @return 0 on success, -EIO if the content cannot be read, -ENOMEM if it cannot be read in
+ *         memory.
+ */
+static int file_digest(ZealFileEntry* entry, uint64_t* hash)
+{
+    *hash = atomic_load(DIGEST_OF(entry));
+    if (*hash != 0) {
+        return 0;
+    }
+    zealfs_cache* cache = cache_find(entry);
+    if (cache) {
+        *hash = archive_hash(cache->data, cache->size);
+    } else {
+        uint8_t* data = malloc(UINT16_MAX);
+        if (data == NULL) {
+            return -ENOMEM;
+        }
+        const int size = file_load(entry, data);
+        if (size >= 0) {
+            *hash = archive_hash(data, size);
+        }
+        free(data);
+        if (size < 0) {
+            return size;
+        }
+    }
+    /* Readers may compute it concurrently, they all get the same hash */
+    atomic_store(DIGEST_OF(entry), *hash);
+    return 0;
+}
+
+
+/**
+ * @brief Describe the pages of a file or directory: their number, then the pages in the order
+ *        of the chain, consecutive pages being given as ranges, such as `4 3-5 9`. A packed file
+ *        gives the page it shares with other files. The volume must be locked.
+ *
+ * @return Length of the description.
+ */
+static int chain_summary(const ZealFileEntry* entry, char* out, size_t size)
+{
+    uint8_t pages[BITMAP_SIZE * 8];
+    int count = 0;
+    uint8_t page = entry->start_page;
+    if (entry->flags & (IS_DIR | IS_PACKED)) {
+        if (page_valid(page)) {
+            pages[count++] = page;
+        }
+    } else {
+        const int total = entry->size == 0 ? 1 : (entry->size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+        /* A chain cannot be longer than the image, whatever its size claims */
+        while (count < total && count < IMAGE_PAGES && page_valid(page)) {
+            pages[count++] = page;
+            page = *CONTENT_FROM_PAGE(page);
+            t_op_hops++;
+        }
+    }
+
+    int len = snprintf(out, size, "%d", count);
+    for (int i = 0; i < count; i++) {
+        int last = i;
+        while (last + 1 < count && pages[last + 1] == pages[last] + 1) {
+            last++;
+        }
+        if (last == i) {
+            len += snprintf(out + len, size - len, " %d", pages[i]);
+        } else {
+            len += snprintf(out + len, size - len, " %d-%d", pages[i], pages[last]);
+        }
+        i = last;
+    }
+    return len;
+}
+
+
+/**
+ * @brief Write the entries of a directory, recursively, one line per entry: its flags, its size,
+ *        its first page, the number of pages it takes, its date and its path. The volume must be
+ *        locked.
+ *
+ * @param visited Bitmap of the directory pages already written, a directory referenced several
+ *                times in a corrupted image is only written once.
+ *
+ * @return Number of entries written.
+ */
+static int tree_write(FILE* out, const ZealFileEntry* entries, int max_entries, const char* dir,
+                      uint8_t* visited)
+{
+    char path[PATH_MAX];
+    int count = 0;
+    for (int i = 0; i < max_entries; i++) {
+        const ZealFileEntry* entry = &entries[i];
+        if ((entry->flags & IS_OCCUPIED) == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%.*s", dir, NAME_MAX_LEN, entry->name);
+        struct stat st;
+        stat_from_entry((ZealFileEntry*) entry, &st);
+        const int pages = (entry->flags & (IS_DIR | IS_PACKED)) || entry->size == 0 ? 1 :
+                          (entry->size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+        fprintf(out, "%c%c%c %d %d %d %02d%02d-%02d-%02d %02d:%02d:%02d %s\n",
+                (entry->flags & IS_DIR) ? 'd' : '-',
+                (entry->flags & IS_PACKED) ? 'p' : '-',
+                (entry->flags & IS_COMPRESSED) ? 'c' : '-',
+                (int) st.st_size, entry->start_page, pages,
+                fromBCD(entry->year[0]), fromBCD(entry->year[1]), fromBCD(entry->month),
+                fromBCD(entry->day), fromBCD(entry->hours), fromBCD(entry->minutes),
+                fromBCD(entry->seconds), path);
+        count++;
+        const uint8_t page = entry->start_page;
+        if ((entry->flags & IS_DIR) && page_valid(page) &&
+            ((visited[page / 8] >> (page % 8)) & 1) == 0) {
+            visited[page / 8] |= 1 << (page % 8);
+            count += tree_write(out, (ZealFileEntry*) CONTENT_FROM_PAGE(page), DIR_MAX_ENTRIES,
+                                path, visited);
+        }
+    }
+    return count;
+}
+
+
+/**
+ * @brief Regenerate the snapshot of the tree of the current partition if entries were modified
+ *        since it was made. Must be called with the `tree_lock` of the partition held.
+ *
+ * @return 0 on success, -ENOMEM if the snapshot could not be generated.
+ */
+static int tree_update(void)
+{
+    zealfs_partition* part = current_partition();
+    VOLUME_READ_LOCK(&g_volume);
+    /* Entries are only modified with the volume locked for writing */
+    const unsigned generation = atomic_load(&g_meta_generation);
+    if (part->tree && part->tree_generation == generation) {
+        return 0;
+    }
+
+    char* data = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&data, &size);
+    if (out == NULL) {
+        return -ENOMEM;
+    }
+    uint8_t visited[BITMAP_SIZE] = { 0 };
+    const int entries = tree_write(out, ((ZealFSHeader*) g_image)->entries, ROOT_MAX_ENTRIES, "",
+                                   visited);
+    if (fclose(out) != 0) {
+        free(data);
+        return -ENOMEM;
+    }
+    free(part->tree);
+    part->tree = data;
+    part->tree_size = size;
+    part->tree_entries = entries;
+    part->tree_generation = generation;
+    return 0;
+}
+
+
+/**
+ * @brief Generate the content of the `tree` virtual file, the snapshot of the whole tree, so that
+ *        tools can index the volume in a single read.
+ */
+static void tree_generate(FILE* out)
+{
+    zealfs_partition* part = current_partition();
+    pthread_mutex_lock(&part->tree_lock);
+    if (tree_update() == 0) {
+        fwrite(part->tree, 1, part->tree_size, out);
+    }
+    pthread_mutex_unlock(&part->tree_lock);
+}
+
+
+/* Longest line of the change feed: the sequence number, the operation, the size, the pages,
+ * none of them consecutive, and the path */
+#define CHANGE_LINE_MAX (PATH_MAX + BITMAP_SIZE * 8 * 2 + 64)
+
+/**
+ * @brief Get the sequence number of the oldest event still in the change feed.
+ */
+static unsigned long changes_oldest(const zealfs_partition* part)
+{
+    const unsigned long oldest = part->changes_seq > CHANGES_MAX ? part->changes_seq - CHANGES_MAX : 1;
+    return MAX(oldest, part->changes_first);
+}
+
+
+/**
+ * @brief Record a modification in the change feed of the current partition, and wake up its
+ *        readers. The volume must be locked for writing.
+ *
+ * @param op Name of the operation, see the README.
+ * @param path Path of the file or directory modified, "/" for the whole volume.
+ * @param size New size of the file or directory, or of the volume.
+ * @param pages Bitmap of the pages written, usually those of the current operation.
+ */
+static void change_record(const char* op, const char* path, int size, const uint8_t* pages)
+{
+    zealfs_partition* part = current_partition();
+    if (part->changes == NULL) {
+        return;
+    }
+    if (path == NULL) {
+        path = "";
+    }
+    pthread_mutex_lock(&part->changes_lock);
+    change_event* event = &part->changes[part->changes_seq % CHANGES_MAX];
+    event->seq = part->changes_seq++;
+    event->op = op;
+    event->size = size;
+    memcpy(event->pages, pages, BITMAP_SIZE);
+    event->path_start = part->change_paths_end;
+    event->path_len = strnlen(path, PATH_MAX - 1);
+    for (int i = 0; i < event->path_len; i++) {
+        part->change_paths[(event->path_start + i) % CHANGES_PATHS_SIZE] = path[i];
+    }
+    part->change_paths_end += event->path_len;
+    /* Drop the events whose path was just overwritten */
+    part->changes_first = changes_oldest(part);
+    while (part->change_paths_end - part->changes[part->changes_first % CHANGES_MAX].path_start >
+           CHANGES_PATHS_SIZE) {
+        part->changes_first++;
+    }
+    pthread_cond_broadcast(&part->changes_cond);
+    for (virtual_file* file = part->feeds; file != NULL; file = file->next) {
+        if (file->poll) {
+            fuse_notify_poll(file->poll);
+            fuse_pollhandle_destroy(file->poll);
+            file->poll = NULL;
+        }
+    }
+    pthread_mutex_unlock(&part->changes_lock);
+}
+
+
+/**
+ * @brief Write an event of the change feed as a line: its sequence number, the operation, the new
+ *        size, the pages written, as ranges separated by commas or `-` if none, and the path.
+ *
+ * @return Length of the line.
+ */
+static int change_format(const zealfs_partition* part, const change_event* event, char* out,
+                         size_t size)
+{
+    char pages[BITMAP_SIZE * 8 * 2];
+    char path[PATH_MAX];
+    int len = 0;
+    for (int i = 0; i < event->path_len; i++) {
+        path[i] = part->change_paths[(event->path_start + i) % CHANGES_PATHS_SIZE];
+    }
+    path[event->path_len] = 0;
+    for (int page = 0; page < BITMAP_SIZE * 8; page++) {
+        if (((event->pages[page / 8] >> (page % 8)) & 1) == 0) {
+            continue;
+        }
+        int last = page;
+        while (last + 1 < BITMAP_SIZE * 8 && ((event->pages[(last + 1) / 8] >> ((last + 1) % 8)) & 1)) {
+            last++;
+        }
+        const char* sep = len ? "," : "";
+        if (last == page) {
+            len += snprintf(pages + len, sizeof(pages) - len, "%s%d", sep, page);
+        } else {
+            len += snprintf(pages + len, sizeof(pages) - len, "%s%d-%d", sep, page, last);
+        }
+        page = last;
+    }
+    const int line = snprintf(out, size, "%lu %s %d %s %s\n", event->seq, event->op, event->size,
+                              len ? pages : "-", path);
+    return MIN(line, (int) size - 1);
+}
+
+
+/**
+ * @brief Open the change feed, it starts at the oldest event still recorded.
+ */
+static int changes_open(virtual_file* file)
+{
+    zealfs_partition* part = current_partition();
+    file->data = malloc(CHANGE_LINE_MAX);
+    if (file->data == NULL) {
+        return -ENOMEM;
+    }
+    pthread_mutex_lock(&part->changes_lock);
+    file->feed = 1;
+    file->seq = changes_oldest(part);
+    file->next = part->feeds;
+    part->feeds = file;
+    pthread_mutex_unlock(&part->changes_lock);
+    return 0;
+}
+
+
+/**
+ * @brief Read the events of the change feed, as lines. The read blocks until at least one event
+ *        is available, unless the file was opened with O_NONBLOCK, the volume is not mounted, or
+ *        CHANGES_WAITERS_MAX readers are already waiting.
+ *
+ * @return Number of bytes read, -EAGAIN if the read would block, -EINTR if it was interrupted,
+ *         0 once the file system is being unmounted.
+ */
+static int changes_read(virtual_file* file, char* buf, size_t size, int nonblock)
+{
+    zealfs_partition* part = current_partition();
+    int len = 0;
+
+    pthread_mutex_lock(&part->changes_lock);
+    int waiting = 0;
+    while (file->pos == file->size && file->seq == part->changes_seq) {
+        /* Only the requests of a mount point can be interrupted. A few readers at most can
+         * wait, so that they don't take all the worker threads. */
+        if (!waiting && part->changes_waiters < CHANGES_WAITERS_MAX && !nonblock && part->fuse) {
+            waiting = 1;
+            part->changes_waiters++;
+        }
+        if (!waiting) {
+            len = -EAGAIN;
+            break;
+        }
+        if (fuse_interrupted()) {
+            len = -EINTR;
+            break;
+        }
+        if (fuse_session_exited(fuse_get_session(part->fuse))) {
+            break;
+        }
+        /* Wake up regularly to notice interruptions and unmounting */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&part->changes_cond, &part->changes_lock, &deadline);
+    }
+    if (waiting) {
+        part->changes_waiters--;
+    }
+
+    while (len >= 0 && (size_t) len < size) {
+        if (file->pos < file->size) {
+            const size_t count = MIN(size - len, file->size - file->pos);
+            memcpy(buf + len, file->data + file->pos, count);
+            file->pos += count;
+            len += count;
+            continue;
+        }
+        if (file->seq == part->changes_seq) {
+            break;
+        }
+        /* The events overwritten before being read are lost, the sequence numbers show the gap */
+        file->seq = MAX(file->seq, changes_oldest(part));
+        file->size = change_format(part, &part->changes[file->seq % CHANGES_MAX], file->data,
+                                   CHANGE_LINE_MAX);
+        file->pos = 0;
+        file->seq++;
+    }
+    pthread_mutex_unlock(&part->changes_lock);
+    return len;
+}
+
+
+/**
+ * @brief Close the change feed.
+ */
+static void changes_close(virtual_file* file)
+{
+    zealfs_partition* part = current_partition();
+    pthread_mutex_lock(&part->changes_lock);
+    virtual_file** prev = &part->feeds;
+    while (*prev != file) {
+        prev = &(*prev)->next;
+    }
+    *prev = file->next;
+    if (file->poll) {
+        fuse_pollhandle_destroy(file->poll);
+    }
+    pthread_mutex_unlock(&part->changes_lock);
+}
+
+
+/* Virtual files present in VIRTUAL_DIR. The change feed is not generated at opening, it follows
+ * the modifications as they are recorded. */
+static const struct {
+    const char* name;
+    void (*generate)(FILE* out);
+} g_virtual_files[] = {
+    { "stats", stats_generate },
+    { "hotness", hotness_generate },
+    { "tree", tree_generate },
+    { "changes", NULL },
+};
+
+#define VIRTUAL_FILES_COUNT ((int) (sizeof(g_virtual_files) / sizeof(g_virtual_files[0])))
+
+
+/**
+ * @brief Check whether a path designates the virtual directory, or a file in it.
+ *
+ * @return Index of the virtual file in `g_virtual_files`, VIRTUAL_FILES_COUNT for the directory
+ *         itself, or -1 if the path is not virtual. Any other name in the virtual directory
+ *         returns -ENOENT.
+ */
+static int virtual_lookup(const char* path)
+{
+    const size_t len = strlen(VIRTUAL_DIR);
+    if (strncmp(path, VIRTUAL_DIR, len) != 0 || (path[len] != '/' && path[len] != 0)) {
+        return -1;
+    }
+    if (path[len] == 0 || path[len + 1] == 0) {
+        return VIRTUAL_FILES_COUNT;
+    }
+    for (int i = 0; i < VIRTUAL_FILES_COUNT; i++) {
+        if (strcmp(path + len + 1, g_virtual_files[i].name) == 0) {
+            return i;
+        }
+    }
+    return -ENOENT;
+}
+
+
+/**
+ * @brief Get the opened file designated by an opened file info.
+ */
+static inline open_file* open_handle(struct fuse_file_info* fi)
+{
+    return (open_file*) fi->fh;
+}
+
+
+/**
+ * @brief Get the virtual file designated by an opened file info, if any.
+ *
+ * @return Virtual file, NULL if the opened file is a regular file.
+ */
+static virtual_file* virtual_handle(struct fuse_file_info* fi)
+{
+    return open_handle(fi)->virtual;
+}
+
+
+/**
+ * @brief Allocate the handle of an opened file and give it to FUSE. Regular files are added to
+ *        the list of the partition, which must be locked.
+ *
+ * @param entry Entry of the regular file, NULL for a virtual file.
+ * @param cache Cache referenced by this open, NULL if none.
+ * @param file Content of the virtual file, NULL for a regular file.
+ *
+ * @return 0 on success, -ENOMEM if the handle cannot be allocated.
+ */
+static int open_new(struct fuse_file_info* fi, ZealFileEntry* entry, zealfs_cache* cache,
+                    virtual_file* file)
+{
+    open_file* open = calloc(1, sizeof(open_file));
+    if (open == NULL) {
+        return -ENOMEM;
+    }
+    open->entry = entry;
+    open->cache = cache;
+    open->virtual = file;
+    if (entry) {
+        open->next = g_open_files;
+        if (g_open_files) {
+            g_open_files->prev = open;
+        }
+        g_open_files = open;
+    }
+    fi->fh = (uint64_t) open;
+    return 0;
+}
+
+
+/**
+ * @brief Free the handle of an opened file. For regular files, the partition must be locked.
+ */
+static void open_free(open_file* open)
+{
+    if (open->virtual == NULL) {
+        if (open->prev) {
+            open->prev->next = open->next;
+        } else {
+            g_open_files = open->next;
+        }
+        if (open->next) {
+            open->next->prev = open->prev;
+        }
+    }
+    free(open);
+}
+
+
+/**
+ * @brief Update the paths of the opened files after the file, or one of their parent directories,
+ *        was renamed. The volume must be locked.
+ */
+static void open_rename(const char* from, const char* to)
+{
+    const size_t from_len = strlen(from);
+    const size_t to_len = strlen(to);
+    for (open_file* open = g_open_files; open != NULL; open = open->next) {
+        if (open->path == NULL || strncmp(open->path, from, from_len) != 0 ||
+            (open->path[from_len] != '/' && open->path[from_len] != 0)) {
+            continue;
+        }
+        const size_t rest = strlen(open->path + from_len);
+        if (to_len + rest < PATH_MAX) {
+            memmove(open->path + to_len, open->path + from_len, rest + 1);
+            memcpy(open->path, to, to_len);
+        }
+    }
+}
+
+
+/**
+ * @brief Make the opened files designating an entry designate another one, after the file was
+ *        moved to another directory, or NULL after it was removed. The volume must be locked.
+ */
+static void open_follow(ZealFileEntry* from, ZealFileEntry* to)
+{
+    for (open_file* open = g_open_files; open != NULL; open = open->next) {
+        if (open->entry == from) {
+            open->entry = to;
+        }
+    }
+}
+
+
+/**
+ * @brief Open a virtual file, its content is generated once, at opening.
+ */
+static int virtual_open(int index, struct fuse_file_info* fi)
+{
+    virtual_file* file = calloc(1, sizeof(virtual_file));
+    if (file == NULL) {
+        return -ENOMEM;
+    }
+    if (g_virtual_files[index].generate == NULL) {
+        const int err = changes_open(file);
+        if (err) {
+            free(file);
+            return err;
+        }
+    } else {
+        FILE* out = open_memstream(&file->data, &file->size);
+        if (out == NULL) {
+            free(file);
+            return -ENOMEM;
+        }
+        g_virtual_files[index].generate(out);
+        fclose(out);
+    }
+
+    const int err = open_new(fi, NULL, NULL, file);
+    if (err) {
+        if (file->feed) {
+            changes_close(file);
+        }
+        free(file->data);
+        free(file);
+        return err;
+    }
+    /* The size is unknown when getattr is called, bypass the page cache */
+    fi->direct_io = 1;
+    return 0;
+}
+
+
+/**
+ * Small helper to simplify functions that need to fill `info` with a ZealFS entry address
+ * before returning.
+ */
+static int fill_info(struct fuse_file_info * info, uint64_t addr)
+{
+    info->fh = addr;
+    return 0;
+}
+
+
+/**
+ * @brief Format the disk image.
+ *
+ * The file system header, in cache, will be formatted. Only the header is written: the file is
+ * extended with a hole, read as zeros, so formatting takes the same time whatever the size.
+ *
+ * @param file File descriptor of the opened disk image. It will be truncated to the image size.
+ *
+ * @return 0 on success, error else
+ */
+static int format(int file) {
+    /* Drop any former content, the whole image must read as zeros */
+    int err = ftruncate(file, 0) || ftruncate(file, options.size);
+    if (err) {
+        return err;
+    }
+
+    /* Initialize image header */
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    header->magic = 'Z';
+    header->version = 1;
+    header->page_order = g_page_shift - 8;
+    header->bitmap_size = IMAGE_PAGES / 8;
+    /* Do not count the first page */
+    header->free_pages = IMAGE_PAGES - 1;
+    /* All the pages are free (0), mark the first one as occupied */
+    header->pages_bitmap[0] = 1;
+    memset(header->reserved, 0, sizeof(header->reserved));
+
+    return pwrite(file, g_image, PAGE_BYTES, 0) == PAGE_BYTES ? 0 : -1;
+}
+
+
+/* State of the integrity check, built while browsing the tree */
+typedef struct {
+    /* Bitmap of the pages referenced so far */
+    uint8_t used[BITMAP_SIZE];
+    /* Bitmap of the pages shared by packed files, a subset of `used` */
+    uint8_t shared[BITMAP_SIZE];
+    int files;
+    int directories;
+} integrity_state;
+
+
+/**
+ * @brief Mark a page referenced by an entry as used while checking the integrity of the image.
+ *
+ * @param state State of the check.
+ * @param page Page to mark.
+ * @param is_shared 1 if the page is referenced as a shared page, which can be referenced several times.
+ *
+ * @return 0 on success, 1 if the page cannot be referenced.
+ */
+static int check_page(integrity_state* state, uint8_t page, int is_shared)
+{
+    const uint8_t mask = 1 << (page % 8);
+    if (!page_valid(page)) {
+        printf("Error: reference to the invalid page %d. Corrupted file?\n", page);
+        return 1;
+    }
+    if (!page_allocated(page)) {
+        printf("Error: page %d is used but marked free in the bitmap. Corrupted file?\n", page);
+        return 1;
+    }
+    if (state->used[page / 8] & mask) {
+        if (is_shared && (state->shared[page / 8] & mask)) {
+            return 0;
+        }
+        printf("Error: page %d is referenced more than once. Corrupted file?\n", page);
+        return 1;
+    }
+    state->used[page / 8] |= mask;
+    if (is_shared) {
+        state->shared[page / 8] |= mask;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Check that all the entries of a directory, and their content, recursively, lie within
+ *        the image. No page can be used twice, except shared pages, so the directories and the
+ *        chains of pages cannot loop.
+ *
+ * @return 0 on success, 1 on error
+ */
+static int check_directory(const ZealFileEntry* entries, int max_entries, integrity_state* state)
+{
+    for (int i = 0; i < max_entries; i++) {
+        const ZealFileEntry* entry = &entries[i];
+        if ((entry->flags & IS_OCCUPIED) == 0) {
+            continue;
+        }
+        if (entry_check(entry)) {
+            printf("Error: invalid content for entry %.*s. Corrupted file?\n", NAME_MAX_LEN, entry->name);
+            return 1;
+        }
+        if (entry->flags & IS_DIR) {
+            state->directories++;
+            if (check_page(state, entry->start_page, 0) ||
+                check_directory((ZealFileEntry*) CONTENT_FROM_PAGE(entry->start_page),
+                                DIR_MAX_ENTRIES, state)) {
+                return 1;
+            }
+            continue;
+        }
+        state->files++;
+        if (entry->flags & IS_PACKED) {
+            if (entry->start_page && check_page(state, entry->start_page, 1)) {
+                return 1;
+            }
+        } else {
+            const int pages = entry->size == 0 ? 1 : (entry->size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+            uint8_t page = entry->start_page;
+            for (int j = 0; j < pages; j++) {
+                if (check_page(state, page, 0)) {
+                    return 1;
+                }
+                page = *CONTENT_FROM_PAGE(page);
+            }
+        }
+    }
+    return 0;
+}
+
+
+/* @brief Check the integrity of the image file loaded in `image` variable
+ *
+ * @param leaked_pages Filled with the number of pages allocated but not used, when not NULL.
+ *
+ * @return 0 on success, 1 on error
+ */
+int check_integrity(int* leaked_pages)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    /* Size of the file according to the bitmap */
+    const int image_size = (header->bitmap_size * 8) << g_page_shift;
+
+    if (header->magic != 'Z') {
+        printf("Error: invalid magic header in the image. Corrupted file?\n");
+        return 1;
+    }
+
+    if (header->bitmap_size == 0 || header->bitmap_size > BITMAP_SIZE) {
+        printf("Error: invalid size %d for bitmap. Corrupted file?\n", header->bitmap_size);
+        return 1;
+    }
+
+    if (image_size > options.size) {
+        printf("Error: invalid bitmap size. Header says the image is %d bytes but actual file size is %d\n",
+                image_size, options.size);
+        return 1;
+    }
+
+    if (image_size < options.size) {
+        printf("Warning: image size according to the bitmap is smaller than file size, "
+               "some part of the image will be unreachable.\n");
+    }
+
+    /* Count the number of free pages in the bitmap compared to the field in the header */
+    int count = 0;
+    for (int i = 0; i < header->bitmap_size; i++) {
+        uint8_t map = header->pages_bitmap[i];
+        /* Count the numbers of 1 and subtract it to 8 */
+        count += 8 - __builtin_popcount(map);
+    }
+
+    if (count < header->free_pages) {
+        printf("Warning: the number of pages marked free is smaller than the actual count, "
+               "some pages may be unreachable.\n");
+    }
+
+    if (count > header->free_pages) {
+        printf("Error: the number of pages marked free is bigger than the actual count. Corrupted file?\n");
+        return 1;
+    }
+
+    /* Browsing the tree would load all the chunks of a compressed image, its pages are only
+     * checked when accessed, unless a full check is requested */
+    if (g_volume.fault && !options.fsck) {
+        return 0;
+    }
+
+    /* The header is always used */
+    integrity_state state = { .used = { 1 } };
+    if (check_directory(header->entries, ROOT_MAX_ENTRIES, &state)) {
+        return 1;
+    }
+
+    /* Pages allocated but not referenced are lost until the image is reformatted */
+    int leaked = 0;
+    for (int i = 0; i < header->bitmap_size; i++) {
+        leaked += __builtin_popcount(header->pages_bitmap[i] & ~state.used[i]);
+    }
+    if (leaked) {
+        printf("Warning: %d pages are allocated but not used by any file or directory.\n", leaked);
+    }
+    if (leaked_pages) {
+        *leaked_pages = leaked;
+    }
+
+    if (options.fsck) {
+        printf("%d files, %d directories, %d/%d pages used, %d pages leaked\n",
+               state.files, state.directories, header->bitmap_size * 8 - count - leaked,
+               header->bitmap_size * 8, leaked);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Flush the modified pages of the volume to the store it was loaded from. Stored pages are
+ *        never modified, the new content of each page is stored separately, or shared with an
+ *        identical page, and the manifest of the image is updated to reference it.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int flush_to_store(zealfs_volume* vol, void* arg)
+{
+    uint32_t former[VOLUME_MAX_PAGES];
+    int count = 0;
+    (void) arg;
+
+    for (uint32_t page = 0; page < g_store_image.pages; page++) {
+        uint32_t ref;
+        if (!volume_is_dirty(vol, page)) {
+            continue;
+        }
+        if (store_put(&g_store, vol->image + page * 256, &ref)) {
+            return -1;
+        }
+        former[count++] = g_store_image.refs[page];
+        g_store_image.refs[page] = ref;
+    }
+
+    /* The pages appended must be in the index before the manifest references them */
+    if (store_save(&g_store) || store_save_image(&g_store, options.imagefile, &g_store_image)) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        store_release(&g_store, former[i]);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Look for the image to mount in the store given with --store, and load it in the volume.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int open_from_store(void)
+{
+    int err = store_open(&g_store, options.store, 0);
+    if (err) {
+        printf("Could not open store %s: %s\n", options.store, strerror(-err));
+        return -1;
+    }
+    err = store_load_image(&g_store, options.imagefile, &g_store_image);
+    if (err || g_store_image.pages > VOLUME_MAX_PAGES) {
+        printf("Could not load image %s from store %s\n", options.imagefile, options.store);
+        store_close(&g_store);
+        return -1;
+    }
+    options.size = g_store_image.pages * 256;
+    return 0;
+}
+
+
+/**
+ * @brief Read the pages of the image from the store, once the volume is initialized.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int load_from_store(void)
+{
+    for (uint32_t page = 0; page < g_store_image.pages; page++) {
+        if (store_read(&g_store, g_store_image.refs[page], g_image + page * 256)) {
+            return -1;
+        }
+    }
+    g_volume.flush = flush_to_store;
+    return 0;
+}
+
+
+/**
+ * @brief Load pages of the volume from the compressed image, the first time they are accessed.
+ *        The volume loads whole chunks.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int fault_from_container(zealfs_volume* vol, int first, int count, void* arg)
+{
+    (void) count;
+    (void) arg;
+    const int chunk = first / g_container.header.chunk_pages;
+    const int err = container_read_chunk(&g_container, chunk, vol->image + first * 256);
+    if (err) {
+        fprintf(stderr, "Error: could not read chunk %d of %s: %s\n", chunk, options.imagefile, strerror(-err));
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Flush the modified pages of the volume to the compressed image. Each chunk containing
+ *        a modified page is compressed again and rewritten.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int flush_to_container(zealfs_volume* vol, void* arg)
+{
+    const int chunk_pages = g_container.header.chunk_pages;
+    (void) arg;
+
+    for (int chunk = 0; chunk < g_container.header.chunks; chunk++) {
+        const int first = chunk * chunk_pages;
+        int dirty = 0;
+        for (int page = first; page < first + chunk_pages && page < IMAGE_PAGES; page++) {
+            dirty |= volume_is_dirty(vol, page);
+        }
+        /* A page can only be modified once loaded, this is a no-op */
+        if (dirty && container_write_chunk(&g_container, chunk, volume_page(vol, first))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Open the compressed image given with --image. Only the chunk of the header is read,
+ *        the others are read when first accessed.
+ *
+ * @return File descriptor of the container on success, -1 on error.
+ */
+static int open_from_container(void)
+{
+    int err = container_open(&g_container, options.imagefile, !options.fsck);
+    if (err) {
+        printf("Could not open compressed image %s: %s\n", options.imagefile, strerror(-err));
+        return -1;
+    }
+    if (g_container.header.size > 64 * 1024) {
+        printf("Invalid size for compressed image %s\n", options.imagefile);
+        container_close(&g_container);
+        return -1;
+    }
+    options.size = g_container.header.size;
+    return g_container.fd;
+}
+
+
+/**
+ * @brief Flush the modified pages and close the image. The hash of an image stored in an archive
+ *        is updated if it was modified.
+ */
+static void close_image(void)
+{
+    volume_wrlock(&g_volume);
+    if (options.hotness) {
+        hotness_save();
+    }
+    free(g_hotness);
+    g_hotness = NULL;
+    free(g_digests);
+    g_digests = NULL;
+    free(current_partition()->changes);
+    current_partition()->changes = NULL;
+    free(current_partition()->change_paths);
+    current_partition()->change_paths = NULL;
+    /* The partitions share the image file, they are flushed together, see `flush_partitions` */
+    if (g_partition_count == 1) {
+        volume_flush(&g_volume);
+    }
+    if (g_archive_entry && g_volume.generation != 0) {
+        archive_set_hash(&g_archive, g_archive_entry, archive_hash(g_image, g_volume.size));
+    }
+    volume_unlock(&g_volume);
+    if (g_archive_entry) {
+        archive_close(&g_archive);
+    } else if (g_container.chunks) {
+        container_close(&g_container);
+    } else if (g_store_image.refs) {
+        /* Save the references released by the last flush */
+        store_save(&g_store);
+        store_close(&g_store);
+    } else if (g_partition_count == 1) {
+        close(g_volume.fd);
+    }
+}
+
+
+/**
+ * @brief Request the invalidation of the entries of a directory, recursively, that are in the
+ *        given pages: the entries themselves, their content or the entries they list.
+ *
+ * @param changed Bitmap of the pages about to be modified.
+ * @param visited Bitmap of the directory pages already browsed, in case the image is corrupted.
+ * @param path Path of the directory, the names of the entries are appended to it.
+ * @param len Length of the path, without its trailing '/'.
+ */
+static void invalidate_pages(const ZealFileEntry* entries, int max_entries, const uint8_t* changed,
+                             uint8_t* visited, char* path, int len)
+{
+    const int dir_page = PTR_TO_IDX(entries) >> g_page_shift;
+    for (int i = 0; i < max_entries; i++) {
+        const ZealFileEntry* entry = &entries[i];
+        if ((entry->flags & IS_OCCUPIED) == 0) {
+            continue;
+        }
+        const int name_len = strnlen(entry->name, NAME_MAX_LEN);
+        if (len + 1 + name_len >= PATH_MAX) {
+            continue;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, entry->name, name_len);
+        const int entry_len = len + 1 + name_len;
+
+        int hit = (changed[dir_page / 8] >> (dir_page % 8)) & 1;
+        uint8_t page = entry->start_page;
+        if (!page_valid(page)) {
+            /* Only the entry can be invalidated */
+        } else if (entry->flags & IS_DIR) {
+            hit |= (changed[page / 8] >> (page % 8)) & 1;
+            if (((visited[page / 8] >> (page % 8)) & 1) == 0) {
+                visited[page / 8] |= 1 << (page % 8);
+                invalidate_pages((ZealFileEntry*) CONTENT_FROM_PAGE(page), DIR_MAX_ENTRIES,
+                                 changed, visited, path, entry_len);
+            }
+        } else {
+            const int pages = (entry->flags & IS_PACKED) ? 1 :
+                              entry->size == 0 ? 1 : (entry->size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+            for (int j = 0; j < pages && !hit && page_valid(page); j++) {
+                hit = (changed[page / 8] >> (page % 8)) & 1;
+                page = *CONTENT_FROM_PAGE(page);
+            }
+        }
+        if (hit) {
+            /* The content of the file may have been modified by the client */
+            atomic_store(DIGEST_OF(entry), 0);
+            invalidate_path(path, entry_len);
+        }
+    }
+}
+
+
+/**
+ * @brief Called by the page server before the pages written by a client are modified, the files
+ *        and directories they belong to are invalidated in the kernel cache. The volume is
+ *        locked for writing.
+ */
+static void server_written(const uint8_t* pages, int count, void* arg)
+{
+    (void) arg;
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    uint8_t changed[BITMAP_SIZE] = { 0 };
+    uint8_t visited[BITMAP_SIZE] = { 0 };
+    char path[PATH_MAX] = "/";
+
+    for (int i = 0; i < count; i++) {
+        changed[pages[i] / 8] |= 1 << (pages[i] % 8);
+    }
+    /* The header contains the root directory */
+    if (changed[0] & 1) {
+        invalidate_path(path, 1);
+    }
+    invalidate_pages(header->entries, ROOT_MAX_ENTRIES, changed, visited, path, 0);
+    change_record("remote", "/", g_volume.size, changed);
+}
+
+
+/**
+ * @brief Initialize the FUSE subsystem with our file system.
+ */
+static void *zealfs_init(struct fuse_conn_info *conn,
+            struct fuse_config *cfg)
+{
+    (void) conn;
+    cfg->kernel_cache = 1;
+    /* The modified paths are invalidated, the kernel can keep them longer */
+    if (options.cache_timeout > 0) {
+        cfg->entry_timeout = options.cache_timeout;
+        cfg->attr_timeout = options.cache_timeout;
+    }
+    /* Started here as the process may have been daemonized after the options were parsed */
+    if (options.serve && server_start(&g_volume, options.serve, server_written, NULL)) {
+        perror("Could not start the page server");
+    }
+    /* Keep the partition of the mount point as private data */
+    return fuse_get_context()->private_data;
+}
+
+/**
+ * @brief Get the attributes of a file or directory. (path)
+ *        Underneath, this function will call `stat_from_entry`.
+*/
+static int zealfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+    (void) fi;
+    memset(stbuf, 0, sizeof(struct stat));
+
+    /* Virtual files don't access the image, their size is only known once generated */
+    const int virtual = virtual_lookup(path);
+    if (virtual == VIRTUAL_FILES_COUNT) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        return 0;
+    } else if (virtual >= 0) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        return 0;
+    } else if (virtual == -ENOENT) {
+        return virtual;
+    }
+
+    BEGIN_READ_OP(SCHED_META);
+    cost_args("%s", path);
+    if (strcmp(path, "/") == 0) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        /* Directory size is a page size */
+        stbuf->st_size = PAGE_BYTES;
+        return 0;
+    }
+
+    /* Not '/' */
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+
+    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
+    ZealFileEntry* entry = (ZealFileEntry*) index;
+    if (index > 0) {
+        stat_from_entry(entry, stbuf);
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * @brief Open the file or directory given as a parameter.
+ */
+static int zealfs_open(const char *path, struct fuse_file_info *info)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+
+    const int virtual = virtual_lookup(path);
+    if (virtual == VIRTUAL_FILES_COUNT) {
+        return -EISDIR;
+    } else if (virtual >= 0) {
+        if ((info->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        return virtual_open(virtual, info);
+    } else if (virtual == -ENOENT) {
+        return virtual;
+    }
+
+    BEGIN_WRITE_OP(SCHED_META);
+    cost_args("%s flags=%#x", path, info->flags);
+    if (strcmp(path, "/") == 0) {
+        return -EISDIR;
+    }
+
+    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
+    ZealFileEntry* entry = (ZealFileEntry*) index;
+    if (entry) {
+        if (entry->flags & 1) {
+            return -ENOTDIR;
+        }
+        /* Compressed files are accessed through their decompressed content, so are the files
+         * that may be written when compression is enabled */
+        const int writing = (info->flags & O_ACCMODE) != O_RDONLY;
+        zealfs_cache* cache = NULL;
+        if ((entry->flags & IS_COMPRESSED) || (options.compress && writing)) {
+            int err = cache_get(entry, &cache);
+            if (err) {
+                return err;
+            }
+        }
+        int err = open_new(info, entry, cache, NULL);
+        if (err) {
+            if (cache) {
+                cache_put(cache);
+            }
+            return err;
+        }
+        atomic_fetch_add(&g_open_handles, 1);
+        return 0;
+    }
+    return -ENOENT;
+}
+
+
+/**
+ * @brief Remove a file (and only a file!) from the disk image. The volume must be locked.
+ */
+static int unlink_file(const char* path)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+
+    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
+    ZealFileEntry* entry = (ZealFileEntry*) index;
+    if (index == 0) {
+        return -ENOENT;
+    }
+    if (entry->flags & IS_DIR) {
+        return -EISDIR;
+    }
+    if (entry_check(entry)) {
+        return -EIO;
+    }
+
+    /* If the file is still opened, its content must not be stored anymore */
+    zealfs_cache* cache = cache_find(entry);
+    if (cache) {
+        cache->entry = NULL;
+    }
+    open_follow(entry, NULL);
+
+    if (entry->flags & IS_PACKED) {
+        packed_free(entry);
+    } else {
+        /* A page already freed means the chain loops */
+        uint8_t page = entry->start_page;
+        while (page_valid(page) && page_allocated(page)) {
+            const uint8_t current = page;
+            page = *CONTENT_FROM_PAGE(current);
+            free_page(current);
+            t_op_hops++;
+        }
+    }
+    /* Clear the flags of the file entry */
+    entry->flags = 0;
+    MARK_DIRTY(entry);
+    atomic_store(DIGEST_OF(entry), 0);
+
+    return 0;
+}
+
+
+/**
+ * @brief Remove a file (and only a file!) from the disk image.
+ */
+static int zealfs_unlink(const char* path)
+{
+    if (virtual_lookup(path) != -1) {
+        return -EACCES;
+    }
+    BEGIN_WRITE_OP(SCHED_META);
+    cost_args("%s", path);
+    int err = unlink_file(path);
+    if (err == 0) {
+        invalidate_entry(path);
+        change_record("unlink", path, 0, t_op_written);
+    }
+    return err;
+}
+
+
+/**
+ * @brief Rename an entry, file or directory, in the disk image.
+ *        The content will not be altered nor modified, only the entries headers will.
+ */
+static int zealfs_rename(const char* from, const char* to, unsigned int flags)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    if (virtual_lookup(from) != -1 || virtual_lookup(to) != -1) {
+        return -EACCES;
+    }
+    BEGIN_WRITE_OP(SCHED_META);
+    cost_args("%s %s flags=%u", from, to, flags);
+    ZealFileEntry* free_entry = NULL;
+    ZealFileEntry* fentry = (ZealFileEntry*) browse_path(from + 1, header->entries, 1, NULL);
+    ZealFileEntry* tentry = (ZealFileEntry*) browse_path(to + 1, header->entries, 1, &free_entry);
+
+    if (fentry == 0 || (tentry == 0 && flags == RENAME_EXCHANGE)) {
+        return -ENOENT;
+    }
+
+    if (flags == RENAME_NOREPLACE && tentry) {
+        return -EEXIST;
+    }
+
+    if (flags == RENAME_EXCHANGE) {
+        return -EFAULT;
+    }
+
+    /* Renaming an entry to itself does nothing, and a directory can't be moved inside itself */
+    const int from_len = strlen(from);
+    if (tentry == fentry) {
+        return 0;
+    } else if (strncmp(to, from, from_len) == 0 && to[from_len] == '/') {
+        return -EINVAL;
+    }
+    /* Only a file can be replaced, by another file */
+    if (tentry && (tentry->flags & IS_DIR)) {
+        return (fentry->flags & IS_DIR) ? -EEXIST : -EISDIR;
+    } else if (tentry && (fentry->flags & IS_DIR)) {
+        return -ENOTDIR;
+    }
+
+    char* from_mod = strdup(from);
+    const char* from_dir = dirname(from_mod);
+    char* to_mod = strdup(to);
+    const char* to_dir = dirname(to_mod);
+    char* to_mod_name = strdup(to);
+    const char* newname = basename(to_mod_name);
+
+    /* Check if the source and destination are in the same directory */
+    const int same_dir = strcmp(from_dir, to_dir) == 0;
+    /* Check if the new name is valid, it is padded with zeros as in the entries */
+    const int len = strlen(newname);
+    char name[NAME_MAX_LEN];
+    strncpy(name, newname, NAME_MAX_LEN);
+    free(to_mod);
+    free(from_mod);
+    free(to_mod_name);
+    if (len > NAME_MAX_LEN) {
+        return -ENAMETOOLONG;
+    }
+    /* Not in the same directory, the header is moved if we have a free entry. Check it before
+     * modifying anything. */
+    if (!same_dir && !tentry && !free_entry) {
+        return -ENOMEM;
+    }
+
+    /* In all cases, if the destination file already exists, remove it! */
+    if (tentry) {
+        const int err = unlink_file(to);
+        if (err) {
+            return err;
+        }
+        free_entry = tentry;
+    }
+    /* And rename the source file in its own directory */
+    memcpy(fentry->name, name, NAME_MAX_LEN);
+    MARK_DIRTY(fentry);
+
+    if (!same_dir) {
+        memcpy(free_entry, fentry, sizeof(ZealFileEntry));
+        MARK_DIRTY(free_entry);
+        hotness_move(free_entry, fentry);
+        digest_move(free_entry, fentry);
+        /* Mark the former one as empty */
+        memset(fentry, 0, sizeof(ZealFileEntry));
+        zealfs_cache* cache = cache_find(fentry);
+        if (cache) {
+            cache->entry = free_entry;
+        }
+        open_follow(fentry, free_entry);
+        fentry = free_entry;
+    }
+
+    invalidate_entry(from);
+    invalidate_entry(to);
+    open_rename(from, to);
+    change_record("rename-from", from, 0, t_op_written);
+    change_record("rename-to", to, entry_size(fentry), t_op_written);
+    return 0;
+}
+
+
+/**
+ * @brief Remove an empty directory from the disk image.
+ */
+static int zealfs_rmdir(const char* path)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    if (strcmp(path, "/") == 0 || virtual_lookup(path) != -1) {
+        return -EACCES;
+    }
+    BEGIN_WRITE_OP(SCHED_META);
+    cost_args("%s", path);
+
+
+    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
+    ZealFileEntry* entry = (ZealFileEntry*) index;
+    if (index == 0) {
+        return -ENOENT;
+    }
+    if ((entry->flags & IS_DIR) == 0) {
+        return -ENOTDIR;
+    }
+    if (entry_check(entry)) {
+        return -EIO;
+    }
+
+    /* Check that the directory is empty */
+    uint8_t page = entry->start_page;
+    ZealFileEntry* entries = (ZealFileEntry*) CONTENT_FROM_PAGE(page);
+
+    for (int i = 0; i < DIR_MAX_ENTRIES; i++) {
+        if (entries[i].flags & IS_OCCUPIED) {
+            return -ENOTEMPTY;
+        }
+    }
+    /* Clear the flags of the entry and release the directory page */
+    entry->flags = 0;
+    MARK_DIRTY(entry);
+    free_page(page);
+
+    invalidate_entry(path);
+    change_record("rmdir", path, 0, t_op_written);
+    return 0;
+}
+
+
+/**
+ * @brief Private function used to create either a directory of a file in the disk image.
+ *        The volume must be locked.
+ *
+ * @param isdir 1 to create a directory, 0 to create a file.
+ * @param path Absolute path of the entry to create.
+ * @param mode Unused.
+ * @param info When not NULL, filled with the newly allocated ZealFS Entry address.
+ *
+ * @return 0 on success, error else.
+ */
+static int zealfs_create_both(int isdir, const char * path, mode_t mode, struct fuse_file_info *info)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    ZealFileEntry* empty = NULL;
+
+    uint64_t index = browse_path(path + 1, header->entries, 1, &empty);
+    if (index) {
+        return -EEXIST;
+    }
+    if (!empty) {
+        return -ENFILE;
+    }
+
+    char* path_mod = strdup(path);
+    const char* filename = basename(path_mod);
+    const int len = strlen(filename);
+
+    if (len > NAME_MAX_LEN) {
+        free(path_mod);
+        return -ENAMETOOLONG;
+    }
+
+    if (info) {
+        info->fh = (uint64_t) empty;
+    }
+
+    /* Populate the entry. A new packed file doesn't need any page until data is written to it. */
+    const int packed = options.pack && !isdir;
+    uint8_t newp = 0;
+    if (!packed) {
+        newp = alloc_page();
+        if (newp == 0) {
+            free(path_mod);
+            return -ENOSPC;
+        }
+    }
+    /* The entry may have been used by a file which doesn't exist anymore */
+    atomic_store(&HOTNESS_OF(empty)->reads, 0);
+    atomic_store(&HOTNESS_OF(empty)->bytes, 0);
+    atomic_store(DIGEST_OF(empty), 0);
+    empty->flags = IS_OCCUPIED | isdir | (packed ? IS_PACKED : 0);
+    empty->start_page = newp;
+    empty->slot = 0;
+    memset(&empty->name, 0, 16);
+    memcpy(&empty->name, filename, len);
+    empty->size = isdir ? PAGE_BYTES : 0;
+    /* Set the date in the structure */
+    setDate(empty, time(NULL));
+    MARK_DIRTY(empty);
+
+    /* Empty the page */
+    if (newp) {
+        uint8_t* content = CONTENT_FROM_PAGE(newp);
+        memset(content, 0, PAGE_BYTES);
+    }
+
+    free(path_mod);
+    return 0;
+}
+
+
+/**
+ * @brief Create an empty file in the disk image.
+ *
+ * @note Underneath, this function calls `zealfs_create_both`. When compression is enabled,
+ *       the content of the new file is compressed when it is flushed.
+ */
+static int zealfs_create(const char * path, mode_t mode, struct fuse_file_info *info)
+{
+    if (virtual_lookup(path) != -1) {
+        return -EACCES;
+    }
+    BEGIN_WRITE_OP(SCHED_META);
+    cost_args("%s", path);
+    int err = zealfs_create_both(0, path, mode, info);
+    ZealFileEntry* entry = (ZealFileEntry*) info->fh;
+    zealfs_cache* cache = NULL;
+    if (err == 0 && options.compress) {
+        err = cache_get(entry, &cache);
+    }
+    if (err == 0) {
+        err = open_new(info, entry, cache, NULL);
+        if (err && cache) {
+            cache_put(cache);
+        }
+    }
+    if (err == 0) {
+        atomic_fetch_add(&g_open_handles, 1);
+        invalidate_entry(path);
+        change_record("create", path, 0, t_op_written);
+    }
+    return err;
+}
+
+
+/**
+ * @brief Create an empty directory in the disk image.
+ *
+ * @note Underneath, this function calls `zealfs_create_both`
+ */
+static int zealfs_mkdir(const char * path, mode_t mode)
+{
+    if (virtual_lookup(path) != -1) {
+        return -EACCES;
+    }
+    BEGIN_WRITE_OP(SCHED_META);
+    cost_args("%s", path);
+    int err = zealfs_create_both(1, path, mode, NULL);
+    if (err == 0) {
+        invalidate_entry(path);
+        change_record("mkdir", path, PAGE_BYTES, t_op_written);
+    }
+    return err;
+}
+
+
+/**
+ * @brief Read data from an opened regular file. The volume must be locked.
+ *
+ * @return number of bytes read from the file.
+ */
+static int open_read(const open_file* open, char *buf, size_t size, off_t offset)
+{
+    ZealFileEntry* entry = open->entry;
+    zealfs_cache* cache = open->cache ? open->cache : cache_find(entry);
+    int ret = 0;
+
+    if (cache == NULL && entry == NULL) {
+        /* Removed while opened, and its content was not kept */
+        return -ESTALE;
+    } else if (cache == NULL) {
+        ret = file_read(entry, (uint8_t*) buf, size, offset);
+    } else if (offset < cache->size) {
+        COST_PHASE_SCOPE(COST_COPY);
+        ret = MIN(size, cache->size - offset);
+        memcpy(buf, cache->data + offset, ret);
+    }
+    /* Several readers can update the same file concurrently */
+    if (ret > 0 && entry) {
+        atomic_fetch_add(&HOTNESS_OF(entry)->reads, 1);
+        atomic_fetch_add(&HOTNESS_OF(entry)->bytes, ret);
+    }
+    return ret;
+}
+
+
+/**
+ * @brief Read data from an opened file.
+ *
+ * @param path Path of the file to read. (unused)
+ * @param buf Buffer to fill with file's data.
+ * @param size Size of the buffer.
+ * @param offset Offset in the file to start reading from.
+ * @param fi File info containing the handle of the opened file, see `open_file`.
+ *
+ * @return number of bytes read from the file.
+ */
+static int zealfs_read(const char *path, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi)
+{
+    virtual_file* file = virtual_handle(fi);
+    if (file && file->feed) {
+        return changes_read(file, buf, size, fi->flags & O_NONBLOCK);
+    } else if (file) {
+        if (offset >= (off_t) file->size) {
+            return 0;
+        }
+        size = MIN(size, file->size - offset);
+        memcpy(buf, file->data + offset, size);
+        return size;
+    }
+
+    BEGIN_READ_OP(SCHED_DATA);
+    cost_args("%s size=%zu offset=%ld", path ? path : "-", size, (long) offset);
+    return open_read(open_handle(fi), buf, size, offset);
+}
+
+
+/**
+ * @brief Write data to an opened regular file. The volume must be locked for writing.
+ *
+ * @return number of bytes written to the file, -EFBIG if the size is too big, -ENOSPC if the
+ *         disk is full.
+ */
+static int open_write(const open_file* open, const char *path, const char *buf, size_t size,
+                      off_t offset)
+{
+    ZealFileEntry* entry = open->entry;
+    zealfs_cache* cache = open->cache ? open->cache : cache_find(entry);
+
+    if (cache == NULL && entry == NULL) {
+        return -ESTALE;
+    } else if (entry) {
+        atomic_store(DIGEST_OF(entry), 0);
+    }
+    if (cache == NULL) {
+        const int former = entry->size;
+        int ret = file_write(entry, (const uint8_t*) buf, size, offset);
+        if (entry->size != former) {
+            invalidate_path(path, path ? strlen(path) : 0);
+        }
+        if (ret > 0) {
+            change_record("write", path, entry->size, t_op_written);
+        }
+        return ret;
+    }
+
+    /* The content will be compressed and stored when the file is flushed */
+    if (offset + size > UINT16_MAX) {
+        return -EFBIG;
+    }
+    COST_PHASE_SCOPE(COST_COPY);
+    if (offset > cache->size) {
+        memset(cache->data + cache->size, 0, offset - cache->size);
+    }
+    memcpy(cache->data + offset, buf, size);
+    if (offset + size > (size_t) cache->size) {
+        cache->size = offset + size;
+        invalidate_path(path, path ? strlen(path) : 0);
+    }
+    cache->dirty = 1;
+    /* No page is written until the content is stored */
+    change_record("write", path, cache->size, t_op_written);
+    return size;
+}
+
+
+/**
+ * @brief Write data to an opened file.
+ *
+ * @param path Path of the file to write. (unused)
+ * @param buf Buffer containing the data to write to file.
+ * @param size Size of the buffer.
+ * @param offset Offset in the file to start writing from.
+ * @param fi File info containing the handle of the opened file, see `open_file`.
+ *
+ * @return number of bytes written to the file, -EFBIG if the size is too big.
+ */
+static int zealfs_write(const char *path, const char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi)
+{
+    BEGIN_WRITE_OP(SCHED_DATA);
+    cost_args("%s size=%zu offset=%ld", path ? path : "-", size, (long) offset);
+    return open_write(open_handle(fi), path, buf, size, offset);
+}
+
+
+/**
+ * @brief Change the size of a file.
+ *
+ * When packing is enabled, files that become small enough are packed into a shared page.
+ *
+ * @param path Absolute path of the file to truncate.
+ * @param size New size of the file.
+ * @param fi File info containing the handle of the opened file, can be NULL.
+ *
+ * @return 0 on success, error code else.
+ */
+static int zealfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    ZealFileEntry* entry = NULL;
+    if (virtual_lookup(path) != -1) {
+        return -EACCES;
+    }
+    BEGIN_WRITE_OP(SCHED_DATA);
+    cost_args("%s size=%ld", path, (long) size);
+
+    if (fi) {
+        entry = open_handle(fi)->entry;
+    } else if (strcmp(path, "/") != 0) {
+        entry = (ZealFileEntry*) browse_path(path + 1, header->entries, 1, NULL);
+    }
+    if (entry == NULL) {
+        return -ENOENT;
+    }
+    if (entry->flags & IS_DIR) {
+        return -EISDIR;
+    }
+    if (size > UINT16_MAX) {
+        return -EFBIG;
+    }
+    atomic_store(DIGEST_OF(entry), 0);
+
+    zealfs_cache* cache = cache_find(entry);
+    if (cache || (entry->flags & IS_COMPRESSED)) {
+        /* Compressed files not opened yet need to be decompressed first */
+        int err = cache_get(entry, &cache);
+        if (err) {
+            return err;
+        }
+        if (size > cache->size) {
+            memset(cache->data + cache->size, 0, size - cache->size);
+        }
+        cache->size = size;
+        cache->dirty = 1;
+        invalidate_path(path, strlen(path));
+        err = cache_put(cache);
+        if (err == 0) {
+            change_record("truncate", path, size, t_op_written);
+        }
+        return err;
+    }
+
+    int err = resize_file(entry, size);
+    if (err == 0 && options.pack && size <= PACK_MAX_SIZE && (entry->flags & IS_PACKED) == 0) {
+        /* Not a problem if the file cannot be packed, it stays a regular file */
+        packed_demote(entry);
+    }
+    if (err == 0) {
+        invalidate_path(path, strlen(path));
+        change_record("truncate", path, size, t_op_written);
+    }
+    return err;
+}
+
+
+/**
+ * @brief Called each time an opened file is closed, store the content of the
+ *        file in the disk image if it has been modified.
+ */
+static int zealfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    if (virtual_handle(fi)) {
+        return 0;
+    }
+    BEGIN_WRITE_OP(SCHED_FLUSH);
+    cost_args("%s", path ? path : "-");
+    zealfs_cache* cache = cache_find(open_handle(fi)->entry);
+    /* Nothing is stored for a file removed while opened */
+    if (cache == NULL || !cache->dirty || cache->entry == NULL) {
+        return 0;
+    }
+    const int err = cache_store(cache);
+    if (err == 0) {
+        change_record("store", path, cache->size, t_op_written);
+    }
+    return err;
+}
+
+
+/**
+ * @brief Called when the last reference to an opened file is closed.
+ */
+static int zealfs_release(const char *path, struct fuse_file_info *fi)
+{
+    open_file* open = open_handle(fi);
+    virtual_file* file = open->virtual;
+    if (file) {
+        if (file->feed) {
+            changes_close(file);
+        }
+        free(file->data);
+        free(file);
+        open_free(open);
+        return 0;
+    }
+    BEGIN_WRITE_OP(SCHED_FLUSH);
+    cost_args("%s", path ? path : "-");
+    atomic_fetch_sub(&g_open_handles, 1);
+    /* Only the opens that took a reference to the cache release one */
+    zealfs_cache* cache = open->cache;
+    open_free(open);
+    if (cache == NULL) {
+        return 0;
+    }
+    const int dirty = cache->dirty && cache->entry;
+    const int size = cache->size;
+    const int err = cache_put(cache);
+    if (dirty && err == 0) {
+        change_record("store", path, size, t_op_written);
+    }
+    return err;
+}
+
+
+/**
+ * @brief Close a directory.
+ */
+static int zealfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+    /* Neither the virtual directory nor the root directory are counted */
+    if (fi->fh && fi->fh != (uint64_t) ((ZealFSHeader*) g_image)->entries) {
+        atomic_fetch_sub(&g_open_handles, 1);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Open a directory from the disk image.
+ *
+ * @param path Absolute path to the directory to open.
+ * @param info Info structure that will be filled with the ZealFileEntry address.
+ *
+ * @return 0 on success, error code else.
+ */
+static int zealfs_opendir(const char * path, struct fuse_file_info * info)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+
+    /* The virtual directory has no entries in the image */
+    const int virtual = virtual_lookup(path);
+    if (virtual == VIRTUAL_FILES_COUNT) {
+        return fill_info(info, 0);
+    } else if (virtual != -1) {
+        return virtual < 0 ? virtual : -ENOTDIR;
+    }
+
+    BEGIN_READ_OP(SCHED_META);
+    cost_args("%s", path);
+    if (strcmp(path, "/") == 0) {
+        return fill_info(info, (uint64_t) &header->entries);
+    }
+
+    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
+    ZealFileEntry* entry = (ZealFileEntry*) index;
+    if (entry) {
+        if ((entry->flags & 1) == 0) {
+            return -ENOTDIR;
+        }
+        if (entry_check(entry)) {
+            return -EIO;
+        }
+        atomic_fetch_add(&g_open_handles, 1);
+        return fill_info(info, (uint64_t) CONTENT_FROM_PAGE(entry->start_page));
+    }
+    return -ENOENT;
+}
+
+
+/**
+ * @brief Read all entries from an opened directory.
+ *
+ * @param path Path of the directory to browse. (unused)
+ * @param buf Context given by FUSE when adding new entries.
+ * @param filler Function to call to add an entry in the directory.
+ * @param offset Unused.
+ * @param info Info structure that will be filled with the opened ZealFileEntry address.
+ * @param flags Unused.
+ */
+static int zealfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+             off_t offset, struct fuse_file_info *info,
+             enum fuse_readdir_flags flags)
+{
+    (void) offset;
+    (void) flags;
+
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    char name[NAME_MAX_LEN + 1] = { 0 };
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+
+    ZealFileEntry* entries = (ZealFileEntry*) info->fh;
+    if (entries == NULL) {
+        for (int i = 0; i < VIRTUAL_FILES_COUNT; i++) {
+            filler(buf, g_virtual_files[i].name, NULL, 0, 0);
+        }
+        return 0;
+    }
+
+    BEGIN_READ_OP(SCHED_META);
+    cost_args("%s offset=%ld", path, (long) offset);
+    /* If the directory we are browsing is the root directory, we have less entries */
+    const int max_entries = (entries == header->entries) ? ROOT_MAX_ENTRIES : DIR_MAX_ENTRIES;
+
+    /* Browse each entry, looking for an non-empty one thanks to the flags */
+    for (int i = 0; i < max_entries; i++) {
+        const uint8_t flags = entries[i].flags;
+        if (flags & IS_OCCUPIED) {
+            struct stat st = { 0 };
+            stat_from_entry(&entries[i], &st);
+            strncpy(name, entries[i].name, NAME_MAX_LEN);
+            filler(buf, name, &st, 0, 0);
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief Mark the directory pages of a directory, recursively, in a bitmap.
+ */
+static void collect_directories(const ZealFileEntry* entries, int max_entries, uint8_t* dirs)
+{
+    for (int i = 0; i < max_entries; i++) {
+        const uint8_t page = entries[i].start_page;
+        if ((entries[i].flags & (IS_OCCUPIED | IS_DIR)) != (IS_OCCUPIED | IS_DIR) || !page_valid(page) ||
+            (dirs[page / 8] >> (page % 8)) & 1) {
+            continue;
+        }
+        dirs[page / 8] |= 1 << (page % 8);
+        collect_directories((ZealFileEntry*) CONTENT_FROM_PAGE(page), DIR_MAX_ENTRIES, dirs);
+    }
+}
+
+
+/**
+ * @brief Update the references to the moved pages in a directory, recursively: the first page of
+ *        the entries and the links of the chains.
+ *
+ * @param map New number of each moved page, 0 for the pages that were not moved.
+ * @param visited Bitmap of the directory pages already updated, in case the image is corrupted.
+ */
+static void remap_directory(ZealFileEntry* entries, int max_entries, const uint8_t* map,
+                            uint8_t* visited)
+{
+    for (int i = 0; i < max_entries; i++) {
+        ZealFileEntry* entry = &entries[i];
+        if ((entry->flags & IS_OCCUPIED) == 0) {
+            continue;
+        }
+        if (map[entry->start_page]) {
+            entry->start_page = map[entry->start_page];
+            MARK_DIRTY(entry);
+        }
+        if (!page_valid(entry->start_page)) {
+            continue;
+        }
+        const uint8_t start = entry->start_page;
+        if (entry->flags & IS_DIR) {
+            if (((visited[start / 8] >> (start % 8)) & 1) == 0) {
+                visited[start / 8] |= 1 << (start % 8);
+                remap_directory((ZealFileEntry*) CONTENT_FROM_PAGE(start), DIR_MAX_ENTRIES, map,
+                                visited);
+            }
+        } else if ((entry->flags & IS_PACKED) == 0) {
+            const int pages = entry->size == 0 ? 1 : (entry->size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+            uint8_t* page = CONTENT_FROM_PAGE(entry->start_page);
+            for (int j = 1; j < pages && page_valid(*page); j++) {
+                if (map[*page]) {
+                    *page = map[*page];
+                    MARK_DIRTY(page);
+                }
+                page = CONTENT_FROM_PAGE(*page);
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Move the allocated pages past `pages` to the lowest free pages, and update the
+ *        references to them. The volume must be locked for writing.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int relocate_pages(int pages)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    const int former = header->bitmap_size * 8;
+    uint8_t dirs[BITMAP_SIZE] = { 0 };
+    uint8_t map[VOLUME_MAX_PAGES] = { 0 };
+
+    /* Check that everything fits before moving anything */
+    int moved = 0;
+    int moved_dirs = 0;
+    int free_pages = 0;
+    collect_directories(header->entries, ROOT_MAX_ENTRIES, dirs);
+    for (int page = 1; page < former; page++) {
+        if (page < pages) {
+            free_pages += !page_allocated(page);
+        } else {
+            moved += page_allocated(page);
+            moved_dirs += (dirs[page / 8] >> (page % 8)) & 1;
+        }
+    }
+    if (moved > free_pages) {
+        return -ENOSPC;
+    }
+    if (moved_dirs && atomic_load(&g_open_handles)) {
+        return -EBUSY;
+    }
+
+    int dest = 1;
+    for (int page = pages; page < former; page++) {
+        if (!page_allocated(page)) {
+            continue;
+        }
+        while (page_allocated(dest)) {
+            dest++;
+        }
+        header->pages_bitmap[dest / 8] |= 1 << (dest % 8);
+        header->pages_bitmap[page / 8] &= ~(1 << (page % 8));
+        memcpy(CONTENT_FROM_PAGE(dest), CONTENT_FROM_PAGE(page), PAGE_BYTES);
+        MARK_DIRTY(CONTENT_FROM_PAGE(dest));
+        map[page] = dest;
+        /* The entries of a moved directory keep their hotness */
+        if ((dirs[page / 8] >> (page % 8)) & 1) {
+            for (int i = 0; i < (int) DIR_MAX_ENTRIES; i++) {
+                hotness_move((ZealFileEntry*) CONTENT_FROM_PAGE(dest) + i,
+                             (ZealFileEntry*) CONTENT_FROM_PAGE(page) + i);
+                digest_move((ZealFileEntry*) CONTENT_FROM_PAGE(dest) + i,
+                            (ZealFileEntry*) CONTENT_FROM_PAGE(page) + i);
+            }
+        }
+    }
+    MARK_DIRTY(header);
+    uint8_t visited[BITMAP_SIZE] = { 0 };
+    remap_directory(header->entries, ROOT_MAX_ENTRIES, map, visited);
+    metadata_changed();
+    return 0;
+}
+
+
+/**
+ * @brief Resize the mounted image, its bitmap is extended or reduced. When shrinking, the pages
+ *        past the new end are moved first, and the image file is truncated. The volume must be
+ *        locked for writing.
+ *
+ * @param size New size of the image in bytes, a multiple of 8 pages.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int resize_image(int size)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    const int pages = size >> g_page_shift;
+    const int former = header->bitmap_size * 8;
+
+    /* Archives, stores, containers and partitions have a fixed geometry */
+    if (g_archive_entry || g_store_image.refs || g_container.chunks || g_volume.fd < 0 ||
+        g_partition_count > 1) {
+        return -EOPNOTSUPP;
+    }
+    if (size <= 0 || size % PAGE_BYTES || pages % 8 || pages > VOLUME_MAX_PAGES) {
+        return -EINVAL;
+    }
+
+    if (pages > former) {
+        if (ftruncate(g_volume.fd, MAX(size, g_volume.size)) != 0) {
+            return -errno;
+        }
+        memset(header->pages_bitmap + former / 8, 0, (pages - former) / 8);
+        header->free_pages += pages - former;
+    } else if (pages < former) {
+        int err = relocate_pages(pages);
+        if (err) {
+            return err;
+        }
+        header->free_pages -= former - pages;
+    }
+    header->bitmap_size = pages / 8;
+    MARK_DIRTY(header);
+
+    /* The dropped pages read as zeros if the image grows again */
+    if (size < g_volume.size) {
+        memset(g_image + size, 0, g_volume.size - size);
+        for (int page = pages; page < IMAGE_PAGES; page++) {
+            g_volume.dirty[page / 8] &= ~(1 << (page % 8));
+        }
+    }
+    g_volume.size = size;
+    options.size = size;
+    /* The chains are bounded by the new number of pages */
+    cost_init(2 * IMAGE_PAGES, options.op_time_bound);
+    if (volume_flush(&g_volume) != 0) {
+        return -EIO;
+    }
+    return ftruncate(g_volume.fd, size) == 0 ? 0 : -errno;
+}
+
+
+/**
+ * @brief Handle the commands of zealfs_ioctl.h, issued on any file or directory of the mount point.
+ */
+#if FUSE_USE_VERSION < 35
+static int zealfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                        unsigned int flags, void *data)
+#else
+static int zealfs_ioctl(const char *path, unsigned int cmd, void *arg, struct fuse_file_info *fi,
+                        unsigned int flags, void *data)
+#endif
+{
+    (void) path;
+    (void) arg;
+    (void) fi;
+    if (flags & FUSE_IOCTL_COMPAT) {
+        return -ENOSYS;
+    }
+    if ((unsigned int) cmd == ZEALFS_IOC_RESIZE) {
+        const uint32_t size_kb = *(const uint32_t*) data;
+        if (size_kb > VOLUME_MAX_SIZE / 1024) {
+            return -EINVAL;
+        }
+        BEGIN_WRITE_OP(SCHED_META);
+        cost_args("%s resize=%uKB", path, size_kb);
+        const int err = resize_image(size_kb * 1024);
+        if (err == 0) {
+            change_record("resize", "/", size_kb * 1024, t_op_written);
+        }
+        return err;
+    }
+    if ((unsigned int) cmd == ZEALFS_IOC_TREE_INFO) {
+        zealfs_partition* part = current_partition();
+        ZealTreeInfo* info = data;
+        pthread_mutex_lock(&part->tree_lock);
+        int err = tree_update();
+        info->generation = part->tree_generation;
+        info->size = part->tree_size;
+        info->entries = part->tree_entries;
+        pthread_mutex_unlock(&part->tree_lock);
+        return err;
+    }
+    return -ENOTTY;
+}
+
+
+/**
+ * @brief Poll an opened file. Only the change feed can have nothing to read, the other files are
+ *        always ready.
+ */
+static int zealfs_poll(const char *path, struct fuse_file_info *fi, struct fuse_pollhandle *ph,
+                       unsigned *reventsp)
+{
+    (void) path;
+    virtual_file* file = virtual_handle(fi);
+    if (file == NULL || !file->feed) {
+        if (ph) {
+            fuse_pollhandle_destroy(ph);
+        }
+        *reventsp = POLLIN | POLLRDNORM | (file ? 0 : POLLOUT | POLLWRNORM);
+        return 0;
+    }
+
+    zealfs_partition* part = current_partition();
+    pthread_mutex_lock(&part->changes_lock);
+    /* Notified, then destroyed, when the next event is recorded */
+    if (ph) {
+        if (file->poll) {
+            fuse_pollhandle_destroy(file->poll);
+        }
+        file->poll = ph;
+    }
+    const int ready = file->pos < file->size || file->seq != part->changes_seq;
+    *reventsp = ready ? POLLIN | POLLRDNORM : 0;
+    pthread_mutex_unlock(&part->changes_lock);
+    return 0;
+}
+
+
+/**
+ * @brief Copy the value of an extended attribute, or only give its size when `size` is 0.
+ */
+static int xattr_reply(const char* value, int len, char* out, size_t size)
+{
+    if (size == 0) {
+        return len;
+    }
+    if (size < (size_t) len) {
+        return -ERANGE;
+    }
+    memcpy(out, value, len);
+    return len;
+}
+
+
+/**
+ * @brief Get an extended attribute of a file or directory, see XATTR_HASH and XATTR_PAGES.
+ */
+static int zealfs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    const int virtual = virtual_lookup(path);
+    if (virtual != -1) {
+        return virtual == -ENOENT ? virtual : -ENODATA;
+    }
+    const int hash = strcmp(name, XATTR_HASH) == 0;
+    if (!hash && strcmp(name, XATTR_PAGES) != 0) {
+        return -ENODATA;
+    }
+    if (strcmp(path, "/") == 0) {
+        return -ENODATA;
+    }
+
+    BEGIN_READ_OP(SCHED_META);
+    cost_args("%s %s", path, name);
+    ZealFileEntry* entry = (ZealFileEntry*) browse_path(path + 1, header->entries, 1, NULL);
+    if (entry == NULL) {
+        return -ENOENT;
+    }
+    if (entry_check(entry)) {
+        return -EIO;
+    }
+    /* Enough for the pages of the biggest image, none consecutive */
+    char text[BITMAP_SIZE * 8 * 4 + 8];
+    int len = 0;
+    if (!hash) {
+        len = chain_summary(entry, text, sizeof(text));
+    } else if (entry->flags & IS_DIR) {
+        return -ENODATA;
+    } else {
+        uint64_t digest = 0;
+        const int err = file_digest(entry, &digest);
+        if (err) {
+            return err;
+        }
+        len = snprintf(text, sizeof(text), "%016llx", (unsigned long long) digest);
+    }
+    return xattr_reply(text, len, value, size);
+}
+
+
+/**
+ * @brief List the extended attributes of a file or directory.
+ */
+static int zealfs_listxattr(const char *path, char *list, size_t size)
+{
+    static const char file_names[] = XATTR_HASH "\0" XATTR_PAGES;
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    const int virtual = virtual_lookup(path);
+    if (virtual != -1) {
+        return virtual == -ENOENT ? virtual : 0;
+    }
+    if (strcmp(path, "/") == 0) {
+        return 0;
+    }
+
+    BEGIN_READ_OP(SCHED_META);
+    cost_args("%s", path);
+    ZealFileEntry* entry = (ZealFileEntry*) browse_path(path + 1, header->entries, 1, NULL);
+    if (entry == NULL) {
+        return -ENOENT;
+    }
+    /* Directories have no hash, only their page is given */
+    if (entry->flags & IS_DIR) {
+        return xattr_reply(XATTR_PAGES, sizeof(XATTR_PAGES), list, size);
+    }
+    return xattr_reply(file_names, sizeof(file_names), list, size);
+}
+
+
+/**
+ * @brief Called when the image in unmounted.
+ *
+ * This function will flush the modified pages of the cache (disk image) into the file.
+ */
+static void zealfs_destroy(void *private_data)
+{
+    /* The destruction may be carried out by a thread serving another mount point */
+    if (private_data) {
+        t_partition = private_data;
+    }
+    if (options.serve) {
+        server_stop();
+    }
+    /* Flush cached data to file */
+    close_image();
+}
+
+
+/**
+ * @brief Zero the free pages that still contain data, they will be punched out of the image
+ *        file on the next flush.
+ */
+static void zero_free_pages(void)
+{
+    for (int page = 1; page < IMAGE_PAGES; page++) {
+        uint8_t* content = CONTENT_FROM_PAGE(page);
+        if (!page_allocated(page) && (content[0] != 0 || memcmp(content, content + 1, PAGE_PAYLOAD) != 0)) {
+            memset(content, 0, PAGE_BYTES);
+            volume_mark_dirty(&g_volume, page);
+        }
+    }
+}
+
+
+/**
+ * @brief Look for the image to mount in the archive given with --archive.
+ *
+ * @return File descriptor of the archive on success, -1 on error.
+ */
+static int open_from_archive(void)
+{
+    struct stat st;
+    int err = archive_open(&g_archive, options.archive, !options.fsck);
+    if (err) {
+        printf("Could not open archive %s: %s\n", options.archive, strerror(-err));
+        return -1;
+    }
+
+    g_archive_entry = archive_find(&g_archive, options.imagefile);
+    if (g_archive_entry == NULL) {
+        printf("Could not find image %s in archive %s\n", options.imagefile, options.archive);
+    } else if (fstat(g_archive.fd, &st) != 0 || g_archive_entry->size > 256 * 1024 ||
+               g_archive_entry->offset + g_archive_entry->size > (uint64_t) st.st_size) {
+        printf("Invalid size for image %s in archive %s\n", options.imagefile, options.archive);
+    } else {
+        options.size = g_archive_entry->size;
+        return g_archive.fd;
+    }
+
+    archive_close(&g_archive);
+    g_archive_entry = NULL;
+    return -1;
+}
+
+
+/**
+ * @brief Set the size of the pages of the image.
+ *
+ * @param order Pages are (256 << order) bytes big.
+ *
+ * @return 0 on success, 1 if the image cannot use such pages.
+ */
+static int set_page_order(int order)
+{
+    if (order > PAGE_ORDER_MAX) {
+        printf("Error: invalid page size in the image. Corrupted file?\n");
+        return 1;
+    }
+    /* Stores and compressed images split the images in 256-byte units */
+    if (order != 0 && (options.store || g_container.chunks)) {
+        printf("Error: stored and compressed images must have 256-byte pages\n");
+        return 1;
+    }
+    if ((options.size >> (8 + order)) > VOLUME_MAX_PAGES || options.size % (256 << order)) {
+        printf("Error: invalid size %d for an image with %d-byte pages\n", options.size, 256 << order);
+        return 1;
+    }
+    g_page_shift = 8 + order;
+    g_volume.page_shift = g_page_shift;
+    return 0;
+}
+
+
+/**
+ * @brief Get the name of one of the images created with --count: the index is inserted before
+ *        the extension of --image, e.g. `disk-3.img`.
+ */
+static void numbered_image_name(char* name, size_t size, int index)
+{
+    const char* image = options.imagefile;
+    const char* slash = strrchr(image, '/');
+    const char* ext = strrchr(slash ? slash : image, '.');
+    if (ext == NULL || ext == image || ext[-1] == '/') {
+        ext = image + strlen(image);
+    }
+    snprintf(name, size, "%.*s-%d%s", (int) (ext - image), image, index, ext);
+}
+
+
+/**
+ * @brief Create and format the --count images, the existing files are not overwritten.
+ *
+ * @return 0 on success, exit code of the program else.
+ */
+static int format_images(void)
+{
+    char name[PATH_MAX];
+
+    if (volume_init(&g_volume, -1, options.size) ||
+        set_page_order(__builtin_ctz(options.page_size) - 8)) {
+        return 1;
+    }
+    g_image = g_volume.image;
+
+    for (int i = 0; i < options.count; i++) {
+        numbered_image_name(name, sizeof(name), i);
+        int fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 || format(fd)) {
+            printf("Could not create image %s: %s\n", name, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return 3;
+        }
+        close(fd);
+    }
+    printf("Info: %d images created\n", options.count);
+    return 0;
+}
+
+
+/**
+ * @brief Open the image given in the options, from an archive, a store, a compressed image or a
+ *        plain file, which is created if needed. The image is then loaded in the volume and
+ *        checked.
+ *
+ * @return 0 on success, exit code of the program else.
+ */
+static int open_image(void)
+{
+    /* Check if the file is already existing */
+    struct stat st = { 0 };
+    int trunc = 0;
+    int fd = -1;
+    if (options.archive) {
+        fd = open_from_archive();
+        if (fd < 0) {
+            return 2;
+        }
+    } else if (options.store) {
+        if (open_from_store()) {
+            return 2;
+        }
+    } else if (options.partitions) {
+        /* The file was opened and its partitions found by `open_partitions` */
+        fd = g_partition_fd;
+        options.size = current_partition()->size;
+    } else if (container_detect(options.imagefile)) {
+        fd = open_from_container();
+        if (fd < 0) {
+            return 2;
+        }
+    } else if (stat(options.imagefile, &st) != 0) {
+        /* File doesn't exist, we need to truncate the new file */
+        trunc = 1;
+        if (options.fsck) {
+            perror("Could not check image file");
+            return 2;
+        }
+    } else if (st.st_size > VOLUME_MAX_SIZE) {
+        printf("Error: image file %s is too big, volumes are at most %d KB\n",
+               options.imagefile, VOLUME_MAX_SIZE / 1024);
+        return 2;
+    } else {
+        options.size = st.st_size;
+    }
+
+    if (fd < 0 && !options.store) {
+        fd = open(options.imagefile, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            perror("Could not open image file");
+            return 2;
+        }
+    }
+
+    /* Create a cache for the file */
+    if (volume_init(&g_volume, fd, options.size)) {
+        if (options.size > VOLUME_MAX_SIZE) {
+            printf("Error: image of %d KB is too big, volumes are at most %d KB\n",
+                   options.size / 1024, VOLUME_MAX_SIZE / 1024);
+        } else {
+            printf("Error: could not allocate the cache of the image\n");
+        }
+        return 2;
+    }
+    g_image = g_volume.image;
+    g_hotness = calloc(VOLUME_MAX_SIZE / sizeof(ZealFileEntry), sizeof(file_hotness));
+    g_digests = calloc(VOLUME_MAX_SIZE / sizeof(ZealFileEntry), sizeof(atomic_ulong));
+    current_partition()->changes = calloc(CHANGES_MAX, sizeof(change_event));
+    current_partition()->change_paths = malloc(CHANGES_PATHS_SIZE);
+    if (g_hotness == NULL || g_digests == NULL || current_partition()->changes == NULL ||
+        current_partition()->change_paths == NULL) {
+        printf("Error: could not allocate the statistics of the image\n");
+        return 2;
+    }
+    if (g_archive_entry) {
+        g_volume.offset = g_archive_entry->offset;
+    } else if (options.partitions) {
+        g_volume.offset = current_partition()->offset;
+    }
+    /* Zeroed chunks are never stored in a compressed image, it is always sparse */
+    if (options.sparse && fd >= 0 && !g_container.chunks && fstat(fd, &st) == 0) {
+        g_volume.sparse_block = st.st_blksize;
+    }
+    sched_init(&g_sched, options.sched_delay * 1000);
+
+    if (trunc) {
+        if (set_page_order(__builtin_ctz(options.page_size) - 8)) {
+            return 1;
+        }
+        if (format(fd)) {
+            perror("Could not set new file size");
+            return 3;
+        }
+    }
+
+    if (options.store) {
+        if (load_from_store()) {
+            printf("Could not read image %s from store %s\n", options.imagefile, options.store);
+            return 2;
+        }
+    } else if (g_container.chunks) {
+        g_volume.fault = fault_from_container;
+        g_volume.fault_pages = g_container.header.chunk_pages;
+        g_volume.flush = flush_to_container;
+        /* Load the header now, the integrity check needs it */
+        volume_page(&g_volume, 0);
+    } else if (!trunc && volume_load(&g_volume)) {
+        perror("Could not read image file");
+        return 2;
+    }
+
+    /* The geometry of an existing image is given by its header */
+    if (!trunc && set_page_order(((ZealFSHeader*) g_image)->page_order)) {
+        return 4;
+    }
+    if (options.pack && g_page_shift != 8) {
+        printf("Info: packing disabled, it needs 256-byte pages\n");
+        options.pack = 0;
+    }
+    /* An operation never needs to follow a chain more than twice */
+    cost_init(2 * IMAGE_PAGES, options.op_time_bound);
+
+    /* Check the integrity of the image */
+    if (check_integrity(NULL)) {
+        return 4;
+    }
+    if (g_volume.sparse_block && !options.fsck) {
+        zero_free_pages();
+    }
+    if (options.hotness) {
+        hotness_load();
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Open the image file given with --image, and each of the volumes stored back to back in
+ *        it. The size of a volume is given by its header, the next one starts right after it.
+ *
+ * @return 0 on success, exit code of the program else.
+ */
+static int open_partitions(void)
+{
+    struct stat st;
+    g_partition_fd = open(options.imagefile, O_RDWR);
+    if (g_partition_fd < 0 || fstat(g_partition_fd, &st) != 0) {
+        perror("Could not open image file");
+        return 2;
+    }
+
+    int count = 0;
+    for (off_t offset = 0; offset < st.st_size || count == 0; count++) {
+        ZealFSHeader header;
+        if (count == PARTITIONS_MAX) {
+            printf("Error: more than %d partitions in the image\n", PARTITIONS_MAX);
+            return 4;
+        }
+        int size = 0;
+        if (pread(g_partition_fd, &header, sizeof(header), offset) == sizeof(header) &&
+            header.magic == 'Z' && header.page_order <= PAGE_ORDER_MAX) {
+            size = (header.bitmap_size * 8) << (8 + header.page_order);
+        }
+        if (size == 0 || offset + size > st.st_size) {
+            printf("Error: invalid partition at offset %ld in the image. Corrupted file?\n", (long) offset);
+            return 4;
+        }
+        g_partitions[count].offset = offset;
+        g_partitions[count].size = size;
+        offset += size;
+    }
+    g_partition_count = count;
+
+    int max_pages = 0;
+    for (int i = 0; i < count; i++) {
+        t_partition = &g_partitions[i];
+        printf("Info: partition %d, %dKB at offset %ldKB\n", i, t_partition->size / 1024,
+               (long) t_partition->offset / 1024);
+        int ret = open_image();
+        if (ret) {
+            return ret;
+        }
+        max_pages = MAX(max_pages, IMAGE_PAGES);
+    }
+    t_partition = &g_partitions[0];
+    /* The bound of the chains must fit the biggest partition */
+    cost_init(2 * max_pages, options.op_time_bound);
+    return 0;
+}
+
+
+/**
+ * @brief Write the modified pages of all the partitions, the writes contiguous in the image file
+ *        being coalesced, even across partitions.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int flush_partitions(void)
+{
+    zealfs_volume* vols[PARTITIONS_MAX];
+    /* The partitions are always locked in the same order */
+    for (int i = 0; i < g_partition_count; i++) {
+        vols[i] = volume_rdlock(&g_partitions[i].volume);
+    }
+    int err = volume_flush_group(vols, g_partition_count);
+    for (int i = 0; i < g_partition_count; i++) {
+        volume_unlock(vols[i]);
+    }
+    return err;
+}
+
+
+/* Kind of object designated by a handle of the embedding API */
+typedef enum {
+    EMBED_FREE = 0,
+    EMBED_FILE,
+    EMBED_DIR,
+} embed_type;
+
+/* Opened file or directory of the embedding API */
+typedef struct {
+    embed_type type;
+    /* Same information as for the FUSE operations */
+    struct fuse_file_info fi;
+    /* Path of an opened file, given to the operations, see `open_rename` */
+    char path[PATH_MAX];
+    /* Position in a file, index of the next entry in a directory */
+    int position;
+    /* Set while an asynchronous operation is pending, cleared by the background thread */
+    atomic_int busy;
+    /* Pending asynchronous operation */
+    int writing;
+    void* buf;
+    int size;
+    zealfs_embed_cb callback;
+    void* arg;
+} embed_handle;
+
+_Static_assert(ZEALFS_EMBED_NAME_LEN == NAME_MAX_LEN, "Names of the embedding API must match the entries");
+
+/* State of the embedding API, see zealfs_embed.h */
+static struct {
+    embed_handle handles[ZEALFS_EMBED_HANDLES];
+    /* Background thread carrying out the asynchronous operations that would block */
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Number of asynchronous operations not completed yet */
+    atomic_int pending;
+    int stop;
+} g_embed = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+
+/**
+ * @brief Get the handle of an opened object.
+ *
+ * @param type Type the object must have, EMBED_FREE to accept both files and directories.
+ *
+ * @return Handle on success, NULL if not opened or of the wrong type.
+ */
+static embed_handle* embed_get(int handle, embed_type type)
+{
+    if (handle < 0 || handle >= ZEALFS_EMBED_HANDLES || g_embed.handles[handle].type == EMBED_FREE) {
+        return NULL;
+    }
+    embed_handle* result = &g_embed.handles[handle];
+    return type == EMBED_FREE || result->type == type ? result : NULL;
+}
+
+
+/**
+ * @brief Get a free handle and initialize it.
+ *
+ * @return Index of the handle, -EMFILE if all the handles are used.
+ */
+static int embed_alloc(embed_type type, const struct fuse_file_info* fi)
+{
+    for (int i = 0; i < ZEALFS_EMBED_HANDLES; i++) {
+        embed_handle* handle = &g_embed.handles[i];
+        if (handle->type == EMBED_FREE) {
+            handle->type = type;
+            handle->fi = *fi;
+            handle->position = 0;
+            return i;
+        }
+    }
+    return -EMFILE;
+}
+
+
+/**
+ * @brief Read or write a file at its current position, which is then advanced.
+ */
+static int embed_transfer(embed_handle* handle, void* buf, int size, int writing)
+{
+    if (size < 0) {
+        return -EINVAL;
+    }
+    const int ret = writing ? zealfs_write(handle->path, buf, size, handle->position, &handle->fi) :
+                              zealfs_read(handle->path, buf, size, handle->position, &handle->fi);
+    if (ret > 0) {
+        handle->position += ret;
+    }
+    return ret;
+}
+
+
+/**
+ * @brief Same as `embed_transfer` for a regular file, with the volume already locked, for writing
+ *        if `writing` is set. The operation is not scheduled, it is only done if it can be done
+ *        right away.
+ */
+static int embed_transfer_locked(embed_handle* handle, void* buf, int size, int writing)
+{
+    if (size < 0) {
+        return -EINVAL;
+    }
+    OP_COST_SCOPE();
+    cost_args("%s size=%d offset=%d", handle->path, size, handle->position);
+    const open_file* open = open_handle(&handle->fi);
+    const int ret = writing ? open_write(open, handle->path, buf, size, handle->position) :
+                              open_read(open, buf, size, handle->position);
+    if (ret > 0) {
+        handle->position += ret;
+    }
+    return ret;
+}
+
+
+/**
+ * @brief Check whether the pages of a file up to the given offset are all in the cache, so that
+ *        accessing them won't wait for the image to be loaded. Must be called with the volume
+ *        locked.
+ */
+static int embed_resident(embed_handle* handle, int end, int writing)
+{
+    if (g_volume.fault == NULL || virtual_handle(&handle->fi)) {
+        return 1;
+    }
+    const open_file* open = open_handle(&handle->fi);
+    ZealFileEntry* entry = open->entry;
+    /* Removed files fail right away */
+    if (entry == NULL || open->cache || cache_find(entry)) {
+        return 1;
+    }
+    /* Growing the file may allocate pages anywhere in the image */
+    if (writing && end > entry->size) {
+        return 0;
+    }
+    if (entry_check(entry)) {
+        /* The operation fails right away */
+        return 1;
+    }
+    if (entry->flags & IS_PACKED) {
+        return entry->start_page == 0 || volume_is_loaded(&g_volume, entry->start_page);
+    }
+    end = MIN(end, entry->size);
+    const int pages = end == 0 ? 1 : (end + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+    uint8_t page = entry->start_page;
+    for (int i = 0; i < pages && page_valid(page); i++) {
+        if (!volume_is_loaded(&g_volume, page)) {
+            return 0;
+        }
+        page = g_image[page << g_page_shift];
+    }
+    return 1;
+}
+
+
+/**
+ * @brief Background thread carrying out the asynchronous operations, one at a time.
+ */
+static void* embed_worker(void* arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&g_embed.lock);
+    while (!g_embed.stop || atomic_load(&g_embed.pending)) {
+        embed_handle* handle = NULL;
+        for (int i = 0; i < ZEALFS_EMBED_HANDLES && handle == NULL; i++) {
+            if (atomic_load(&g_embed.handles[i].busy)) {
+                handle = &g_embed.handles[i];
+            }
+        }
+        if (handle == NULL) {
+            pthread_cond_wait(&g_embed.cond, &g_embed.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&g_embed.lock);
+
+        const int result = embed_transfer(handle, handle->buf, handle->size, handle->writing);
+        const zealfs_embed_cb callback = handle->callback;
+        void* const callback_arg = handle->arg;
+        /* The callback can issue another operation on the same handle */
+        atomic_store(&handle->busy, 0);
+        atomic_fetch_sub(&g_embed.pending, 1);
+        if (callback) {
+            callback(handle - g_embed.handles, result, callback_arg);
+        }
+
+        pthread_mutex_lock(&g_embed.lock);
+    }
+    pthread_mutex_unlock(&g_embed.lock);
+    return NULL;
+}
+
+
+/**
+ * @brief Read or write a file without waiting: the operation is done right away if the volume
+ *        is not locked, no other asynchronous operation is pending, and the pages are in the
+ *        cache. Else, it is queued for the background thread.
+ */
+static int embed_submit(int index, void* buf, int size, int writing, zealfs_embed_cb callback, void* arg)
+{
+    embed_handle* handle = embed_get(index, EMBED_FILE);
+    if (handle == NULL) {
+        return -EBADF;
+    }
+    if (atomic_load(&handle->busy)) {
+        return -EBUSY;
+    }
+
+    if (atomic_load(&g_embed.pending) == 0) {
+        pthread_rwlock_t* lock = &g_volume.lock;
+        /* Virtual files are not in the image */
+        if (virtual_handle(&handle->fi)) {
+            return embed_transfer(handle, buf, size, writing);
+        }
+        if ((writing ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock)) == 0) {
+            /* Transfer while holding the lock taken, taking it again could block */
+            if (embed_resident(handle, handle->position + MAX(size, 0), writing)) {
+                const int ret = embed_transfer_locked(handle, buf, size, writing);
+                volume_unlock(&g_volume);
+                return ret;
+            }
+            /* Nothing was modified, no need to signal the volume */
+            pthread_rwlock_unlock(lock);
+        }
+    }
+
+    handle->writing = writing;
+    handle->buf = buf;
+    handle->size = size;
+    handle->callback = callback;
+    handle->arg = arg;
+    pthread_mutex_lock(&g_embed.lock);
+    atomic_fetch_add(&g_embed.pending, 1);
+    atomic_store(&handle->busy, 1);
+    pthread_cond_signal(&g_embed.cond);
+    pthread_mutex_unlock(&g_embed.lock);
+    return -EWOULDBLOCK;
+}
+
+
+/**
+ * @brief Close the image and free its pages. `close_image` keeps them for `flush_partitions`,
+ *        while an embedded image can be mounted again afterwards.
+ */
+static void embed_close_image(void)
+{
+    close_image();
+    free(g_volume.image);
+    g_volume.image = NULL;
+    g_image = NULL;
+}
+
+
+int zealfs_embed_mount(const char* image, int size_kb)
+{
+    return zealfs_embed_mount_options(image, size_kb, NULL);
+}
+
+
+int zealfs_embed_mount_options(const char* image, int size_kb, const zealfs_embed_options* opts)
+{
+    const int page_size = (opts && opts->page_size) ? opts->page_size : 256;
+    if (page_size != 256 && page_size != 512 && page_size != 1024) {
+        return -EINVAL;
+    }
+    /* An image has at most 256 pages */
+    if (size_kb <= 0 || size_kb > page_size / 4) {
+        return -EINVAL;
+    }
+    options.imagefile = image;
+    options.size = size_kb * 1024;
+    options.page_size = page_size;
+    options.pack = opts && opts->pack;
+    options.compress = opts && opts->compress;
+    options.sched_delay = DEFAULT_SCHED_DELAY_MS;
+    options.op_time_bound = DEFAULT_COST_MAX_US;
+    if (open_image()) {
+        /* The image may have been loaded before being rejected */
+        if (g_image) {
+            embed_close_image();
+        }
+        return -EIO;
+    }
+
+    g_embed.stop = 0;
+    if (pthread_create(&g_embed.worker, NULL, embed_worker, NULL) != 0) {
+        embed_close_image();
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+
+void zealfs_embed_unmount(void)
+{
+    pthread_mutex_lock(&g_embed.lock);
+    g_embed.stop = 1;
+    pthread_cond_signal(&g_embed.cond);
+    pthread_mutex_unlock(&g_embed.lock);
+    pthread_join(g_embed.worker, NULL);
+
+    for (int i = 0; i < ZEALFS_EMBED_HANDLES; i++) {
+        if (g_embed.handles[i].type != EMBED_FREE) {
+            zealfs_embed_close(i);
+        }
+    }
+    embed_close_image();
+}
+
+
+int zealfs_embed_open(const char* path, int flags)
+{
+    struct fuse_file_info fi = { .flags = flags & O_ACCMODE };
+    const int writing = (flags & O_ACCMODE) != O_RDONLY;
+
+    if (strlen(path) >= PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    int err = zealfs_open(path, &fi);
+    if (err == -ENOENT && (flags & O_CREAT)) {
+        err = zealfs_create(path, 0644, &fi);
+    } else if (err == 0 && (flags & O_TRUNC) && writing) {
+        err = zealfs_truncate(path, 0, &fi);
+        if (err) {
+            zealfs_release(path, &fi);
+        }
+    }
+    if (err) {
+        return err;
+    }
+
+    const int handle = embed_alloc(EMBED_FILE, &fi);
+    if (handle < 0) {
+        zealfs_release(path, &fi);
+        return handle;
+    }
+    embed_handle* opened = &g_embed.handles[handle];
+    strcpy(opened->path, path);
+    if (!open_handle(&fi)->virtual) {
+        open_handle(&fi)->path = opened->path;
+    }
+    return handle;
+}
+
+
+int zealfs_embed_opendir(const char* path)
+{
+    struct fuse_file_info fi = { 0 };
+    const int err = zealfs_opendir(path, &fi);
+    return err ? err : embed_alloc(EMBED_DIR, &fi);
+}
+
+
+int zealfs_embed_close(int index)
+{
+    embed_handle* handle = embed_get(index, EMBED_FREE);
+    int err = 0;
+
+    if (handle == NULL) {
+        return -EBADF;
+    }
+    if (atomic_load(&handle->busy)) {
+        return -EBUSY;
+    }
+    if (handle->type == EMBED_FILE) {
+        err = zealfs_flush(handle->path, &handle->fi);
+        zealfs_release(handle->path, &handle->fi);
+    } else {
+        zealfs_releasedir(NULL, &handle->fi);
+    }
+    handle->type = EMBED_FREE;
+    return err;
+}
 
-    size = MIN(size, entry->size);
-    const int total = size;
 
-    uint8_t* page = CONTENT_FROM_PAGE(entry->start_page);
-    while (jump_pages) {
-        page = CONTENT_FROM_PAGE(*page);
-        jump_pages--;
+int zealfs_embed_read(int index, void* buf, int size)
+{
+    embed_handle* handle = embed_get(index, EMBED_FILE);
+    if (handle == NULL) {
+        return -EBADF;
     }
+    return atomic_load(&handle->busy) ? -EBUSY : embed_transfer(handle, buf, size, 0);
+}
 
-    while (size) {
-        int count = MIN(255 - offset_in_page, size);
-        memcpy(buf, page + 1 + offset_in_page, count);
-        buf += count;
-        if (size != count) {
-            page = CONTENT_FROM_PAGE(*page);
-        }
-        size -= count;
-        offset_in_page = 0;
+
+int zealfs_embed_write(int index, const void* buf, int size)
+{
+    embed_handle* handle = embed_get(index, EMBED_FILE);
+    if (handle == NULL) {
+        return -EBADF;
     }
+    return atomic_load(&handle->busy) ? -EBUSY : embed_transfer(handle, (void*) buf, size, 1);
+}
 
-    return total;
+
+int zealfs_embed_read_async(int handle, void* buf, int size, zealfs_embed_cb callback, void* arg)
+{
+    return embed_submit(handle, buf, size, 0, callback, arg);
 }
 
 
-/**
- * @brief Write data to an opened file.
- *
- * @param path Path of the file to write. (unused)
- * @param buf Buffer containing the data to write to file.
- * @param size Size of the buffer.
- * @param offset Offset in the file to start writing from.
- * @param fi File info containing the ZealFS Entry address of the opened file.
- *
- * @return number of bytes written to the file, -EFBIG if the size is too big.
- */
-static int zealfs_write(const char *path, const char *buf, size_t size, off_t offset,
-              struct fuse_file_info *fi)
+int zealfs_embed_write_async(int handle, const void* buf, int size, zealfs_embed_cb callback, void* arg)
 {
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
-    ZealFileEntry* entry = (ZealFileEntry*) fi->fh;
-    int jump_pages = offset / 255;
-    int offset_in_page = offset % 255;
-    const int remaining_in_page = 255 - offset_in_page;
+    return embed_submit(handle, (void*) buf, size, 1, callback, arg);
+}
 
-    const int total = size;
 
-    /* Check if we have enough pages. */
-    if (header->free_pages * 255 + remaining_in_page < size) {
-        return -EFBIG;
+/**
+ * @brief Get the size of an opened file.
+ */
+static int embed_size(embed_handle* handle)
+{
+    const virtual_file* file = virtual_handle(&handle->fi);
+    if (file) {
+        return file->size;
     }
 
-    uint8_t* page = CONTENT_FROM_PAGE(entry->start_page);
-    while (jump_pages) {
-        page = CONTENT_FROM_PAGE(*page);
-        jump_pages--;
+    BEGIN_READ_OP(SCHED_META);
+    const open_file* open = open_handle(&handle->fi);
+    ZealFileEntry* entry = open->entry;
+    const zealfs_cache* cache = open->cache ? open->cache : cache_find(entry);
+    struct stat st;
+    if (cache) {
+        return cache->size;
+    } else if (entry == NULL) {
+        return -ESTALE;
     }
+    stat_from_entry(entry, &st);
+    return st.st_size;
+}
 
-    while (size) {
-        int count = MIN(255 - offset_in_page, size);
-        // printf("Writing: %d, remaining %ld\n", count, size);
-        memcpy(page + 1 + offset_in_page, buf, count);
-        entry->size += (uint16_t) count;
-        buf += count;
-        size -= count;
 
-        /* In all cases, check the next page */
-        uint8_t next = *page;
-        if (next) {
-            page = CONTENT_FROM_PAGE(*page);
-        } else if (size) {
-            /* Only allocate a new page if we still need to write some bytes */
-            next = allocatePage((ZealFSHeader*) g_image);
-            assert( next != 0 );
-            *page = next;
-            page = CONTENT_FROM_PAGE(next);
-        }
+int zealfs_embed_seek(int index, int offset, int whence)
+{
+    embed_handle* handle = embed_get(index, EMBED_FILE);
+    int base = 0;
 
-        offset_in_page = 0;
+    if (handle == NULL) {
+        return -EBADF;
     }
-
-    return total;
+    if (atomic_load(&handle->busy)) {
+        return -EBUSY;
+    }
+    if (whence == SEEK_CUR) {
+        base = handle->position;
+    } else if (whence == SEEK_END) {
+        base = embed_size(handle);
+    } else if (whence != SEEK_SET) {
+        return -EINVAL;
+    }
+    if (base + offset < 0 || base + offset > UINT16_MAX) {
+        return -EINVAL;
+    }
+    handle->position = base + offset;
+    return handle->position;
 }
 
 
-/**
- * @brief Open a directory from the disk image.
- *
- * @param path Absolute path to the directory to open.
- * @param info Info structure that will be filled with the ZealFileEntry address.
- *
- * @return 0 on success, error code else.
- */
-static int zealfs_opendir(const char * path, struct fuse_file_info * info)
+int zealfs_embed_readdir(int index, zealfs_embed_dirent* dirent)
 {
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    embed_handle* handle = embed_get(index, EMBED_DIR);
+    if (handle == NULL) {
+        return -EBADF;
+    }
 
-    if (strcmp(path, "/") == 0) {
-        return fill_info(info, (uint64_t) &header->entries);
+    ZealFileEntry* entries = (ZealFileEntry*) handle->fi.fh;
+    memset(dirent, 0, sizeof(*dirent));
+    if (entries == NULL) {
+        if (handle->position >= VIRTUAL_FILES_COUNT) {
+            return 0;
+        }
+        strncpy(dirent->name, g_virtual_files[handle->position++].name, ZEALFS_EMBED_NAME_LEN);
+        return 1;
     }
 
-    uint64_t index = browse_path(path + 1, header->entries, 1, NULL);
-    ZealFileEntry* entry = (ZealFileEntry*) index;
-    if (entry) {
-        if (entry->flags & 1) {
-            return fill_info(info, (uint64_t) CONTENT_FROM_PAGE(entry->start_page));
+    BEGIN_READ_OP(SCHED_META);
+    ZealFSHeader* header = (ZealFSHeader*) g_image;
+    const int max_entries = (entries == header->entries) ? ROOT_MAX_ENTRIES : DIR_MAX_ENTRIES;
+    while (handle->position < max_entries) {
+        ZealFileEntry* entry = &entries[handle->position++];
+        if (entry->flags & IS_OCCUPIED) {
+            struct stat st = { 0 };
+            stat_from_entry(entry, &st);
+            strncpy(dirent->name, entry->name, NAME_MAX_LEN);
+            dirent->is_dir = (entry->flags & IS_DIR) != 0;
+            dirent->size = dirent->is_dir ? 0 : st.st_size;
+            return 1;
         }
-        return -ENOTDIR;
     }
-    return -ENOENT;
+    return 0;
 }
 
 
-/**
- * @brief Read all entries from an opened directory.
- *
- * @param path Path of the directory to browse. (unused)
- * @param buf Context given by FUSE when adding new entries.
- * @param filler Function to call to add an entry in the directory.
- * @param offset Unused.
- * @param info Info structure that will be filled with the opened ZealFileEntry address.
- * @param flags Unused.
- */
-static int zealfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-             off_t offset, struct fuse_file_info *info,
-             enum fuse_readdir_flags flags)
+int zealfs_embed_mkdir(const char* path)
 {
-    (void) offset;
-    (void) flags;
+    return zealfs_mkdir(path, 0755);
+}
 
-    ZealFSHeader* header = (ZealFSHeader*) g_image;
-    char name[NAME_MAX_LEN + 1] = { 0 };
 
-    filler(buf, ".", NULL, 0, 0);
-    filler(buf, "..", NULL, 0, 0);
+int zealfs_embed_rmdir(const char* path)
+{
+    return zealfs_rmdir(path);
+}
 
-    ZealFileEntry* entries = (ZealFileEntry*) info->fh;
-    /* If the directory we are browsing is the root directory, we have less entries */
-    const int max_entries = (entries == header->entries) ? ROOT_MAX_ENTRIES : DIR_MAX_ENTRIES;
 
-    /* Browse each entry, looking for an non-empty one thanks to the flags */
-    for (int i = 0; i < max_entries; i++) {
-        const uint8_t flags = entries[i].flags;
-        if (flags & IS_OCCUPIED) {
-            struct stat st = { 0 };
-            stat_from_entry(&entries[i], &st);
-            strncpy(name, entries[i].name, NAME_MAX_LEN);
-            filler(buf, name, &st, 0, 0);
-        }
-    }
+int zealfs_embed_unlink(const char* path)
+{
+    return zealfs_unlink(path);
+}
 
-    return 0;
+
+int zealfs_embed_rename(const char* from, const char* to)
+{
+    return zealfs_rename(from, to, 0);
 }
 
 
-/**
- * @brief Called when the image in unmounted.
- *
- * This function will flush the cache (disk image) into the file.
- */
-static void zealfs_destroy(void *private_data)
+int zealfs_embed_truncate(const char* path, int size)
 {
-    /* Flush cached data to file */
-    lseek(g_fimg, 0, SEEK_SET);
-    write(g_fimg, g_image, options.size);
-    close(g_fimg);
+    return size < 0 ? -EINVAL : zealfs_truncate(path, size, NULL);
+}
+
+
+int zealfs_embed_check(void)
+{
+    int leaked = 0;
+    volume_rdlock(&g_volume);
+    const int err = check_integrity(&leaked);
+    volume_unlock(&g_volume);
+    return err ? -EIO : leaked;
 }
 
 
@@ -728,14 +4685,45 @@ static void show_help(const char *program)
     printf("File-system specific options:\n"
            "    --image=<s>          Name of the image file, \"" DEFAULT_IMAGE_NAME "\" by default\n"
            "    --size=<s>           Size of the new image file in KB (if not existing)\n"
+           "    --pack               Pack new small files together in shared pages\n"
+           "    --compress           Compress the files written, when it saves space\n"
+           "    --serve=<s>          Serve the image pages on the given UNIX socket, the\n"
+           "                         mount point is optional in that case\n"
+           "    --io-uring           Receive the requests over io_uring when supported\n"
+           "    --io-uring-depth=<d> Depth of the io_uring queues\n"
+           "    --max-threads=<n>    Maximum number of worker threads\n"
+           "    --idle-threads=<n>   Maximum number of idle worker threads kept\n"
+           "    --pin-workers        Pin each worker thread to its own CPU\n"
+           "    --sched-delay=<ms>   Maximum time a request can be delayed by higher priority\n"
+           "                         ones, 20ms by default\n"
+           "    --op-time-bound=<us> Report the operations taking longer than this, 10ms by\n"
+           "                         default\n"
+           "    --slow-log=<s>       File where each operation taking longer than the bound\n"
+           "                         is logged, with the time spent in each phase\n"
+           "    --fsck               Check the integrity of the image and exit\n"
+           "    --count=<n>          Create n formatted images named after --image, with\n"
+           "                         their index before the extension, and exit\n"
+           "    --archive=<s>        Archive containing the image, --image is then the name of\n"
+           "                         the image in the archive\n"
+           "    --store=<s>          Deduplicated store containing the image, --image is then\n"
+           "                         the name of the image in the store\n"
+           "    --sparse             Deallocate the free pages from the image file\n"
+           "    --page-size=<n>      Size of the pages of the new image file: 256 (default),\n"
+           "                         512 or 1024 bytes\n"
+           "    --hotness=<s>        File keeping the number of reads of each file between\n"
+           "                         mounts, used by `zealfs-tool relayout`\n"
+           "    --partitions         Mount each of the volumes stored back to back in the image\n"
+           "                         file, on the directories 0, 1... of the mount point\n"
+           "    --flush-period=<ms>  Write the modified pages to the image file periodically,\n"
+           "                         only when unmounting by default\n"
+           "    --cache-timeout=<s>  Time the kernel keeps the attributes and the entries in\n"
+           "                         its cache, 1s by default\n"
            "\n");
 }
 
 
 /**
  * @brief FUSE operations associated to our file system.
- *
- * TODO: Implement truncate function.
  */
 static const struct fuse_operations zealfs_oper = {
     .init     = zealfs_init,
@@ -746,14 +4734,338 @@ static const struct fuse_operations zealfs_oper = {
     .read     = zealfs_read,
     .create   = zealfs_create,
     .write    = zealfs_write,
+    .truncate = zealfs_truncate,
+    .flush    = zealfs_flush,
+    .release  = zealfs_release,
     .unlink   = zealfs_unlink,
     .rename   = zealfs_rename,
     .mkdir    = zealfs_mkdir,
     .rmdir    = zealfs_rmdir,
+    .releasedir = zealfs_releasedir,
+    .ioctl    = zealfs_ioctl,
+    .poll     = zealfs_poll,
+    .getxattr = zealfs_getxattr,
+    .listxattr = zealfs_listxattr,
     .destroy  = zealfs_destroy,
 };
 
 
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 18)
+/**
+ * @brief Check whether the kernel can deliver FUSE requests over io_uring.
+ *        It must have been built with it, and the feature must be enabled in the module.
+ */
+static int kernel_supports_io_uring(void)
+{
+    int value = 'N';
+    FILE* file = fopen("/sys/module/fuse/parameters/enable_uring", "r");
+    if (file) {
+        value = fgetc(file);
+        fclose(file);
+    }
+    return value == 'Y';
+}
+#endif
+
+
+/**
+ * @brief Ask FUSE to use io_uring instead of reading `/dev/fuse`, if both libfuse and the
+ *        kernel support it.
+ *
+ * @return 1 if io_uring will be used, 0 else.
+ */
+static int enable_io_uring(struct fuse_args* args)
+{
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 18)
+    if (!kernel_supports_io_uring()) {
+        printf("Info: io_uring is not enabled in the kernel FUSE module, using /dev/fuse\n");
+        return 0;
+    }
+    char depth[32];
+    assert(fuse_opt_add_arg(args, "-oio_uring") == 0);
+    if (options.io_uring_depth > 0) {
+        snprintf(depth, sizeof(depth), "-oio_uring_q_depth=%d", options.io_uring_depth);
+        assert(fuse_opt_add_arg(args, depth) == 0);
+    }
+    return 1;
+#else
+    (void) args;
+    printf("Info: libfuse %d.%d doesn't support io_uring, using /dev/fuse\n",
+           FUSE_MAJOR_VERSION, FUSE_MINOR_VERSION);
+    return 0;
+#endif
+}
+
+
+/* Periodic flush of the modified pages, see --flush-period */
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+} g_flusher = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* Log of the slow operations, see --slow-log. Opened before being daemonized, the path may be
+ * relative, it is written by a thread started once daemonized. */
+static FILE* g_slow_log;
+
+
+/**
+ * @brief Body of the flusher thread: the modified pages of all the partitions are written every
+ *        --flush-period milliseconds, until stopped.
+ */
+static void* flusher_run(void* arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&g_flusher.lock);
+    while (!g_flusher.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += options.flush_period / 1000;
+        deadline.tv_nsec += (options.flush_period % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&g_flusher.cond, &g_flusher.lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&g_flusher.lock);
+            if (flush_partitions()) {
+                fprintf(stderr, "Error: could not write the modified pages: %s\n", strerror(errno));
+            }
+            pthread_mutex_lock(&g_flusher.lock);
+        }
+    }
+    pthread_mutex_unlock(&g_flusher.lock);
+    return NULL;
+}
+
+
+/**
+ * @brief Process the requests of a mount point until it is unmounted.
+ *        Unlike `fuse_main`, each worker thread gets its own `/dev/fuse` file descriptor, thanks
+ *        to clone_fd, so that the requests are not all received through a single one.
+ *
+ * @return 0 on success, error else.
+ */
+static int run_loop(struct fuse* fuse, const struct fuse_cmdline_opts* opts)
+{
+    int ret;
+    if (opts->singlethread) {
+        ret = fuse_loop(fuse);
+    } else {
+#if FUSE_USE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+        struct fuse_loop_config* config = fuse_loop_cfg_create();
+        fuse_loop_cfg_set_clone_fd(config, 1);
+        fuse_loop_cfg_set_idle_threads(config, options.idle_threads ? options.idle_threads : opts->max_idle_threads);
+        fuse_loop_cfg_set_max_threads(config, options.max_threads ? options.max_threads : opts->max_threads);
+        ret = fuse_loop_mt(fuse, config);
+        fuse_loop_cfg_destroy(config);
+#else
+        /* The maximum number of threads cannot be configured with this version of libfuse */
+        struct fuse_loop_config config = {
+            .clone_fd = 1,
+            .max_idle_threads = options.idle_threads ? options.idle_threads : opts->max_idle_threads,
+        };
+        ret = fuse_loop_mt(fuse, &config);
+#endif
+    }
+    return ret;
+}
+
+
+/* Mount point of a partition served by its own thread */
+typedef struct {
+    struct fuse* fuse;
+    const struct fuse_cmdline_opts* opts;
+    pthread_t thread;
+} partition_session;
+
+
+/**
+ * @brief Body of the threads serving the mount points of the partitions other than the first one.
+ */
+static void* partition_loop(void* arg)
+{
+    partition_session* session = arg;
+    run_loop(session->fuse, session->opts);
+    return NULL;
+}
+
+
+/**
+ * @brief Mount the file system and process the requests until it is unmounted. With partitions,
+ *        each one is mounted on its own directory of the mount point, the first one is served by
+ *        this thread and the others by their own threads. They are all unmounted once the first
+ *        one is.
+ *
+ * @param args Arguments for FUSE, the file-system specific ones have been removed.
+ *
+ * @return 0 on success, error else.
+ */
+static int run_session(struct fuse_args* args)
+{
+    struct fuse_cmdline_opts opts;
+    partition_session sessions[PARTITIONS_MAX] = { 0 };
+    int created = 0;
+    int mounted = 0;
+    int ret = 1;
+
+    if (fuse_parse_cmdline(args, &opts) != 0) {
+        return 1;
+    }
+    if (opts.show_help) {
+        fuse_cmdline_help();
+        fuse_lib_help(args);
+        ret = 0;
+        goto out;
+    }
+    if (opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        ret = 0;
+        goto out;
+    }
+    if (opts.mountpoint == NULL) {
+        printf("Error: no mount point specified\n");
+        goto out;
+    }
+
+    for (int i = 0; i < g_partition_count; i++) {
+        char path[PATH_MAX];
+        const char* mountpoint = opts.mountpoint;
+        if (options.partitions) {
+            snprintf(path, sizeof(path), "%s/%d", opts.mountpoint, i);
+            if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+                perror("Could not create the mount point of a partition");
+                goto out_unmount;
+            }
+            mountpoint = path;
+        }
+        /* Each instance parses its own copy of the arguments */
+        struct fuse_args copy = FUSE_ARGS_INIT(0, NULL);
+        for (int j = 0; j < args->argc; j++) {
+            assert(fuse_opt_add_arg(&copy, args->argv[j]) == 0);
+        }
+        sessions[i].fuse = fuse_new(&copy, &zealfs_oper, sizeof(zealfs_oper), &g_partitions[i]);
+        sessions[i].opts = &opts;
+        fuse_opt_free_args(&copy);
+        if (sessions[i].fuse == NULL) {
+            goto out_unmount;
+        }
+        g_partitions[i].fuse = sessions[i].fuse;
+        created++;
+        if (fuse_mount(sessions[i].fuse, mountpoint) != 0) {
+            goto out_unmount;
+        }
+        mounted++;
+    }
+    if (fuse_daemonize(opts.foreground) != 0 ||
+        fuse_set_signal_handlers(fuse_get_session(sessions[0].fuse)) != 0) {
+        goto out_unmount;
+    }
+
+    /* Started once daemonized, as the threads don't survive the fork */
+    if (options.flush_period > 0 && pthread_create(&g_flusher.thread, NULL, flusher_run, NULL) != 0) {
+        options.flush_period = 0;
+        perror("Could not start the flusher thread");
+    }
+    if (g_slow_log && cost_slow_log_start(g_slow_log, options.op_time_bound) != 0) {
+        perror("Could not start logging the slow operations");
+        fclose(g_slow_log);
+        g_slow_log = NULL;
+    }
+    invalidator_start();
+    for (int i = 1; i < g_partition_count; i++) {
+        assert(pthread_create(&sessions[i].thread, NULL, partition_loop, &sessions[i]) == 0);
+    }
+    ret = run_loop(sessions[0].fuse, &opts);
+    /* Unmounting the other partitions ends their loops */
+    for (int i = 1; i < g_partition_count; i++) {
+        fuse_unmount(sessions[i].fuse);
+        pthread_join(sessions[i].thread, NULL);
+    }
+    invalidator_stop();
+    if (g_slow_log) {
+        cost_slow_log_stop();
+        g_slow_log = NULL;
+    }
+    if (options.flush_period > 0) {
+        pthread_mutex_lock(&g_flusher.lock);
+        g_flusher.stop = 1;
+        pthread_cond_signal(&g_flusher.cond);
+        pthread_mutex_unlock(&g_flusher.lock);
+        pthread_join(g_flusher.thread, NULL);
+    }
+
+    fuse_remove_signal_handlers(fuse_get_session(sessions[0].fuse));
+out_unmount:
+    for (int i = 0; i < mounted; i++) {
+        fuse_unmount(sessions[i].fuse);
+    }
+    for (int i = 0; i < created; i++) {
+        g_partitions[i].fuse = NULL;
+        fuse_destroy(sessions[i].fuse);
+    }
+    /* The partitions were closed, their pages are written together */
+    if (g_partition_count > 1) {
+        if (flush_partitions()) {
+            perror("Could not write the modified pages");
+        }
+        close(g_partition_fd);
+    }
+out:
+    free(opts.mountpoint);
+    return ret ? 1 : 0;
+}
+
+
+/**
+ * @brief Option processing function, used to remember the mount point, if any.
+ */
+static int option_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    if (key == FUSE_OPT_KEY_NONOPT && options.mountpoint == NULL) {
+        options.mountpoint = arg;
+    }
+    /* Keep all the arguments for FUSE */
+    return 1;
+}
+
+
+/**
+ * @brief Serve the image pages without mounting it, until SIGINT or SIGTERM is received.
+ *
+ * @return 0 on success, error else.
+ */
+static int serve_only(void)
+{
+    sigset_t set;
+    int sig = 0;
+
+    /* Block the signals before starting the server, so that its thread inherits the mask */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (server_start(&g_volume, options.serve, NULL, NULL)) {
+        perror("Could not start the page server");
+        return 5;
+    }
+    printf("Info: serving pages on %s\n", options.serve);
+    sigwait(&set, &sig);
+    server_stop();
+
+    close_image();
+    return 0;
+}
+
+
+#ifdef ZEALFS_EMBED
+/* The program embedding the file system has its own main function */
+#define main zealfs_main
+#endif
+
 int main(int argc, char *argv[])
 {
     int ret;
@@ -761,13 +5073,16 @@ int main(int argc, char *argv[])
 
     options.imagefile = strdup(DEFAULT_IMAGE_NAME);
     options.size = DEFAULT_IMAGE_SIZE_KB;
+    options.sched_delay = DEFAULT_SCHED_DELAY_MS;
+    options.op_time_bound = DEFAULT_COST_MAX_US;
+    options.page_size = 256;
 
     /* Parse options */
-    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+    if (fuse_opt_parse(&args, &options, option_spec, option_proc) == -1)
         return 1;
 
     /* When --help is specified, first print our own file-system
-       specific help text, then signal fuse_main to show
+       specific help text, then signal run_session to show
        additional help (by adding `--help` to the options again)
        without usage: line (by setting argv[0] to the empty
        string) */
@@ -778,51 +5093,56 @@ int main(int argc, char *argv[])
     }
 
     printf("Info: using disk image %s\n", options.imagefile);
-    /* Convert the size to bytes and check that it's valid */
-    if (options.size > 64) {
+    if (options.page_size != 256 && options.page_size != 512 && options.page_size != 1024) {
+        printf("Invalid page size %d\n"
+               "Provided page size must be 256, 512 or 1024\n",
+               options.page_size);
+        return 1;
+    }
+    /* Convert the size to bytes and check that it's valid, an image has at most 256 pages */
+    const int max_size = options.page_size / 4;
+    if (options.size > max_size) {
         printf("Invalid size %d\n"
-               "Provided size must be less or equal to 64KB\n",
-               options.size);
+               "Provided size must be less or equal to %dKB\n",
+               options.size, max_size);
         return 1;
     }
     options.size *= 1024;
 
-    /* Check if the file is already existing */
-    struct stat st = { 0 };
-    int trunc = 0;
-    if (stat(options.imagefile, &st) != 0) {
-        /* File doesn't exist, we need to truncate the new file */
-        trunc = 1;
-    } else {
-        options.size = st.st_size;
+    if (options.count > 0) {
+        return format_images();
     }
 
-    /* Create a cache for the file */
-    g_image = calloc(1, options.size);
-    assert(g_image != NULL);
+    /* The partitions share a plain image file, each one with its own geometry */
+    if (options.partitions && (options.archive || options.store || options.serve || options.hotness)) {
+        printf("Partitions cannot be combined with --archive, --store, --serve or --hotness\n");
+        return 1;
+    }
 
-    g_fimg = open(options.imagefile, O_RDWR | O_CREAT, 0644);
-    if (g_fimg < 0) {
-        perror("Could not open image file");
-        return 2;
+    ret = options.partitions ? open_partitions() : open_image();
+    if (ret || options.fsck) {
+        return ret;
+    }
+    if (options.serve && g_page_shift != 8) {
+        printf("The page server only supports images with 256-byte pages\n");
+        return 1;
     }
 
-    if (trunc && format(g_fimg)) {
-        perror("Could not set new file size");
-        return 3;
+    /* The page server can be used without mounting the image */
+    if (options.serve && options.mountpoint == NULL && !options.show_help) {
+        return serve_only();
     }
 
-    if (!trunc) {
-        int rd = read(g_fimg, g_image, options.size);
-        assert(rd == options.size);
+    if (options.slow_log && (g_slow_log = fopen(options.slow_log, "a")) == NULL) {
+        perror("Could not open the log of the slow operations");
+        return 1;
     }
 
-    /* Check the integrity of the image */
-    if (check_integrity()) {
-        return 4;
+    if (options.io_uring && enable_io_uring(&args)) {
+        printf("Info: using io_uring\n");
     }
 
-    ret = fuse_main(args.argc, args.argv, &zealfs_oper, NULL);
+    ret = run_session(&args);
     fuse_opt_free_args(&args);
     return ret;
 }
@@ -0,0 +1,32 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * Commands accepted by the mounted file system, on any file or directory of the mount point,
+ * such as the mount point itself.
+ */
+
+/* Resize the image, the argument is the new size in KB, a multiple of 8 pages. When shrinking,
+ * the pages past the new end are moved first, which fails with EBUSY if directories have to be
+ * moved while files or directories are opened. */
+#define ZEALFS_IOC_RESIZE   _IOW('Z', 1, uint32_t)
+
+/* Snapshot of the whole tree, given by the `.zealfs/tree` virtual file. Its generation changes
+ * each time entries are modified, so that tools only read the tree again when it changed. */
+typedef struct {
+    uint32_t generation;
+    /* Size of the content of the virtual file, in bytes */
+    uint32_t size;
+    /* Number of entries, files and directories, in the tree */
+    uint32_t entries;
+} ZealTreeInfo;
+
+/* Get the information about the current snapshot of the tree */
+#define ZEALFS_IOC_TREE_INFO _IOR('Z', 2, ZealTreeInfo)
@@ -0,0 +1,124 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "zealfs_lz.h"
+
+/* Number of bits for the hash table of the compressor, only used to find matches quickly */
+#define HASH_BITS   12
+#define HASH_SIZE   (1 << HASH_BITS)
+/* Maximum distance of a match, must fit in 16 bits */
+#define MAX_DISTANCE 0xffff
+
+static inline unsigned hash3(const uint8_t* p)
+{
+    const unsigned value = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+
+/**
+ * @brief Flush the pending literals to the destination buffer.
+ *
+ * @return New position in the destination buffer, -1 if it is full.
+ */
+static int flush_literals(const uint8_t* lit, int count, uint8_t* dst, int pos, int capacity)
+{
+    while (count > 0) {
+        const int run = count > LZ_MAX_LITERALS ? LZ_MAX_LITERALS : count;
+        if (pos + 1 + run > capacity) {
+            return -1;
+        }
+        dst[pos++] = run - 1;
+        memcpy(dst + pos, lit, run);
+        pos += run;
+        lit += run;
+        count -= run;
+    }
+    return pos;
+}
+
+
+int lz_compress(const uint8_t* src, int size, uint8_t* dst, int capacity)
+{
+    /* Position + 1 of the last occurrence of each hash, 0 means none */
+    int table[HASH_SIZE] = { 0 };
+    int pos = 0;
+    int lit_start = 0;
+    int i = 0;
+
+    while (i + LZ_MIN_MATCH <= size) {
+        const unsigned h = hash3(src + i);
+        const int candidate = table[h] - 1;
+        table[h] = i + 1;
+
+        int length = 0;
+        if (candidate >= 0 && i - candidate <= MAX_DISTANCE) {
+            const int max = (size - i) < LZ_MAX_MATCH ? (size - i) : LZ_MAX_MATCH;
+            while (length < max && src[candidate + length] == src[i + length]) {
+                length++;
+            }
+        }
+
+        if (length < LZ_MIN_MATCH) {
+            i++;
+            continue;
+        }
+
+        pos = flush_literals(src + lit_start, i - lit_start, dst, pos, capacity);
+        if (pos < 0 || pos + 3 > capacity) {
+            return -1;
+        }
+        const int distance = i - candidate;
+        dst[pos++] = 0x80 | (length - LZ_MIN_MATCH);
+        dst[pos++] = distance & 0xff;
+        dst[pos++] = distance >> 8;
+
+        /* Register the positions covered by the match, to find overlapping repetitions */
+        for (int j = i + 1; j < i + length && j + LZ_MIN_MATCH <= size; j++) {
+            table[hash3(src + j)] = j + 1;
+        }
+        i += length;
+        lit_start = i;
+    }
+
+    return flush_literals(src + lit_start, size - lit_start, dst, pos, capacity);
+}
+
+
+int lz_decompress(const uint8_t* src, int size, uint8_t* dst, int capacity)
+{
+    int in = 0;
+    int out = 0;
+
+    while (in < size) {
+        const uint8_t token = src[in++];
+        if ((token & 0x80) == 0) {
+            const int run = token + 1;
+            if (in + run > size || out + run > capacity) {
+                return -1;
+            }
+            memcpy(dst + out, src + in, run);
+            in += run;
+            out += run;
+        } else {
+            const int length = (token & 0x7f) + LZ_MIN_MATCH;
+            if (in + 2 > size) {
+                return -1;
+            }
+            const int distance = src[in] | (src[in + 1] << 8);
+            in += 2;
+            if (distance == 0 || distance > out || out + length > capacity) {
+                return -1;
+            }
+            /* Byte per byte copy, the regions can overlap, as LDIR would do */
+            for (int j = 0; j < length; j++, out++) {
+                dst[out] = dst[out - distance];
+            }
+        }
+    }
+
+    return out;
+}
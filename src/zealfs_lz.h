@@ -0,0 +1,48 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Tiny LZ codec used for compressed files. The format is byte-oriented so that it can be
+ * decoded on the Z80 with a handful of instructions, using LDIR for both kinds of tokens:
+ *
+ * - 0x00-0x7F: literal run, the token is followed by (token + 1) bytes to copy as-is.
+ * - 0x80-0xFF: match, copy ((token & 0x7F) + 3) bytes from the already decoded data, starting
+ *              `distance` bytes before the current position. The token is followed by the
+ *              16-bit distance, in little-endian. Source and destination can overlap.
+ *
+ * There is no end marker, the decoder stops when the compressed data has been consumed.
+ */
+#define LZ_MAX_LITERALS 128
+#define LZ_MIN_MATCH    3
+#define LZ_MAX_MATCH    (0x7f + LZ_MIN_MATCH)
+
+/**
+ * @brief Compress a buffer.
+ *
+ * @param src Data to compress.
+ * @param size Size of the data to compress.
+ * @param dst Buffer to store the compressed data in.
+ * @param capacity Size of the destination buffer.
+ *
+ * @return Size of the compressed data, -1 if it doesn't fit in the destination buffer.
+ */
+int lz_compress(const uint8_t* src, int size, uint8_t* dst, int capacity);
+
+/**
+ * @brief Decompress a buffer.
+ *
+ * @param src Compressed data.
+ * @param size Size of the compressed data.
+ * @param dst Buffer to store the decompressed data in.
+ * @param capacity Size of the destination buffer.
+ *
+ * @return Size of the decompressed data, -1 if the compressed data is invalid or doesn't fit
+ *         in the destination buffer.
+ */
+int lz_decompress(const uint8_t* src, int size, uint8_t* dst, int capacity);
@@ -0,0 +1,125 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include "zealfs_sched.h"
+
+static const char* const s_class_names[SCHED_CLASSES] = { "meta", "data", "flush" };
+
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+
+void sched_init(zealfs_sched* sched, uint32_t max_delay_us)
+{
+    memset(sched, 0, sizeof(*sched));
+    pthread_mutex_init(&sched->mutex, NULL);
+    /* The deadlines are computed with the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    sched->max_delay_us = max_delay_us;
+}
+
+
+/**
+ * @brief Check whether a request of the given class can be admitted. Must be called with the mutex held.
+ */
+static int admissible(const zealfs_sched* sched, sched_class cls)
+{
+    for (int higher = 0; higher < cls; higher++) {
+        if (sched->waiting[higher] || sched->running[higher]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+void sched_enter(zealfs_sched* sched, sched_class cls)
+{
+    pthread_mutex_lock(&sched->mutex);
+
+    const uint64_t start = now_us();
+    const uint64_t deadline = start + sched->max_delay_us;
+    const struct timespec ts = {
+        .tv_sec = deadline / 1000000,
+        .tv_nsec = (deadline % 1000000) * 1000,
+    };
+    int delayed = 0;
+
+    sched->waiting[cls]++;
+    if (sched->waiting[cls] > sched->max_waiting[cls]) {
+        sched->max_waiting[cls] = sched->waiting[cls];
+    }
+    while (!admissible(sched, cls)) {
+        delayed = 1;
+        if (pthread_cond_timedwait(&sched->cond, &sched->mutex, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+    sched->waiting[cls]--;
+    sched->running[cls]++;
+
+    /* Update the statistics */
+    const uint64_t waited = delayed ? now_us() - start : 0;
+    int bucket = 0;
+    while (bucket < SCHED_BUCKETS - 1 && waited >= (1ull << bucket)) {
+        bucket++;
+    }
+    sched->wait_us[cls][bucket]++;
+    sched->admitted[cls]++;
+    sched->delayed[cls] += delayed;
+
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+
+void sched_leave(zealfs_sched* sched, sched_class cls)
+{
+    pthread_mutex_lock(&sched->mutex);
+    sched->running[cls]--;
+    /* Only wake up the waiters if this request could have been holding back some of them */
+    for (int lower = cls + 1; lower < SCHED_CLASSES; lower++) {
+        if (sched->waiting[lower]) {
+            pthread_cond_broadcast(&sched->cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+
+void sched_print_stats(zealfs_sched* sched, FILE* out)
+{
+    pthread_mutex_lock(&sched->mutex);
+    for (int cls = 0; cls < SCHED_CLASSES; cls++) {
+        const char* name = s_class_names[cls];
+        fprintf(out, "sched.%s.depth %d\n", name, sched->waiting[cls]);
+        fprintf(out, "sched.%s.max_depth %d\n", name, sched->max_waiting[cls]);
+        fprintf(out, "sched.%s.running %d\n", name, sched->running[cls]);
+        fprintf(out, "sched.%s.admitted %llu\n", name, (unsigned long long) sched->admitted[cls]);
+        fprintf(out, "sched.%s.delayed %llu\n", name, (unsigned long long) sched->delayed[cls]);
+        for (int bucket = 0; bucket < SCHED_BUCKETS; bucket++) {
+            if (bucket < SCHED_BUCKETS - 1) {
+                fprintf(out, "sched.%s.wait_us.lt_%llu %llu\n", name, 1ull << bucket,
+                        (unsigned long long) sched->wait_us[cls][bucket]);
+            } else {
+                fprintf(out, "sched.%s.wait_us.inf %llu\n", name,
+                        (unsigned long long) sched->wait_us[cls][bucket]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sched->mutex);
+}
@@ -0,0 +1,91 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Classes of requests, by decreasing priority */
+typedef enum {
+    /* lookup, getattr, readdir, ... */
+    SCHED_META,
+    /* read, write, truncate */
+    SCHED_DATA,
+    /* flush, release */
+    SCHED_FLUSH,
+    SCHED_CLASSES
+} sched_class;
+
+/* Default maximum time, in milliseconds, a request can be delayed by higher priority ones */
+#ifndef DEFAULT_SCHED_DELAY_MS
+#define DEFAULT_SCHED_DELAY_MS 20
+#endif
+
+/* Buckets of the wait time histograms, bucket n counts the waits shorter than 2^n microseconds,
+ * the last one counts all the longer waits */
+#define SCHED_BUCKETS 22
+
+/* Scheduler of the requests of one mount. A request is admitted once no request of a higher
+ * priority class is waiting or running, or once it has waited for `max_delay_us`, so that
+ * lower priority requests are never starved. */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /* Maximum time a request can be delayed by higher priority ones */
+    uint32_t max_delay_us;
+    /* Number of requests waiting to be admitted, and admitted, for each class */
+    int waiting[SCHED_CLASSES];
+    int running[SCHED_CLASSES];
+    /* Statistics, for each class */
+    int max_waiting[SCHED_CLASSES];
+    uint64_t admitted[SCHED_CLASSES];
+    uint64_t delayed[SCHED_CLASSES];
+    uint64_t wait_us[SCHED_CLASSES][SCHED_BUCKETS];
+} zealfs_sched;
+
+
+/**
+ * @brief Initialize a scheduler.
+ *
+ * @param sched Scheduler to initialize.
+ * @param max_delay_us Maximum time, in microseconds, a request can be delayed.
+ */
+void sched_init(zealfs_sched* sched, uint32_t max_delay_us);
+
+/**
+ * @brief Wait until a request of the given class can be processed.
+ *        Must be balanced with `sched_leave`.
+ */
+void sched_enter(zealfs_sched* sched, sched_class cls);
+
+/**
+ * @brief Signal the end of a request admitted by `sched_enter`.
+ */
+void sched_leave(zealfs_sched* sched, sched_class cls);
+
+/**
+ * @brief Print the statistics of the scheduler, one `key value` pair per line.
+ */
+void sched_print_stats(zealfs_sched* sched, FILE* out);
+
+
+typedef struct {
+    zealfs_sched* sched;
+    sched_class cls;
+} sched_scope;
+
+/**
+ * @brief Cleanup function for scoped admissions, to use with `__attribute__((cleanup))`.
+ */
+static inline void sched_leave_scope(sched_scope* scope) {
+    sched_leave(scope->sched, scope->cls);
+}
+
+/* Wait for the request to be admitted, until the end of the current scope */
+#define SCHED_SCOPE(s, c) \
+    sched_scope _scoped_sched __attribute__((cleanup(sched_leave_scope))) = { (s), (c) }; \
+    sched_enter(_scoped_sched.sched, _scoped_sched.cls)
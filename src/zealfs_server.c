@@ -0,0 +1,509 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "zealfs_server.h"
+
+#define MAX_CLIENTS     16
+/* Big enough for the biggest request: a write of SERVER_MAX_COUNT pages */
+#define INPUT_SIZE      (sizeof(ZealServerHeader) + SERVER_MAX_COUNT * sizeof(ZealServerPage))
+/* The biggest response, to a read of SERVER_MAX_COUNT pages, is as big */
+#define RESPONSE_MAX    INPUT_SIZE
+#define NOTIFY_MAX      (sizeof(ZealServerHeader) + VOLUME_MAX_PAGES)
+/* Responses not sent yet to a client. Its requests are not processed while the biggest response
+ * doesn't fit, and its notifications are merged, so a client that doesn't read its socket only
+ * holds that much memory. */
+#define OUTPUT_SIZE     (2 * RESPONSE_MAX)
+
+typedef struct {
+    int fd;
+    int subscribed;
+    /* Generation of the last notification sent to the client */
+    uint32_t notified;
+    /* Received bytes, INPUT_SIZE at most, that don't form a complete request yet or wait for
+     * room in the output */
+    uint8_t* input;
+    size_t input_len;
+    /* Responses not sent yet, OUTPUT_SIZE at most */
+    uint8_t* output;
+    size_t output_len;
+} client_t;
+
+static struct {
+    zealfs_volume* vol;
+    char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    int listen_fd;
+    /* Written to stop the server thread */
+    int stop_pipe[2];
+    pthread_t thread;
+    /* Set once everything above is ready, `server_stop` does nothing else */
+    int started;
+    client_t clients[MAX_CLIENTS];
+    /* Called before the pages written by the clients are modified */
+    server_write_fn on_write;
+    void* on_write_arg;
+} g_server;
+
+
+/**
+ * @brief Check whether a client's output buffer has room for `size` more bytes.
+ */
+static int output_room(const client_t* client, size_t size)
+{
+    return client->output_len + size <= OUTPUT_SIZE;
+}
+
+
+/**
+ * @brief Reserve room at the end of a client's output buffer, the caller checked that it fits.
+ *
+ * @return Address of the reserved bytes.
+ */
+static uint8_t* output_reserve(client_t* client, size_t size)
+{
+    uint8_t* ptr = client->output + client->output_len;
+    client->output_len += size;
+    return ptr;
+}
+
+
+/**
+ * @brief Append a response header to a client's output buffer.
+ */
+static void output_header(client_t* client, const ZealServerHeader* request, int status, int count,
+                          uint32_t generation)
+{
+    ZealServerHeader* header = (ZealServerHeader*) output_reserve(client, sizeof(ZealServerHeader));
+    header->op = request->op;
+    header->status = status;
+    header->count = count;
+    header->tag = request->tag;
+    header->generation = generation;
+}
+
+
+/**
+ * @brief Send as many pending bytes as possible to a client without blocking.
+ *
+ * @return 0 on success, -1 if the connection is broken.
+ */
+static int output_send(client_t* client)
+{
+    size_t sent = 0;
+    while (sent < client->output_len) {
+        ssize_t wr = send(client->fd, client->output + sent, client->output_len - sent,
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (wr < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        sent += wr;
+    }
+    memmove(client->output, client->output + sent, client->output_len - sent);
+    client->output_len -= sent;
+    return 0;
+}
+
+
+/**
+ * @brief Get the size of the payload of a request.
+ */
+static size_t request_payload(const ZealServerHeader* request)
+{
+    switch (request->op) {
+        case SERVER_OP_READ:  return request->count;
+        case SERVER_OP_WRITE: return request->count * sizeof(ZealServerPage);
+        default:              return 0;
+    }
+}
+
+
+static void handle_read(client_t* client, const ZealServerHeader* request, const uint8_t* pages)
+{
+    zealfs_volume* vol = g_server.vol;
+    const int total = vol->size / 256;
+
+    for (int i = 0; i < request->count; i++) {
+        if (pages[i] >= total) {
+            output_header(client, request, EINVAL, 0, 0);
+            return;
+        }
+    }
+
+    volume_rdlock(vol);
+    output_header(client, request, 0, request->count, vol->generation);
+    ZealServerPage* out = (ZealServerPage*) output_reserve(client, request->count * sizeof(ZealServerPage));
+    for (int i = 0; i < request->count; i++) {
+        out[i].page = pages[i];
+        memset(out[i].reserved, 0, sizeof(out[i].reserved));
+        out[i].generation = vol->page_gen[pages[i]];
+        memcpy(out[i].data, volume_page(vol, pages[i]), 256);
+    }
+    volume_unlock(vol);
+}
+
+
+static void handle_write(client_t* client, const ZealServerHeader* request, const ZealServerPage* pages)
+{
+    zealfs_volume* vol = g_server.vol;
+    const int total = vol->size / 256;
+    int status = 0;
+
+    for (int i = 0; i < request->count; i++) {
+        if (pages[i].page >= total) {
+            output_header(client, request, EINVAL, 0, 0);
+            return;
+        }
+    }
+
+    volume_wrlock(vol);
+    for (int i = 0; i < request->count; i++) {
+        const uint32_t expected = pages[i].generation;
+        if (expected != SERVER_ANY_GENERATION && expected != vol->page_gen[pages[i].page]) {
+            status = ESTALE;
+        }
+    }
+    if (status == 0 && g_server.on_write) {
+        uint8_t numbers[SERVER_MAX_COUNT];
+        for (int i = 0; i < request->count; i++) {
+            numbers[i] = pages[i].page;
+        }
+        g_server.on_write(numbers, request->count, g_server.on_write_arg);
+    }
+    if (status == 0) {
+        for (int i = 0; i < request->count; i++) {
+            memcpy(volume_page(vol, pages[i].page), pages[i].data, 256);
+            volume_mark_dirty(vol, pages[i].page);
+        }
+    }
+    output_header(client, request, status, request->count, vol->generation);
+    ZealServerPageGen* out = (ZealServerPageGen*) output_reserve(client, request->count * sizeof(ZealServerPageGen));
+    for (int i = 0; i < request->count; i++) {
+        out[i].page = pages[i].page;
+        memset(out[i].reserved, 0, sizeof(out[i].reserved));
+        out[i].generation = vol->page_gen[pages[i].page];
+    }
+    volume_unlock(vol);
+}
+
+
+/**
+ * @brief Process the complete requests received from a client, while its output has room for
+ *        their responses. The others are processed once the client has read the responses.
+ *
+ * @return 0 on success, -1 if the client sent an invalid request.
+ */
+static int process_input(client_t* client)
+{
+    zealfs_volume* vol = g_server.vol;
+    size_t offset = 0;
+
+    while (client->input_len - offset >= sizeof(ZealServerHeader) &&
+           output_room(client, RESPONSE_MAX)) {
+        ZealServerHeader request;
+        memcpy(&request, client->input + offset, sizeof(request));
+        if (request.count > SERVER_MAX_COUNT) {
+            return -1;
+        }
+        const size_t payload = request_payload(&request);
+        if (client->input_len - offset < sizeof(request) + payload) {
+            break;
+        }
+        const uint8_t* data = client->input + offset + sizeof(request);
+        offset += sizeof(request) + payload;
+
+        switch (request.op) {
+            case SERVER_OP_INFO:
+                volume_rdlock(vol);
+                output_header(client, &request, 0, vol->size / 256, vol->generation);
+                volume_unlock(vol);
+                break;
+            case SERVER_OP_READ:
+                handle_read(client, &request, data);
+                break;
+            case SERVER_OP_WRITE:
+                handle_write(client, &request, (const ZealServerPage*) data);
+                break;
+            case SERVER_OP_FLUSH: {
+                volume_wrlock(vol);
+                const int status = volume_flush(vol) ? EIO : 0;
+                output_header(client, &request, status, 0, vol->generation);
+                volume_unlock(vol);
+                break;
+            }
+            case SERVER_OP_SUBSCRIBE:
+                volume_rdlock(vol);
+                client->subscribed = request.count != 0;
+                client->notified = vol->generation;
+                output_header(client, &request, 0, 0, vol->generation);
+                volume_unlock(vol);
+                break;
+            default:
+                output_header(client, &request, ENOSYS, 0, 0);
+                break;
+        }
+    }
+
+    memmove(client->input, client->input + offset, client->input_len - offset);
+    client->input_len -= offset;
+    return 0;
+}
+
+
+/**
+ * @brief Send the pages modified since their last notification to the subscribed clients. A
+ *        client whose output is full is notified later, of all the pages modified meanwhile.
+ */
+static void notify_subscribers(void)
+{
+    zealfs_volume* vol = g_server.vol;
+    uint8_t pages[VOLUME_MAX_PAGES];
+
+    volume_rdlock(vol);
+    const uint32_t generation = vol->generation;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        client_t* client = &g_server.clients[i];
+        if (client->fd < 0 || !client->subscribed || client->notified == generation ||
+            !output_room(client, NOTIFY_MAX)) {
+            continue;
+        }
+        int count = 0;
+        for (int page = 0; page < vol->size / 256; page++) {
+            if (vol->page_gen[page] > client->notified) {
+                pages[count++] = page;
+            }
+        }
+        client->notified = generation;
+        if (count) {
+            const ZealServerHeader notify = { .op = SERVER_OP_NOTIFY };
+            output_header(client, &notify, 0, count, generation);
+            memcpy(output_reserve(client, count), pages, count);
+        }
+    }
+    volume_unlock(vol);
+}
+
+
+static void close_client(client_t* client)
+{
+    close(client->fd);
+    free(client->input);
+    free(client->output);
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+}
+
+
+static void accept_client(void)
+{
+    int fd = accept(g_server.listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        client_t* client = &g_server.clients[i];
+        if (client->fd < 0) {
+            client->fd = fd;
+            client->input = malloc(INPUT_SIZE);
+            client->output = malloc(OUTPUT_SIZE);
+            if (client->input == NULL || client->output == NULL) {
+                close_client(client);
+            }
+            return;
+        }
+    }
+    /* Too many clients */
+    close(fd);
+}
+
+
+static void* server_thread(void* arg)
+{
+    (void) arg;
+    struct pollfd fds[3 + MAX_CLIENTS];
+    zealfs_volume* vol = g_server.vol;
+
+    while (1) {
+        fds[0] = (struct pollfd) { .fd = g_server.stop_pipe[0], .events = POLLIN };
+        fds[1] = (struct pollfd) { .fd = g_server.listen_fd, .events = POLLIN };
+        fds[2] = (struct pollfd) { .fd = vol->event_fd, .events = POLLIN };
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            client_t* client = &g_server.clients[i];
+            /* A client that doesn't read its responses is not read either */
+            fds[3 + i] = (struct pollfd) {
+                .fd = client->fd,
+                .events = (output_room(client, RESPONSE_MAX) ? POLLIN : 0) |
+                          (client->output_len ? POLLOUT : 0),
+            };
+        }
+
+        if (poll(fds, 3 + MAX_CLIENTS, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_client();
+        }
+        if (fds[2].revents & POLLIN) {
+            uint64_t value;
+            if (read(vol->event_fd, &value, sizeof(value)) == sizeof(value)) {
+                notify_subscribers();
+            }
+        }
+
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            client_t* client = &g_server.clients[i];
+            const short revents = fds[3 + i].revents;
+            if (client->fd < 0 || revents == 0) {
+                continue;
+            }
+            if (revents & POLLIN) {
+                ssize_t rd = recv(client->fd, client->input + client->input_len,
+                                  INPUT_SIZE - client->input_len, 0);
+                if (rd <= 0) {
+                    close_client(client);
+                    continue;
+                }
+                client->input_len += rd;
+                if (process_input(client)) {
+                    close_client(client);
+                    continue;
+                }
+            } else if (revents & (POLLERR | POLLHUP)) {
+                close_client(client);
+                continue;
+            }
+        }
+
+        /* Send the responses and notifications, then process the requests that were waiting
+         * for room in the output */
+        int drained = 0;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            client_t* client = &g_server.clients[i];
+            if (client->fd < 0 || client->output_len == 0) {
+                continue;
+            }
+            const int full = !output_room(client, RESPONSE_MAX);
+            if (output_send(client) || process_input(client)) {
+                close_client(client);
+                continue;
+            }
+            drained |= full && output_room(client, NOTIFY_MAX);
+        }
+        if (drained) {
+            notify_subscribers();
+        }
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (g_server.clients[i].fd >= 0) {
+            close_client(&g_server.clients[i]);
+        }
+    }
+    return NULL;
+}
+
+
+int server_start(zealfs_volume* vol, const char* path, server_write_fn on_write, void* arg)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(g_server.path, path);
+    g_server.vol = vol;
+    g_server.on_write = on_write;
+    g_server.on_write_arg = arg;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        g_server.clients[i].fd = -1;
+    }
+
+    g_server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (g_server.listen_fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(g_server.listen_fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        goto err_socket;
+    }
+    if (listen(g_server.listen_fd, MAX_CLIENTS) || pipe(g_server.stop_pipe)) {
+        goto err_bound;
+    }
+
+    /* Get notified of the modifications made by the file system */
+    const int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        goto err_pipe;
+    }
+    volume_wrlock(vol);
+    vol->event_fd = event_fd;
+    vol->signaled = vol->generation;
+    volume_unlock(vol);
+
+    const int err = pthread_create(&g_server.thread, NULL, server_thread, NULL);
+    if (err) {
+        volume_wrlock(vol);
+        vol->event_fd = -1;
+        volume_unlock(vol);
+        close(event_fd);
+        errno = err;
+        goto err_pipe;
+    }
+    g_server.started = 1;
+    return 0;
+
+    /* The calls releasing the resources succeed, errno is kept from the failing one */
+err_pipe:
+    close(g_server.stop_pipe[0]);
+    close(g_server.stop_pipe[1]);
+err_bound:
+    unlink(path);
+err_socket:
+    close(g_server.listen_fd);
+    return -1;
+}
+
+
+void server_stop(void)
+{
+    zealfs_volume* vol = g_server.vol;
+
+    if (!g_server.started) {
+        return;
+    }
+    g_server.started = 0;
+    if (write(g_server.stop_pipe[1], "", 1) == 1) {
+        pthread_join(g_server.thread, NULL);
+    }
+    close(g_server.stop_pipe[0]);
+    close(g_server.stop_pipe[1]);
+    close(g_server.listen_fd);
+    unlink(g_server.path);
+
+    volume_wrlock(vol);
+    close(vol->event_fd);
+    vol->event_fd = -1;
+    volume_unlock(vol);
+}
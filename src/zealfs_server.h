@@ -0,0 +1,98 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "zealfs_volume.h"
+
+/*
+ * The page server gives block-level access to the pages of a volume over a UNIX stream socket.
+ * Each request and response starts with a `ZealServerHeader`, followed by a payload which
+ * depends on the operation. All the multi-byte fields are little-endian.
+ *
+ * Clients can send several requests without waiting for the responses, the responses are sent
+ * back in the same order. Each page is 256 bytes big and has a generation number: the volume
+ * generation at the time the page was last modified. It can be used to perform conditional
+ * writes, which only succeed if the pages were not modified in the meantime.
+ */
+
+/* Response: `count` is the number of pages in the volume. No payload in both directions */
+#define SERVER_OP_INFO      0
+/* Request payload: `count` page numbers, one byte each.
+ * Response payload: `count` ZealServerPage structures */
+#define SERVER_OP_READ      1
+/* Request payload: `count` ZealServerPage structures, the generation is the one expected for
+ * the page, or SERVER_ANY_GENERATION. If one of them doesn't match, none of the pages are
+ * written and the status is ESTALE.
+ * Response payload: `count` ZealServerPageGen structures, with the current generations */
+#define SERVER_OP_WRITE     2
+/* Write the modified pages to the image file. No payload in both directions */
+#define SERVER_OP_FLUSH     3
+/* Enable (`count` = 1) or disable (`count` = 0) the change notifications. No payload */
+#define SERVER_OP_SUBSCRIBE 4
+/* Sent by the server to the subscribed clients when pages are modified, by the file system or
+ * by any client. Payload: `count` page numbers, one byte each. The tag is always 0 */
+#define SERVER_OP_NOTIFY    0x80
+
+/* Generation to use in a write request to write the page unconditionally */
+#define SERVER_ANY_GENERATION 0xffffffff
+
+/* Maximum number of pages in a single request */
+#define SERVER_MAX_COUNT    256
+
+typedef struct {
+    uint8_t  op;
+    /* 0 in requests, 0 or an errno value in responses */
+    uint8_t  status;
+    /* Number of pages in the payload */
+    uint16_t count;
+    /* Chosen by the client, copied as-is in the response */
+    uint32_t tag;
+    /* Generation of the volume after the request was processed, 0 in requests */
+    uint32_t generation;
+} __attribute__((packed)) ZealServerHeader;
+
+typedef struct {
+    uint8_t  page;
+    uint8_t  reserved[3];
+    uint32_t generation;
+} __attribute__((packed)) ZealServerPageGen;
+
+typedef struct {
+    uint8_t  page;
+    uint8_t  reserved[3];
+    uint32_t generation;
+    uint8_t  data[256];
+} __attribute__((packed)) ZealServerPage;
+
+
+/**
+ * @brief Function called when a client writes pages, with the volume locked for writing, right
+ *        before the pages are modified. The file system can then tell which of its files change.
+ *
+ * @param pages Numbers of the pages about to be written.
+ * @param count Number of pages.
+ */
+typedef void (*server_write_fn)(const uint8_t* pages, int count, void* arg);
+
+/**
+ * @brief Start serving the pages of a volume on a UNIX socket, from a background thread.
+ *        Any existing socket file at the given path is replaced.
+ *
+ * @param vol Volume to serve, must stay valid until `server_stop` is called.
+ * @param path Path of the UNIX socket to create.
+ * @param on_write When not NULL, called each time a client writes pages.
+ * @param arg Argument given to `on_write`.
+ *
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int server_start(zealfs_volume* vol, const char* path, server_write_fn on_write, void* arg);
+
+/**
+ * @brief Stop the server, close all the connections and remove the socket file. Nothing is done
+ *        if the server was not started, or failed to start.
+ */
+void server_stop(void);
@@ -0,0 +1,723 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "zealfs_store.h"
+#include "zealfs_archive.h"
+
+#define PAGE_SIZE_BYTES     256
+#define MIN_TABLE_SIZE      1024
+
+/* Created by `store_compact` once the compacted files are all written, see `compact_finish` */
+#define COMPACT_MARKER      "compacted"
+
+
+/**
+ * @brief Get the path of a file in the store.
+ */
+static void store_file(const zealfs_store* store, const char* name, char* path)
+{
+    snprintf(path, PATH_MAX, "%s/%s", store->path, name);
+}
+
+
+/**
+ * @brief Get the path of an image manifest, the name must not designate another file.
+ *
+ * @return 0 on success, -EINVAL if the name is not valid.
+ */
+static int manifest_file(const zealfs_store* store, const char* name, char* path)
+{
+    if (name[0] == 0 || name[0] == '.' || strchr(name, '/') != NULL) {
+        return -EINVAL;
+    }
+    snprintf(path, PATH_MAX, "%s/images/%s", store->path, name);
+    return 0;
+}
+
+
+/**
+ * @brief Write a whole file as `<path>.new`, synced to the disk, so that it can then replace the
+ *        file atomically, see `finish_file`.
+ */
+static int write_new(const char* path, const void* header, size_t header_size,
+                     const void* content, size_t size)
+{
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    int err = 0;
+    if (write(fd, header, header_size) != (ssize_t) header_size ||
+        write(fd, content, size) != (ssize_t) size || fsync(fd) != 0) {
+        err = -EIO;
+    }
+    close(fd);
+    return err;
+}
+
+
+/**
+ * @brief Replace a file with its `<path>.new` version, or discard that version.
+ *
+ * @return 0 on success, or if there is no new version, negative error code else.
+ */
+static int finish_file(const char* path, int replace)
+{
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+    if ((replace ? rename(tmp, path) : unlink(tmp)) != 0 && errno != ENOENT) {
+        return -errno;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Write a whole file through a temporary file, so that it is replaced atomically.
+ */
+static int write_file(const char* path, const void* header, size_t header_size,
+                      const void* content, size_t size)
+{
+    int err = write_new(path, header, header_size, content, size);
+    return err ? err : finish_file(path, 1);
+}
+
+
+/**
+ * @brief Complete or undo a compaction: when the marker exists, the compacted pages, index and
+ *        manifests were all written and replace the former ones, even if the compaction was
+ *        interrupted while replacing them. Else, the files written so far are discarded.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int compact_finish(zealfs_store* store)
+{
+    char marker[PATH_MAX];
+    char path[PATH_MAX];
+    store_file(store, COMPACT_MARKER, marker);
+    const int replace = access(marker, F_OK) == 0;
+
+    /* The manifests being written by another operation are discarded too */
+    store_file(store, "images", path);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return errno == ENOENT ? 0 : -errno;
+    }
+    int err = 0;
+    struct dirent* ent;
+    while (err == 0 && (ent = readdir(dir)) != NULL) {
+        const size_t len = strlen(ent->d_name);
+        if (len > 4 && strcmp(ent->d_name + len - 4, ".new") == 0) {
+            snprintf(path, sizeof(path), "%s/images/%.*s", store->path, (int) len - 4, ent->d_name);
+            err = finish_file(path, replace);
+        }
+    }
+    closedir(dir);
+
+    store_file(store, "index", path);
+    if (err == 0) {
+        err = finish_file(path, replace);
+    }
+    store_file(store, "pages", path);
+    if (err == 0) {
+        err = finish_file(path, replace);
+    }
+    if (err == 0 && replace && unlink(marker) != 0) {
+        err = -errno;
+    }
+    return err;
+}
+
+
+/**
+ * @brief Insert a stored page in the hash table, which must have room for it.
+ */
+static void table_insert(zealfs_store* store, uint32_t ref)
+{
+    const uint32_t mask = store->table_size - 1;
+    uint32_t bucket = store->slots[ref].hash & mask;
+    while (store->table[bucket] != 0) {
+        bucket = (bucket + 1) & mask;
+    }
+    store->table[bucket] = ref + 1;
+}
+
+
+/**
+ * @brief Allocate a hash table big enough for the stored pages and fill it.
+ *
+ * @return 0 on success, -ENOMEM on error.
+ */
+static int table_rebuild(zealfs_store* store, uint32_t count)
+{
+    uint32_t size = MIN_TABLE_SIZE;
+    /* Keep the load factor below 1/2 */
+    while (size < count * 2) {
+        size *= 2;
+    }
+    uint32_t* table = calloc(size, sizeof(uint32_t));
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+    free(store->table);
+    store->table = table;
+    store->table_size = size;
+    for (uint32_t i = 0; i < store->count; i++) {
+        table_insert(store, i);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Make sure the index has room for `count` pages.
+ *
+ * @return 0 on success, -ENOMEM on error.
+ */
+static int slots_reserve(zealfs_store* store, uint32_t count)
+{
+    if (count <= store->capacity) {
+        return 0;
+    }
+    uint32_t capacity = store->capacity ? store->capacity : MIN_TABLE_SIZE;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    ZealStoreSlot* slots = realloc(store->slots, capacity * sizeof(ZealStoreSlot));
+    if (slots == NULL) {
+        return -ENOMEM;
+    }
+    store->slots = slots;
+    store->capacity = capacity;
+    return 0;
+}
+
+
+/**
+ * @brief Load the index file of the store, if any.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int load_index(zealfs_store* store)
+{
+    char path[PATH_MAX];
+    ZealStoreHeader header;
+    struct stat st;
+
+    store_file(store, "index", path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -errno;
+    }
+
+    int err = -EINVAL;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, STORE_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != STORE_VERSION ||
+        fstat(store->pages_fd, &st) != 0 ||
+        (uint64_t) header.count * PAGE_SIZE_BYTES > (uint64_t) st.st_size) {
+        goto end;
+    }
+    err = slots_reserve(store, header.count);
+    if (err) {
+        goto end;
+    }
+    const size_t size = header.count * sizeof(ZealStoreSlot);
+    if (read(fd, store->slots, size) != (ssize_t) size) {
+        err = -EINVAL;
+        goto end;
+    }
+    store->count = header.count;
+    err = 0;
+
+end:
+    close(fd);
+    return err;
+}
+
+
+int store_open(zealfs_store* store, const char* path, int create)
+{
+    char file[PATH_MAX];
+    int err;
+
+    memset(store, 0, sizeof(*store));
+    store->lock_fd = -1;
+    store->pages_fd = -1;
+    store->path = strdup(path);
+    if (store->path == NULL) {
+        return -ENOMEM;
+    }
+
+    if (create) {
+        mkdir(path, 0755);
+        store_file(store, "images", file);
+        mkdir(file, 0755);
+    }
+
+    /* Only one process can modify the store at a time */
+    store_file(store, "lock", file);
+    store->lock_fd = open(file, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (store->lock_fd < 0) {
+        err = -errno;
+        goto error;
+    }
+    if (flock(store->lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        err = -EBUSY;
+        goto error;
+    }
+    err = compact_finish(store);
+    if (err) {
+        goto error;
+    }
+
+    store_file(store, "pages", file);
+    store->pages_fd = open(file, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (store->pages_fd < 0) {
+        err = -errno;
+        goto error;
+    }
+
+    err = load_index(store);
+    if (err == 0) {
+        err = table_rebuild(store, store->count);
+    }
+    if (err == 0) {
+        return 0;
+    }
+
+error:
+    store_close(store);
+    return err;
+}
+
+
+void store_close(zealfs_store* store)
+{
+    if (store->pages_fd >= 0) {
+        close(store->pages_fd);
+    }
+    if (store->lock_fd >= 0) {
+        close(store->lock_fd);
+    }
+    free(store->slots);
+    free(store->table);
+    free(store->path);
+    memset(store, 0, sizeof(*store));
+    store->lock_fd = -1;
+    store->pages_fd = -1;
+}
+
+
+int store_save(zealfs_store* store)
+{
+    char path[PATH_MAX];
+    ZealStoreHeader header = {
+        .version = STORE_VERSION,
+        .count = store->count,
+    };
+    memcpy(header.magic, STORE_INDEX_MAGIC, sizeof(header.magic));
+    store_file(store, "index", path);
+    return write_file(path, &header, sizeof(header), store->slots, store->count * sizeof(ZealStoreSlot));
+}
+
+
+int store_put(zealfs_store* store, const uint8_t* content, uint32_t* ref)
+{
+    uint8_t stored[PAGE_SIZE_BYTES];
+    const uint64_t hash = archive_hash(content, PAGE_SIZE_BYTES);
+    const uint32_t mask = store->table_size - 1;
+
+    /* Look for an identical page, pages with the same hash are compared to rule out collisions */
+    for (uint32_t bucket = hash & mask; store->table[bucket] != 0; bucket = (bucket + 1) & mask) {
+        const uint32_t candidate = store->table[bucket] - 1;
+        if (store->slots[candidate].hash == hash &&
+            store_read(store, candidate, stored) == 0 &&
+            memcmp(stored, content, PAGE_SIZE_BYTES) == 0) {
+            store->slots[candidate].refs++;
+            *ref = candidate;
+            return 0;
+        }
+    }
+
+    /* New content, append it */
+    const uint32_t new_ref = store->count;
+    int err = slots_reserve(store, new_ref + 1);
+    if (err) {
+        return err;
+    }
+    if (pwrite(store->pages_fd, content, PAGE_SIZE_BYTES, (off_t) new_ref * PAGE_SIZE_BYTES) != PAGE_SIZE_BYTES) {
+        return -EIO;
+    }
+    store->slots[new_ref] = (ZealStoreSlot) { .hash = hash, .refs = 1 };
+    store->count++;
+    if (store->count * 2 > store->table_size) {
+        err = table_rebuild(store, store->count);
+        if (err) {
+            store->count--;
+            return err;
+        }
+    } else {
+        table_insert(store, new_ref);
+    }
+    *ref = new_ref;
+    return 0;
+}
+
+
+void store_release(zealfs_store* store, uint32_t ref)
+{
+    if (ref < store->count && store->slots[ref].refs > 0) {
+        store->slots[ref].refs--;
+    }
+}
+
+
+int store_read(zealfs_store* store, uint32_t ref, uint8_t* content)
+{
+    if (ref >= store->count ||
+        pread(store->pages_fd, content, PAGE_SIZE_BYTES, (off_t) ref * PAGE_SIZE_BYTES) != PAGE_SIZE_BYTES) {
+        return -EIO;
+    }
+    return 0;
+}
+
+
+int store_load_image(zealfs_store* store, const char* name, store_image* image)
+{
+    char path[PATH_MAX];
+    ZealStoreManifest manifest;
+
+    image->pages = 0;
+    image->refs = NULL;
+    int err = manifest_file(store, name, path);
+    if (err) {
+        return err;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    err = -EINVAL;
+    if (read(fd, &manifest, sizeof(manifest)) != sizeof(manifest) ||
+        memcmp(manifest.magic, STORE_MANIFEST_MAGIC, sizeof(manifest.magic)) != 0 ||
+        manifest.version != STORE_VERSION) {
+        goto end;
+    }
+    image->refs = malloc((manifest.pages ? manifest.pages : 1) * sizeof(uint32_t));
+    if (image->refs == NULL) {
+        err = -ENOMEM;
+        goto end;
+    }
+    const size_t size = manifest.pages * sizeof(uint32_t);
+    if (read(fd, image->refs, size) != (ssize_t) size) {
+        goto end;
+    }
+    for (uint32_t i = 0; i < manifest.pages; i++) {
+        if (image->refs[i] >= store->count) {
+            goto end;
+        }
+    }
+    image->pages = manifest.pages;
+    err = 0;
+
+end:
+    if (err) {
+        free(image->refs);
+        image->refs = NULL;
+    }
+    close(fd);
+    return err;
+}
+
+
+/**
+ * @brief Write the manifest of an image, replacing the former one, or as `<name>.new` when
+ *        `replace` is 0.
+ */
+static int manifest_write(zealfs_store* store, const char* name, const store_image* image,
+                          int replace)
+{
+    char path[PATH_MAX];
+    ZealStoreManifest manifest = {
+        .version = STORE_VERSION,
+        .pages = image->pages,
+    };
+    memcpy(manifest.magic, STORE_MANIFEST_MAGIC, sizeof(manifest.magic));
+
+    int err = manifest_file(store, name, path);
+    if (err) {
+        return err;
+    }
+    const size_t size = image->pages * sizeof(uint32_t);
+    return replace ? write_file(path, &manifest, sizeof(manifest), image->refs, size) :
+                     write_new(path, &manifest, sizeof(manifest), image->refs, size);
+}
+
+
+int store_save_image(zealfs_store* store, const char* name, const store_image* image)
+{
+    return manifest_write(store, name, image, 1);
+}
+
+
+int store_import(zealfs_store* store, const char* name, const uint8_t* content, int size)
+{
+    char path[PATH_MAX];
+    store_image former;
+
+    if (size % PAGE_SIZE_BYTES || manifest_file(store, name, path)) {
+        return -EINVAL;
+    }
+
+    store_image image = { .pages = size / PAGE_SIZE_BYTES };
+    image.refs = malloc((image.pages ? image.pages : 1) * sizeof(uint32_t));
+    if (image.refs == NULL) {
+        return -ENOMEM;
+    }
+    int err = 0;
+    for (uint32_t i = 0; i < image.pages && err == 0; i++) {
+        err = store_put(store, content + i * PAGE_SIZE_BYTES, &image.refs[i]);
+    }
+
+    /* The pages appended must be in the index before a manifest references them */
+    if (err == 0 && store_load_image(store, name, &former) == 0) {
+        for (uint32_t i = 0; i < former.pages; i++) {
+            store_release(store, former.refs[i]);
+        }
+        free(former.refs);
+    }
+    if (err == 0) {
+        err = store_save(store);
+    }
+    if (err == 0) {
+        err = store_save_image(store, name, &image);
+    }
+    free(image.refs);
+    return err;
+}
+
+
+int store_remove(zealfs_store* store, const char* name)
+{
+    char path[PATH_MAX];
+    store_image image;
+
+    int err = store_load_image(store, name, &image);
+    if (err) {
+        return err;
+    }
+    manifest_file(store, name, path);
+    if (unlink(path) != 0) {
+        err = -errno;
+    } else {
+        for (uint32_t i = 0; i < image.pages; i++) {
+            store_release(store, image.refs[i]);
+        }
+        err = store_save(store);
+    }
+    free(image.refs);
+    return err;
+}
+
+
+/**
+ * @brief Call a function for each image of the store, until it returns an error.
+ *
+ * @return 0 on success, the first error else.
+ */
+static int for_each_image(zealfs_store* store, int (*fn)(zealfs_store*, const char*, void*), void* arg)
+{
+    char path[PATH_MAX];
+    store_file(store, "images", path);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return -errno;
+    }
+    int err = 0;
+    struct dirent* ent;
+    while (err == 0 && (ent = readdir(dir)) != NULL) {
+        /* Skip the hidden files, including the manifests being written */
+        const size_t len = strlen(ent->d_name);
+        if (ent->d_name[0] != '.' && (len < 4 || strcmp(ent->d_name + len - 4, ".new") != 0)) {
+            err = fn(store, ent->d_name, arg);
+        }
+    }
+    closedir(dir);
+    return err;
+}
+
+
+static int count_refs(zealfs_store* store, const char* name, void* arg)
+{
+    uint32_t* refs = arg;
+    store_image image;
+    int err = store_load_image(store, name, &image);
+    if (err) {
+        return err;
+    }
+    for (uint32_t i = 0; i < image.pages; i++) {
+        refs[image.refs[i]]++;
+    }
+    free(image.refs);
+    return 0;
+}
+
+
+static int remap_refs(zealfs_store* store, const char* name, void* arg)
+{
+    const uint32_t* mapping = arg;
+    store_image image;
+    int err = store_load_image(store, name, &image);
+    if (err) {
+        return err;
+    }
+    for (uint32_t i = 0; i < image.pages; i++) {
+        image.refs[i] = mapping[image.refs[i]];
+    }
+    /* The former manifest stays valid until the compaction is complete */
+    err = manifest_write(store, name, &image, 0);
+    free(image.refs);
+    return err;
+}
+
+
+int store_compact(zealfs_store* store)
+{
+    uint8_t content[PAGE_SIZE_BYTES];
+    char path[PATH_MAX];
+    uint32_t* refs = calloc(store->count + 1, sizeof(uint32_t));
+    ZealStoreSlot* slots = malloc((store->count + 1) * sizeof(ZealStoreSlot));
+    if (refs == NULL || slots == NULL) {
+        free(refs);
+        free(slots);
+        return -ENOMEM;
+    }
+
+    /* The manifests are the reference, the counters of the index may be off after a crash */
+    int err = for_each_image(store, count_refs, refs);
+
+    /* The store is compacted into new files, the current ones stay valid until they are all
+     * written. The referenced pages are copied, `refs` becomes the mapping from the former
+     * indexes. */
+    store_file(store, "pages.new", path);
+    const int fd = err ? -1 : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (err == 0 && fd < 0) {
+        err = -errno;
+    }
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < store->count && err == 0; i++) {
+        if (refs[i] == 0) {
+            continue;
+        }
+        if (store_read(store, i, content) != 0 ||
+            write(fd, content, PAGE_SIZE_BYTES) != PAGE_SIZE_BYTES) {
+            err = -EIO;
+            break;
+        }
+        slots[kept] = store->slots[i];
+        slots[kept].refs = refs[i];
+        refs[i] = kept++;
+    }
+    if (fd >= 0) {
+        if (err == 0 && fsync(fd) != 0) {
+            err = -EIO;
+        }
+        close(fd);
+    }
+    if (err == 0) {
+        err = for_each_image(store, remap_refs, refs);
+    }
+    if (err == 0) {
+        ZealStoreHeader header = {
+            .version = STORE_VERSION,
+            .count = kept,
+        };
+        memcpy(header.magic, STORE_INDEX_MAGIC, sizeof(header.magic));
+        store_file(store, "index", path);
+        err = write_new(path, &header, sizeof(header), slots, kept * sizeof(ZealStoreSlot));
+    }
+
+    /* Once the marker exists, the new files replace the current ones, even after a crash */
+    store_file(store, COMPACT_MARKER, path);
+    const int marker = err ? -1 : open(path, O_WRONLY | O_CREAT, 0644);
+    if (err == 0 && marker < 0) {
+        err = -errno;
+    }
+    if (marker >= 0) {
+        fsync(marker);
+        close(marker);
+    }
+    const int finished = compact_finish(store);
+    err = err ? err : finished;
+
+    /* The pages are read from the new file from now on */
+    if (err == 0) {
+        store_file(store, "pages", path);
+        const int pages_fd = open(path, O_RDWR);
+        if (pages_fd < 0) {
+            err = -errno;
+        } else {
+            close(store->pages_fd);
+            store->pages_fd = pages_fd;
+        }
+    }
+    const uint32_t dropped = store->count - kept;
+    if (err == 0) {
+        free(store->slots);
+        store->slots = slots;
+        store->capacity = store->count + 1;
+        store->count = kept;
+        slots = NULL;
+        err = table_rebuild(store, kept);
+    }
+    free(slots);
+    free(refs);
+    return err ? err : (int) dropped;
+}
+
+
+static int count_pages(zealfs_store* store, const char* name, void* arg)
+{
+    uint64_t* totals = arg;
+    store_image image;
+    if (store_load_image(store, name, &image) == 0) {
+        totals[0]++;
+        totals[1] += image.pages;
+        free(image.refs);
+    }
+    return 0;
+}
+
+
+void store_print_stats(zealfs_store* store, FILE* out)
+{
+    /* Images count and pages referenced by the images */
+    uint64_t totals[2] = { 0 };
+    uint32_t referenced = 0;
+
+    for_each_image(store, count_pages, totals);
+    for (uint32_t i = 0; i < store->count; i++) {
+        referenced += store->slots[i].refs != 0;
+    }
+    fprintf(out, "store.images %lu\n", (unsigned long) totals[0]);
+    fprintf(out, "store.image_pages %lu\n", (unsigned long) totals[1]);
+    fprintf(out, "store.stored_pages %u\n", store->count);
+    fprintf(out, "store.referenced_pages %u\n", referenced);
+    fprintf(out, "store.dedup_ratio %.2f\n", store->count ? (double) totals[1] / store->count : 0.0);
+}
@@ -0,0 +1,165 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * A store keeps many disk images with each distinct page stored only once. It is a directory
+ * containing:
+ *  - `pages`: content of the stored pages, 256 bytes each, a page is designated by its index;
+ *  - `index`: a ZealStoreHeader followed by one ZealStoreSlot per stored page, giving its hash
+ *    and the number of references to it from the images;
+ *  - `images/<name>`: one manifest per image, a ZealStoreManifest followed by the index of the
+ *    stored page for each page of the image;
+ *  - `lock`: locked while the store is opened;
+ *  - `compacted`: only while a compaction replaces the files above with their `.new` versions.
+ *
+ * Stored pages are never modified: writing to a page of an image stores its new content as
+ * another page (or references an identical one), so the images sharing the former content are
+ * not affected. Pages are only appended, the ones no longer referenced are reclaimed by
+ * `store_compact`. All the fields are little-endian.
+ */
+#define STORE_INDEX_MAGIC       "ZEALSIDX"
+#define STORE_MANIFEST_MAGIC    "ZEALSIMG"
+#define STORE_VERSION           1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    /* Number of pages in the store */
+    uint32_t count;
+} __attribute__((packed)) ZealStoreHeader;
+
+typedef struct {
+    /* Hash of the page content, see `archive_hash` */
+    uint64_t hash;
+    /* Number of pages of the images referencing this page */
+    uint32_t refs;
+    uint32_t reserved;
+} __attribute__((packed)) ZealStoreSlot;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    /* Number of pages in the image */
+    uint32_t pages;
+} __attribute__((packed)) ZealStoreManifest;
+
+/* Opened store */
+typedef struct {
+    char* path;
+    int lock_fd;
+    int pages_fd;
+    /* Index of the store, `count` pages stored */
+    ZealStoreSlot* slots;
+    uint32_t count;
+    uint32_t capacity;
+    /* Hash table of the stored pages, open addressing, each bucket contains a page index + 1 */
+    uint32_t* table;
+    uint32_t table_size;
+} zealfs_store;
+
+/* Image of a store, as a list of page references */
+typedef struct {
+    uint32_t pages;
+    uint32_t* refs;
+} store_image;
+
+
+/**
+ * @brief Open a store, the index is loaded in memory.
+ *
+ * @param store Store to initialize.
+ * @param path Path of the store directory.
+ * @param create 1 to create the store if it doesn't exist.
+ *
+ * @return 0 on success, negative error code else. -EBUSY if the store is already opened.
+ */
+int store_open(zealfs_store* store, const char* path, int create);
+
+/**
+ * @brief Close a store. The index must have been saved before if it was modified.
+ */
+void store_close(zealfs_store* store);
+
+/**
+ * @brief Write the index of the store.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int store_save(zealfs_store* store);
+
+/**
+ * @brief Reference a page with the given content, which is stored if no identical page exists.
+ *
+ * @param store Opened store.
+ * @param content Content of the page, 256 bytes.
+ * @param ref Filled with the index of the stored page.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int store_put(zealfs_store* store, const uint8_t* content, uint32_t* ref);
+
+/**
+ * @brief Release a reference to a stored page.
+ */
+void store_release(zealfs_store* store, uint32_t ref);
+
+/**
+ * @brief Read the content of a stored page.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int store_read(zealfs_store* store, uint32_t ref, uint8_t* content);
+
+/**
+ * @brief Load the manifest of an image. `image->refs` must be freed by the caller.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int store_load_image(zealfs_store* store, const char* name, store_image* image);
+
+/**
+ * @brief Write the manifest of an image, replacing the former one.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int store_save_image(zealfs_store* store, const char* name, const store_image* image);
+
+/**
+ * @brief Add an image to the store, or replace it. The index is saved.
+ *
+ * @param size Size of the image, must be a multiple of 256.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int store_import(zealfs_store* store, const char* name, const uint8_t* content, int size);
+
+/**
+ * @brief Remove an image from the store, its pages are released. The index is saved.
+ *
+ * @return 0 on success, negative error code else.
+ */
+int store_remove(zealfs_store* store, const char* name);
+
+/**
+ * @brief Recompute the references from the manifests and drop the pages no longer referenced.
+ *        The remaining pages are moved to the beginning of the store, the manifests and the
+ *        index are rewritten accordingly. The compacted files are written next to the current
+ *        ones and replace them all once complete, a compaction interrupted before that is
+ *        discarded when the store is opened again, one interrupted after is completed.
+ *
+ * @return Number of pages dropped, negative error code on error.
+ */
+int store_compact(zealfs_store* store);
+
+/**
+ * @brief Print the images count, the pages referenced by the images, the pages stored and the
+ *        deduplication ratio, one `key value` pair per line.
+ */
+void store_print_stats(zealfs_store* store, FILE* out);
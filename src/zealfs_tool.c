@@ -0,0 +1,577 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include "zealfs.h"
+#include "zealfs_archive.h"
+#include "zealfs_store.h"
+#include "zealfs_container.h"
+#include "zealfs_build.h"
+#include "zealfs_variant.h"
+#include "zealfs_ioctl.h"
+
+/**
+ * @brief Create an archive out of image files.
+ *
+ * usage: pack [-j <jobs>] <archive> <images...>
+ */
+static int cmd_pack(int argc, char** argv)
+{
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+        jobs = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 1 || jobs < 1) {
+        return 1;
+    }
+
+    int err = archive_build(argv[0], argv + 1, argc - 1, jobs);
+    if (err) {
+        printf("Error: could not create %s: %s\n", argv[0], strerror(-err));
+        return 2;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief List the images of an archive.
+ *
+ * usage: list <archive>
+ */
+static int cmd_list(int argc, char** argv)
+{
+    zealfs_archive archive;
+    if (argc < 1) {
+        return 1;
+    }
+
+    int err = archive_open(&archive, argv[0], 0);
+    if (err) {
+        printf("Error: could not open %s: %s\n", argv[0], strerror(-err));
+        return 2;
+    }
+    for (uint32_t i = 0; i < archive.header->count; i++) {
+        const ZealArchiveEntry* entry = &archive.entries[i];
+        printf("%-*.*s %6u %016llx\n", ARCHIVE_NAME_LEN, ARCHIVE_NAME_LEN, entry->name,
+               entry->size, (unsigned long long) entry->hash);
+    }
+    archive_close(&archive);
+    return 0;
+}
+
+
+/**
+ * @brief Extract all the images of an archive, their hash is checked.
+ *
+ * usage: unpack <archive> [directory]
+ */
+static int cmd_unpack(int argc, char** argv)
+{
+    zealfs_archive archive;
+    char path[PATH_MAX];
+    int ret = 0;
+
+    if (argc < 1) {
+        return 1;
+    }
+    const char* dir = argc >= 2 ? argv[1] : ".";
+
+    int err = archive_open(&archive, argv[0], 0);
+    if (err) {
+        printf("Error: could not open %s: %s\n", argv[0], strerror(-err));
+        return 2;
+    }
+    struct stat st;
+    if (fstat(archive.fd, &st) != 0) {
+        printf("Error: could not open %s: %s\n", argv[0], strerror(errno));
+        archive_close(&archive);
+        return 2;
+    }
+    for (uint32_t i = 0; i < archive.header->count && ret == 0; i++) {
+        const ZealArchiveEntry* entry = &archive.entries[i];
+        char name[ARCHIVE_NAME_LEN + 1] = { 0 };
+        memcpy(name, entry->name, ARCHIVE_NAME_LEN);
+
+        /* The names come from the archive, they must not lead outside of the directory */
+        if (name[0] == 0 || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            printf("Error: invalid image name %s in the archive\n", name);
+            ret = 2;
+            break;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if (entry->offset > (uint64_t) st.st_size || entry->size > st.st_size - entry->offset) {
+            printf("Error: invalid size for %s in the archive\n", path);
+            ret = 2;
+            break;
+        }
+
+        uint8_t* content = malloc(entry->size ? entry->size : 1);
+        if (content == NULL ||
+            pread(archive.fd, content, entry->size, entry->offset) != (ssize_t) entry->size) {
+            printf("Error: could not read %s from the archive\n", path);
+            ret = 2;
+        } else {
+            if (archive_hash(content, entry->size) != entry->hash) {
+                printf("Warning: %s doesn't match its hash, corrupted archive?\n", path);
+            }
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || write(fd, content, entry->size) != (ssize_t) entry->size) {
+                printf("Error: could not write %s\n", path);
+                ret = 2;
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        free(content);
+    }
+    archive_close(&archive);
+    return ret;
+}
+
+
+/**
+ * @brief Open a store, print an error on failure.
+ *
+ * @return 0 on success, 2 on error.
+ */
+static int open_store(zealfs_store* store, const char* path, int create)
+{
+    int err = store_open(store, path, create);
+    if (err) {
+        printf("Error: could not open store %s: %s\n", path, strerror(-err));
+        return 2;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Read a whole image file, print an error on failure. Stores and containers only hold
+ *        images of at most 64KB, with 256-byte pages.
+ *
+ * @param content Buffer of UINT16_MAX + 1 bytes, filled with the image.
+ * @param size Filled with the size of the image.
+ *
+ * @return 0 on success, 2 on error.
+ */
+static int read_image(const char* path, uint8_t* content, int* size)
+{
+    struct stat st;
+    int ret = 2;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Error: could not read %s: %s\n", path, strerror(errno));
+    } else if (st.st_size > UINT16_MAX + 1) {
+        printf("Error: %s is too big, images are at most 64KB here\n", path);
+    } else {
+        ssize_t total = 0;
+        ssize_t rd = 1;
+        while (total < st.st_size && (rd = read(fd, content + total, st.st_size - total)) > 0) {
+            total += rd;
+        }
+        if (rd <= 0) {
+            printf("Error: could not read %s: %s\n", path, rd ? strerror(errno) : "truncated file");
+        } else if (total >= (ssize_t) sizeof(ZealFSHeader) &&
+                   ((const ZealFSHeader*) content)->page_order != 0) {
+            printf("Error: %s doesn't have 256-byte pages\n", path);
+        } else {
+            *size = total;
+            ret = 0;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ret;
+}
+
+
+/**
+ * @brief Add image files to a store, which is created if needed. The images are named after their
+ *        file name, an image with the same name is replaced.
+ *
+ * usage: store-add <store> <images...>
+ */
+static int cmd_store_add(int argc, char** argv)
+{
+    zealfs_store store;
+    uint8_t content[UINT16_MAX + 1];
+    int ret = 0;
+
+    if (argc < 2) {
+        return 1;
+    }
+    if (open_store(&store, argv[0], 1)) {
+        return 2;
+    }
+    for (int i = 1; i < argc && ret == 0; i++) {
+        char* copy = strdup(argv[i]);
+        int size = 0;
+        if (read_image(argv[i], content, &size)) {
+            ret = 2;
+        } else {
+            int err = store_import(&store, basename(copy), content, size);
+            if (err) {
+                printf("Error: could not add %s: %s\n", argv[i], strerror(-err));
+                ret = 2;
+            }
+        }
+        free(copy);
+    }
+    store_close(&store);
+    return ret;
+}
+
+
+/**
+ * @brief Remove images from a store. Their pages are only reclaimed by `store-compact`.
+ *
+ * usage: store-rm <store> <names...>
+ */
+static int cmd_store_rm(int argc, char** argv)
+{
+    zealfs_store store;
+    int ret = 0;
+
+    if (argc < 2) {
+        return 1;
+    }
+    if (open_store(&store, argv[0], 0)) {
+        return 2;
+    }
+    for (int i = 1; i < argc; i++) {
+        int err = store_remove(&store, argv[i]);
+        if (err) {
+            printf("Error: could not remove %s: %s\n", argv[i], strerror(-err));
+            ret = 2;
+        }
+    }
+    store_close(&store);
+    return ret;
+}
+
+
+/**
+ * @brief Extract an image from a store.
+ *
+ * usage: store-get <store> <name> <file>
+ */
+static int cmd_store_get(int argc, char** argv)
+{
+    zealfs_store store;
+    store_image image;
+    uint8_t page[256];
+
+    if (argc < 3) {
+        return 1;
+    }
+    if (open_store(&store, argv[0], 0)) {
+        return 2;
+    }
+    int ret = 0;
+    int err = store_load_image(&store, argv[1], &image);
+    int fd = err ? -1 : open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (uint32_t i = 0; fd >= 0 && i < image.pages; i++) {
+        if (store_read(&store, image.refs[i], page) || write(fd, page, sizeof(page)) != sizeof(page)) {
+            ret = 2;
+            break;
+        }
+    }
+    if (err || fd < 0 || ret) {
+        printf("Error: could not extract %s to %s\n", argv[1], argv[2]);
+        ret = 2;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(image.refs);
+    store_close(&store);
+    return ret;
+}
+
+
+/**
+ * @brief Reclaim the pages of a store that are not referenced anymore.
+ *
+ * usage: store-compact <store>
+ */
+static int cmd_store_compact(int argc, char** argv)
+{
+    zealfs_store store;
+
+    if (argc < 1) {
+        return 1;
+    }
+    if (open_store(&store, argv[0], 0)) {
+        return 2;
+    }
+    int dropped = store_compact(&store);
+    if (dropped < 0) {
+        printf("Error: could not compact %s: %s\n", argv[0], strerror(-dropped));
+    } else {
+        printf("%d pages reclaimed\n", dropped);
+    }
+    store_close(&store);
+    return dropped < 0 ? 2 : 0;
+}
+
+
+/**
+ * @brief Show the deduplication statistics of a store.
+ *
+ * usage: store-stats <store>
+ */
+static int cmd_store_stats(int argc, char** argv)
+{
+    zealfs_store store;
+
+    if (argc < 1) {
+        return 1;
+    }
+    if (open_store(&store, argv[0], 0)) {
+        return 2;
+    }
+    store_print_stats(&store, stdout);
+    store_close(&store);
+    return 0;
+}
+
+
+/**
+ * @brief Compress an image file into a container, which can be mounted directly.
+ *
+ * usage: compress [-c <chunk-pages>] <image> <container>
+ */
+static int cmd_compress(int argc, char** argv)
+{
+    uint8_t content[UINT16_MAX + 1];
+    int chunk_pages = CONTAINER_CHUNK_PAGES;
+    if (argc >= 2 && strcmp(argv[0], "-c") == 0) {
+        chunk_pages = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2 || chunk_pages < 1) {
+        return 1;
+    }
+
+    int size = 0;
+    if (read_image(argv[0], content, &size)) {
+        return 2;
+    }
+    int err = container_create(argv[1], content, size, chunk_pages);
+    if (err) {
+        printf("Error: could not compress %s into %s: %s\n", argv[0], argv[1], strerror(-err));
+        return 2;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Extract the image of a container. Compressing it again reclaims the space lost when
+ *        chunks were rewritten.
+ *
+ * usage: decompress <container> <image>
+ */
+static int cmd_decompress(int argc, char** argv)
+{
+    zealfs_container container;
+    uint8_t content[UINT16_MAX + 1];
+    int ret = 0;
+
+    if (argc < 2) {
+        return 1;
+    }
+    int err = container_open(&container, argv[0], 0);
+    if (err) {
+        printf("Error: could not open %s: %s\n", argv[0], strerror(-err));
+        return 2;
+    }
+    const int chunk_size = container.header.chunk_pages * 256;
+    for (int i = 0; i < container.header.chunks && err == 0; i++) {
+        err = container_read_chunk(&container, i, content + i * chunk_size);
+    }
+    if (err) {
+        printf("Error: could not read %s: %s\n", argv[0], strerror(-err));
+        ret = 2;
+    } else {
+        int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, content, container.header.size) != (ssize_t) container.header.size) {
+            printf("Error: could not write %s\n", argv[1]);
+            ret = 2;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    container_close(&container);
+    return ret;
+}
+
+
+/**
+ * @brief Build an image out of a manifest, see src/zealfs_build.h for its format.
+ *
+ * usage: build [-s <size-kb>] [-p <page-size>] <manifest> <image>
+ */
+static int cmd_build(int argc, char** argv)
+{
+    /* Same default size as the images created by the driver */
+    int size_kb = 32;
+    int page_size = 256;
+    while (argc >= 2 && argv[0][0] == '-') {
+        if (strcmp(argv[0], "-s") == 0) {
+            size_kb = atoi(argv[1]);
+        } else if (strcmp(argv[0], "-p") == 0) {
+            page_size = atoi(argv[1]);
+        } else {
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2 || size_kb < 1 || page_size < 1) {
+        return 1;
+    }
+    return build_image(argv[0], argv[1], size_kb * 1024, page_size) ? 2 : 0;
+}
+
+
+/**
+ * @brief Lay out an image again with its most read files first, according to the hotness file
+ *        saved by the driver.
+ *
+ * usage: relayout [-h <hotness>] <image> <output>
+ */
+static int cmd_relayout(int argc, char** argv)
+{
+    const char* hotness = NULL;
+    if (argc >= 2 && strcmp(argv[0], "-h") == 0) {
+        hotness = argv[1];
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2) {
+        return 1;
+    }
+    return relayout_image(argv[0], hotness, argv[1]) ? 2 : 0;
+}
+
+
+/**
+ * @brief Generate variants of a template image, see src/zealfs_variant.h for the overlays format.
+ *
+ * usage: variants [-j <jobs>] <template> <overlays> <directory>
+ */
+static int cmd_variants(int argc, char** argv)
+{
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+        jobs = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 3 || jobs < 1) {
+        return 1;
+    }
+    int count = variants_generate(argv[0], argv[1], argv[2], jobs);
+    if (count < 0) {
+        return 2;
+    }
+    printf("%d variants written to %s\n", count, argv[2]);
+    return 0;
+}
+
+
+/**
+ * @brief Resize a mounted image, the pages past the new end are moved first when shrinking.
+ *
+ * usage: resize <mountpoint> <size-kb>
+ */
+static int cmd_resize(int argc, char** argv)
+{
+    if (argc < 2 || atoi(argv[1]) < 1) {
+        return 1;
+    }
+    const uint32_t size_kb = atoi(argv[1]);
+    int fd = open(argv[0], O_RDONLY);
+    if (fd < 0 || ioctl(fd, ZEALFS_IOC_RESIZE, &size_kb) != 0) {
+        printf("Error: could not resize %s to %uKB: %s\n", argv[0], size_kb, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 2;
+    }
+    close(fd);
+    return 0;
+}
+
+
+static const struct {
+    const char* name;
+    const char* usage;
+    int (*run)(int argc, char** argv);
+} s_commands[] = {
+    { "pack",           "[-j <jobs>] <archive> <images...>",                    cmd_pack },
+    { "unpack",         "<archive> [directory]",                                cmd_unpack },
+    { "list",           "<archive>",                                            cmd_list },
+    { "store-add",      "<store> <images...>",                                  cmd_store_add },
+    { "store-rm",       "<store> <names...>",                                   cmd_store_rm },
+    { "store-get",      "<store> <name> <file>",                                cmd_store_get },
+    { "store-compact",  "<store>",                                              cmd_store_compact },
+    { "store-stats",    "<store>",                                              cmd_store_stats },
+    { "compress",       "[-c <chunk-pages>] <image> <container>",               cmd_compress },
+    { "decompress",     "<container> <image>",                                  cmd_decompress },
+    { "build",          "[-s <size-kb>] [-p <page-size>] <manifest> <image>",   cmd_build },
+    { "relayout",       "[-h <hotness>] <image> <output>",                      cmd_relayout },
+    { "variants",       "[-j <jobs>] <template> <overlays> <directory>",        cmd_variants },
+    { "resize",         "<mountpoint> <size-kb>",                               cmd_resize },
+};
+
+#define COMMANDS_COUNT  ((int) (sizeof(s_commands) / sizeof(s_commands[0])))
+
+
+static void show_help(const char* program)
+{
+    printf("usage: %s <command> [arguments]\n\nCommands:\n", program);
+    for (int i = 0; i < COMMANDS_COUNT; i++) {
+        printf("    %s %s\n", s_commands[i].name, s_commands[i].usage);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        show_help(argv[0]);
+        return 1;
+    }
+    for (int i = 0; i < COMMANDS_COUNT; i++) {
+        if (strcmp(argv[1], s_commands[i].name) == 0) {
+            int ret = s_commands[i].run(argc - 2, argv + 2);
+            if (ret == 1) {
+                printf("usage: %s %s %s\n", argv[0], s_commands[i].name, s_commands[i].usage);
+            }
+            return ret;
+        }
+    }
+    show_help(argv[0]);
+    return 1;
+}
@@ -0,0 +1,653 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "zealfs.h"
+#include "zealfs_variant.h"
+
+/* Geometry of the template, shared by all the variants */
+static int g_page_shift;
+static int g_pages;
+
+#define PAGE_PAYLOAD        (PAGE_BYTES - 1)
+#define VARIANT_MAX_PAGES   256
+#define VARIANT_NAME_LEN    64
+
+/* Source file of a change, loaded once even if several variants use it */
+typedef struct {
+    char path[PATH_MAX];
+    uint8_t* content;
+    int size;
+    time_t mtime;
+} variant_source;
+
+/* Change of a variant, `source` is NULL to delete the file */
+typedef struct {
+    int line;
+    int variant;
+    char path[PATH_MAX];
+    const variant_source* source;
+} variant_change;
+
+typedef struct {
+    char name[VARIANT_NAME_LEN + 1];
+    /* Changes of the variant, contiguous in the list of changes once sorted */
+    int first;
+    int count;
+} variant_desc;
+
+/* State shared by the threads generating the variants */
+typedef struct {
+    const uint8_t* template;
+    const char* directory;
+    variant_desc* variants;
+    int variant_count;
+    variant_change* changes;
+    int change_count;
+    variant_source* sources;
+    int source_count;
+    /* Next variant to generate */
+    atomic_int next;
+    atomic_int error;
+} variant_context;
+
+/* Image of a variant, its pages are the template's until they are modified */
+typedef struct {
+    const uint8_t* template;
+    uint8_t* copies[VARIANT_MAX_PAGES];
+} variant_image;
+
+/* Location of an entry: page of its directory, 0 for the root directory, and index in it */
+typedef struct {
+    int page;
+    int index;
+} entry_loc;
+
+
+static const uint8_t* page_get(const variant_image* image, int page)
+{
+    return image->copies[page] ? image->copies[page] : image->template + (page << g_page_shift);
+}
+
+
+/**
+ * @brief Get a page of a variant for modification, it is copied from the template first.
+ *
+ * @param keep 1 to keep the former content, 0 to get a zeroed page.
+ *
+ * @return Content of the page, NULL if there is no memory left.
+ */
+static uint8_t* page_modify(variant_image* image, int page, int keep)
+{
+    if (image->copies[page] == NULL) {
+        image->copies[page] = malloc(PAGE_BYTES);
+        if (image->copies[page] == NULL) {
+            return NULL;
+        }
+        if (keep) {
+            memcpy(image->copies[page], image->template + (page << g_page_shift), PAGE_BYTES);
+        }
+    }
+    if (!keep) {
+        memset(image->copies[page], 0, PAGE_BYTES);
+    }
+    return image->copies[page];
+}
+
+
+/**
+ * @brief Get the entries of a directory, and their number.
+ */
+static const ZealFileEntry* dir_entries(const variant_image* image, int page, int* max_entries)
+{
+    if (page == 0) {
+        *max_entries = ROOT_MAX_ENTRIES;
+        return ((const ZealFSHeader*) page_get(image, 0))->entries;
+    }
+    *max_entries = DIR_MAX_ENTRIES;
+    return (const ZealFileEntry*) page_get(image, page);
+}
+
+
+static ZealFileEntry* entry_modify(variant_image* image, entry_loc loc)
+{
+    uint8_t* page = page_modify(image, loc.page, 1);
+    if (page == NULL) {
+        return NULL;
+    }
+    const size_t offset = loc.page == 0 ? offsetof(ZealFSHeader, entries) : 0;
+    return (ZealFileEntry*) (page + offset) + loc.index;
+}
+
+
+/**
+ * @brief Allocate a zeroed page in a variant.
+ *
+ * @return Page number on success, 0 if the image is full, negative error code else.
+ */
+static int alloc_page(variant_image* image)
+{
+    ZealFSHeader* header = (ZealFSHeader*) page_modify(image, 0, 1);
+    if (header == NULL) {
+        return -ENOMEM;
+    }
+    const uint8_t page = allocatePage(header);
+    if (page >= g_pages) {
+        /* The bitmap doesn't match the image size, don't go past its end */
+        freePage(header, page);
+        return 0;
+    }
+    if (page != 0 && page_modify(image, page, 0) == NULL) {
+        return -ENOMEM;
+    }
+    return page;
+}
+
+
+static int page_valid(const variant_image* image, int page)
+{
+    const ZealFSHeader* header = (const ZealFSHeader*) page_get(image, 0);
+    return page != 0 && page < g_pages && ((header->pages_bitmap[page / 8] >> (page % 8)) & 1);
+}
+
+
+/**
+ * @brief Look for the entry of a path. Its missing parent directories are created.
+ *
+ * @param loc Filled with the location of the entry, or of a free entry in its directory.
+ *
+ * @return 1 if the entry exists, 0 if it doesn't, negative error code else.
+ */
+static int lookup(variant_image* image, const char* path, entry_loc* loc)
+{
+    char copy[PATH_MAX];
+    char* saveptr = NULL;
+    int dir = 0;
+
+    strcpy(copy, path);
+    char* name = strtok_r(copy, "/", &saveptr);
+    while (name != NULL) {
+        char* next = strtok_r(NULL, "/", &saveptr);
+        int max_entries = 0;
+        int found = -1;
+        int free_index = -1;
+        if (strlen(name) > NAME_MAX_LEN) {
+            return -ENAMETOOLONG;
+        }
+        const ZealFileEntry* entries = dir_entries(image, dir, &max_entries);
+        for (int i = 0; i < max_entries && found < 0; i++) {
+            if ((entries[i].flags & IS_OCCUPIED) == 0) {
+                free_index = free_index < 0 ? i : free_index;
+            } else if (strncmp(entries[i].name, name, NAME_MAX_LEN) == 0) {
+                found = i;
+            }
+        }
+        if (next == NULL || found >= 0) {
+            loc->page = dir;
+            loc->index = found >= 0 ? found : free_index;
+            if (next == NULL) {
+                return found >= 0 ? 1 : free_index >= 0 ? 0 : -ENFILE;
+            }
+            if ((entries[found].flags & IS_DIR) == 0 || !page_valid(image, entries[found].start_page)) {
+                return -ENOTDIR;
+            }
+            dir = entries[found].start_page;
+        } else if (free_index < 0) {
+            return -ENFILE;
+        } else {
+            /* Create the missing directory */
+            const int page = alloc_page(image);
+            ZealFileEntry* entry = entry_modify(image, (entry_loc) { dir, free_index });
+            if (page <= 0 || entry == NULL) {
+                return page == 0 ? -ENOSPC : -ENOMEM;
+            }
+            memset(entry, 0, sizeof(*entry));
+            strncpy(entry->name, name, NAME_MAX_LEN);
+            entry->flags = IS_OCCUPIED | IS_DIR;
+            entry->start_page = page;
+            entry->size = PAGE_BYTES;
+            setDate(entry, time(NULL));
+            dir = page;
+        }
+        name = next;
+    }
+    return -EINVAL;
+}
+
+
+/**
+ * @brief Remove a file from a variant, its pages are freed.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int remove_file(variant_image* image, entry_loc loc)
+{
+    int max_entries = 0;
+    const ZealFileEntry entry = dir_entries(image, loc.page, &max_entries)[loc.index];
+    ZealFSHeader* header = (ZealFSHeader*) page_modify(image, 0, 1);
+    if (header == NULL) {
+        return -ENOMEM;
+    }
+    if (entry.flags & IS_DIR) {
+        return -EISDIR;
+    }
+
+    if (entry.flags & IS_PACKED) {
+        const int count = packedSlots(entry.size);
+        if (entry.start_page && count) {
+            uint8_t* bitmap = page_valid(image, entry.start_page) ? page_modify(image, entry.start_page, 1) : NULL;
+            if (bitmap == NULL) {
+                return -EIO;
+            }
+            /* The shared page is freed with its last slot */
+            *bitmap &= ~(((1 << count) - 1) << entry.slot);
+            if (*bitmap == 1) {
+                freePage(header, entry.start_page);
+            }
+        }
+    } else {
+        const int pages = entry.size == 0 ? 1 : (entry.size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+        int page = entry.start_page;
+        for (int i = 0; i < pages; i++) {
+            /* A page already freed means the chain loops */
+            if (!page_valid(image, page)) {
+                return -EIO;
+            }
+            const int next = page_get(image, page)[0];
+            freePage(header, page);
+            page = next;
+        }
+    }
+    ZealFileEntry* modified = entry_modify(image, loc);
+    if (modified == NULL) {
+        return -ENOMEM;
+    }
+    modified->flags = 0;
+    return 0;
+}
+
+
+/**
+ * @brief Store a source file in a free entry of a variant.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int add_file(variant_image* image, entry_loc loc, const char* path, const variant_source* source)
+{
+    const ZealFSHeader* header = (const ZealFSHeader*) page_get(image, 0);
+    const int pages = source->size == 0 ? 1 : (source->size + PAGE_PAYLOAD - 1) / PAGE_PAYLOAD;
+    if (header->free_pages < pages) {
+        return -ENOSPC;
+    }
+
+    int start = 0;
+    uint8_t* previous = NULL;
+    for (int i = 0; i < pages; i++) {
+        const int page = alloc_page(image);
+        if (page <= 0) {
+            return page == 0 ? -ENOSPC : page;
+        }
+        uint8_t* content = image->copies[page];
+        const int offset = i * PAGE_PAYLOAD;
+        memcpy(content + 1, source->content + offset, MIN(source->size - offset, PAGE_PAYLOAD));
+        if (previous) {
+            previous[0] = page;
+        } else {
+            start = page;
+        }
+        previous = content;
+    }
+
+    ZealFileEntry* entry = entry_modify(image, loc);
+    if (entry == NULL) {
+        return -ENOMEM;
+    }
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->name, strrchr(path, '/') + 1, NAME_MAX_LEN);
+    entry->flags = IS_OCCUPIED;
+    entry->start_page = start;
+    entry->size = source->size;
+    setDate(entry, source->mtime);
+    return 0;
+}
+
+
+/**
+ * @brief Apply a change to a variant.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int apply_change(variant_image* image, const variant_change* change)
+{
+    entry_loc loc;
+    int err = lookup(image, change->path, &loc);
+    if (err < 0) {
+        return err;
+    }
+    const int exists = err;
+    if (change->source == NULL) {
+        return exists ? remove_file(image, loc) : -ENOENT;
+    }
+    if (exists) {
+        err = remove_file(image, loc);
+    }
+    return err ? err : add_file(image, loc, change->path, change->source);
+}
+
+
+/**
+ * @brief Write a variant, the pages that were not modified are written from the template.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int write_variant(const variant_context* ctx, const variant_image* image, const char* name)
+{
+    char path[PATH_MAX];
+    struct iovec iov[VARIANT_MAX_PAGES];
+    const ssize_t size = (ssize_t) g_pages << g_page_shift;
+
+    for (int i = 0; i < g_pages; i++) {
+        iov[i].iov_base = (void*) page_get(image, i);
+        iov[i].iov_len = PAGE_BYTES;
+    }
+    snprintf(path, sizeof(path), "%s/%s.img", ctx->directory, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    int err = writev(fd, iov, g_pages) == size ? 0 : -EIO;
+    close(fd);
+    return err;
+}
+
+
+/**
+ * @brief Generate one variant: apply its changes to a copy-on-write view of the template, and
+ *        write it.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int generate(variant_context* ctx, const variant_desc* variant)
+{
+    variant_image image = { .template = ctx->template };
+    int err = 0;
+
+    for (int i = 0; i < variant->count && err == 0; i++) {
+        const variant_change* change = &ctx->changes[variant->first + i];
+        err = apply_change(&image, change);
+        if (err) {
+            printf("Error: line %d: could not change %s in %s: %s\n",
+                   change->line, change->path, variant->name, strerror(-err));
+        }
+    }
+    if (err == 0) {
+        err = write_variant(ctx, &image, variant->name);
+        if (err) {
+            printf("Error: could not write variant %s: %s\n", variant->name, strerror(-err));
+        }
+    }
+    for (int i = 0; i < g_pages; i++) {
+        free(image.copies[i]);
+    }
+    return err;
+}
+
+
+static void* generate_thread(void* arg)
+{
+    variant_context* ctx = arg;
+    int i;
+
+    while (atomic_load(&ctx->error) == 0 && (i = atomic_fetch_add(&ctx->next, 1)) < ctx->variant_count) {
+        int err = generate(ctx, &ctx->variants[i]);
+        if (err) {
+            atomic_store(&ctx->error, err);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Load a source file, unless it was already loaded for another change.
+ *
+ * @return The source, NULL on error.
+ */
+static const variant_source* load_source(variant_context* ctx, const char* path, int line)
+{
+    struct stat st;
+    for (int i = 0; i < ctx->source_count; i++) {
+        if (strcmp(ctx->sources[i].path, path) == 0) {
+            return &ctx->sources[i];
+        }
+    }
+
+    variant_source* source = &ctx->sources[ctx->source_count];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: line %d: could not open %s: %s\n", line, path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT16_MAX) {
+        printf("Error: line %d: %s must be a regular file of at most %d bytes\n", line, path, UINT16_MAX);
+        close(fd);
+        return NULL;
+    }
+    strcpy(source->path, path);
+    source->size = st.st_size;
+    source->mtime = st.st_mtime;
+    source->content = malloc(source->size ? source->size : 1);
+    const int ok = source->content && read(fd, source->content, source->size) == source->size;
+    close(fd);
+    if (!ok) {
+        printf("Error: line %d: could not read %s\n", line, path);
+        free(source->content);
+        return NULL;
+    }
+    ctx->source_count++;
+    return source;
+}
+
+
+/**
+ * @brief Parse one line of the overlays.
+ *
+ * @return 1 if a change was added, 0 if the line is empty, negative error code else.
+ */
+static int parse_line(variant_context* ctx, char* line, int number)
+{
+    const char* separators = " \t\r\n";
+    char* saveptr = NULL;
+    const char* name = strtok_r(line, separators, &saveptr);
+    if (name == NULL || name[0] == '#') {
+        return 0;
+    }
+    const char* path = strtok_r(NULL, separators, &saveptr);
+    const char* source = strtok_r(NULL, separators, &saveptr);
+    if (path == NULL || source == NULL || strtok_r(NULL, separators, &saveptr) != NULL) {
+        printf("Error: line %d: expected <variant> <path> <source|->\n", number);
+        return -EINVAL;
+    }
+    if (strlen(name) > VARIANT_NAME_LEN || strchr(name, '/')) {
+        printf("Error: line %d: invalid variant name %s\n", number, name);
+        return -EINVAL;
+    }
+    const size_t len = strlen(path);
+    if (path[0] != '/' || len < 2 || path[len - 1] == '/' || len >= PATH_MAX) {
+        printf("Error: line %d: invalid path %s\n", number, path);
+        return -EINVAL;
+    }
+
+    variant_change* change = &ctx->changes[ctx->change_count];
+    change->line = number;
+    strcpy(change->path, path);
+    change->source = NULL;
+    if (strcmp(source, "-") != 0) {
+        change->source = load_source(ctx, source, number);
+        if (change->source == NULL) {
+            return -EINVAL;
+        }
+    }
+
+    change->variant = -1;
+    for (int i = 0; i < ctx->variant_count && change->variant < 0; i++) {
+        if (strcmp(ctx->variants[i].name, name) == 0) {
+            change->variant = i;
+        }
+    }
+    if (change->variant < 0) {
+        change->variant = ctx->variant_count++;
+        strcpy(ctx->variants[change->variant].name, name);
+    }
+    ctx->change_count++;
+    return 1;
+}
+
+
+/**
+ * @brief Parse the overlays, the changes are grouped by variant, in the order of the lines.
+ *
+ * @return 0 on success, negative error code else.
+ */
+static int parse_overlays(variant_context* ctx, const char* overlays)
+{
+    char line[PATH_MAX * 2 + VARIANT_NAME_LEN + 8];
+    int lines = 0;
+    int err = 0;
+
+    FILE* file = fopen(overlays, "r");
+    if (file == NULL) {
+        err = -errno;
+        printf("Error: could not open %s: %s\n", overlays, strerror(-err));
+        return err;
+    }
+    /* Each line adds at most one change, one variant and one source */
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lines++;
+    }
+    rewind(file);
+    ctx->changes = calloc(lines + 1, sizeof(variant_change));
+    ctx->variants = calloc(lines + 1, sizeof(variant_desc));
+    ctx->sources = calloc(lines + 1, sizeof(variant_source));
+    if (ctx->changes == NULL || ctx->variants == NULL || ctx->sources == NULL) {
+        err = -ENOMEM;
+    }
+    for (int number = 1; err == 0 && fgets(line, sizeof(line), file) != NULL; number++) {
+        const int ret = parse_line(ctx, line, number);
+        err = ret < 0 ? ret : 0;
+    }
+    fclose(file);
+    if (err) {
+        return err;
+    }
+
+    /* Group the changes by variant, keeping their order, with a counting sort */
+    variant_change* sorted = malloc((ctx->change_count + 1) * sizeof(variant_change));
+    if (sorted == NULL) {
+        return -ENOMEM;
+    }
+    for (int i = 0; i < ctx->change_count; i++) {
+        ctx->variants[ctx->changes[i].variant].count++;
+    }
+    for (int i = 1; i < ctx->variant_count; i++) {
+        ctx->variants[i].first = ctx->variants[i - 1].first + ctx->variants[i - 1].count;
+    }
+    int filled[ctx->variant_count + 1];
+    memset(filled, 0, sizeof(filled));
+    for (int i = 0; i < ctx->change_count; i++) {
+        const int variant = ctx->changes[i].variant;
+        sorted[ctx->variants[variant].first + filled[variant]++] = ctx->changes[i];
+    }
+    free(ctx->changes);
+    ctx->changes = sorted;
+    return 0;
+}
+
+
+/**
+ * @brief Load the template image and check its geometry.
+ *
+ * @return The content of the template, NULL on error.
+ */
+static uint8_t* load_template(const char* path)
+{
+    struct stat st;
+    uint8_t* content = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= 256 && st.st_size <= (256 << PAGE_ORDER_MAX) * 256) {
+        content = malloc(st.st_size);
+        if (content && read(fd, content, st.st_size) != st.st_size) {
+            free(content);
+            content = NULL;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    const ZealFSHeader* header = (const ZealFSHeader*) content;
+    if (content == NULL || header->magic != 'Z' || header->page_order > PAGE_ORDER_MAX) {
+        printf("Error: %s is not a valid image\n", path);
+        free(content);
+        return NULL;
+    }
+    g_page_shift = header->page_order + 8;
+    g_pages = st.st_size >> g_page_shift;
+    if (header->bitmap_size == 0 || header->bitmap_size * 8 > g_pages || st.st_size % PAGE_BYTES) {
+        printf("Error: %s is not a valid image\n", path);
+        free(content);
+        return NULL;
+    }
+    return content;
+}
+
+
+int variants_generate(const char* template, const char* overlays, const char* directory, int jobs)
+{
+    variant_context ctx = { .directory = directory };
+    pthread_t threads[jobs];
+    int started = 0;
+
+    ctx.template = load_template(template);
+    if (ctx.template == NULL) {
+        return -EINVAL;
+    }
+    int err = parse_overlays(&ctx, overlays);
+
+    /* Variants are independent, generate them in parallel */
+    if (err == 0) {
+        for (started = 0; started < jobs - 1 && started < ctx.variant_count - 1; started++) {
+            if (pthread_create(&threads[started], NULL, generate_thread, &ctx) != 0) {
+                break;
+            }
+        }
+        generate_thread(&ctx);
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        err = atomic_load(&ctx.error);
+    }
+
+    for (int i = 0; i < ctx.source_count; i++) {
+        free(ctx.sources[i].content);
+    }
+    free(ctx.sources);
+    free(ctx.changes);
+    free(ctx.variants);
+    free((void*) ctx.template);
+    return err ? err : ctx.variant_count;
+}
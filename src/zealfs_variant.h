@@ -0,0 +1,34 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+/*
+ * Variants of an image are generated out of a template image and a list of overlays, one change
+ * per line:
+ *
+ *     <variant> <path in the image> <source file|->
+ *
+ * Empty lines and lines starting with '#' are ignored. The file at the given path is replaced by
+ * the source file, or created, with its parent directories, if it doesn't exist. A source `-`
+ * deletes the file. The changes of a variant are applied in the order of the lines, and the
+ * variant is written to `<directory>/<variant>.img`.
+ *
+ * The template is loaded once, and each variant shares its pages until they are modified, so a
+ * variant only costs the pages its changes touch. The variants are generated in parallel.
+ */
+
+/**
+ * @brief Generate the variants of a template image.
+ *
+ * @param template Path of the template image.
+ * @param overlays Path of the list of overlays, the sources are relative to the current directory.
+ * @param directory Directory where the variants are written, their files are overwritten.
+ * @param jobs Number of variants generated in parallel.
+ *
+ * @return Number of variants written on success, negative error code else. The error is described
+ *         on the standard output.
+ */
+int variants_generate(const char* template, const char* overlays, const char* directory, int jobs);
@@ -0,0 +1,281 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include "zealfs_volume.h"
+
+int volume_init(zealfs_volume* vol, int fd, int size)
+{
+    memset(vol, 0, sizeof(*vol));
+    vol->fd = fd;
+    vol->size = size;
+    vol->page_shift = 8;
+    vol->event_fd = -1;
+    vol->image = size <= VOLUME_MAX_SIZE ? calloc(1, VOLUME_MAX_SIZE) : NULL;
+    if (vol->image == NULL) {
+        return -1;
+    }
+    if (pthread_mutex_init(&vol->fault_lock, NULL)) {
+        return -1;
+    }
+    return pthread_rwlock_init(&vol->lock, NULL) ? -1 : 0;
+}
+
+
+int volume_load(zealfs_volume* vol)
+{
+    int offset = 0;
+    while (offset < vol->size) {
+        ssize_t rd = pread(vol->fd, vol->image + offset, vol->size - offset, vol->offset + offset);
+        if (rd <= 0) {
+            return -1;
+        }
+        offset += rd;
+    }
+    return 0;
+}
+
+
+void volume_fault(zealfs_volume* vol, int page)
+{
+    const int first = page - page % vol->fault_pages;
+    const int pages = vol->size >> vol->page_shift;
+    const int count = first + vol->fault_pages > pages ? pages - first : vol->fault_pages;
+
+    pthread_mutex_lock(&vol->fault_lock);
+    /* Another reader may have loaded the pages while we were waiting */
+    if (((atomic_load_explicit(&vol->loaded[page / 8], memory_order_relaxed) >> (page % 8)) & 1) == 0) {
+        if (vol->fault(vol, first, count, vol->fault_arg)) {
+            /* Nothing better to do than to expose zeros, the callback reported the error */
+            memset(vol->image + (first << vol->page_shift), 0, count << vol->page_shift);
+        }
+        /* Publish the content of the pages before marking them loaded */
+        for (int i = first; i < first + count; i++) {
+            atomic_fetch_or_explicit(&vol->loaded[i / 8], 1 << (i % 8), memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&vol->fault_lock);
+}
+
+
+void volume_mark_dirty(zealfs_volume* vol, int page)
+{
+    vol->dirty[page / 8] |= 1 << (page % 8);
+    vol->page_gen[page] = ++vol->generation;
+}
+
+
+/**
+ * @brief Check whether a page of the cache only contains zeros.
+ */
+static int page_is_zero(const zealfs_volume* vol, int page)
+{
+    const uint64_t* words = (const uint64_t*) (vol->image + (page << vol->page_shift));
+    uint64_t acc = 0;
+    for (int i = 0; i < (1 << vol->page_shift) / 8; i++) {
+        acc |= words[i];
+    }
+    return acc == 0;
+}
+
+
+/**
+ * @brief Write a run of dirty pages to the file. In a sparse volume, the zeroed pages are
+ *        deallocated from the file instead. The holes are extended over the neighbouring zeroed
+ *        pages, clean or not, up to the allocation unit of the file system, so that whole
+ *        blocks are released.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int write_run(zealfs_volume* vol, int first, int last)
+{
+    const int shift = vol->page_shift;
+    const int pages = vol->size >> shift;
+
+    if (vol->sparse_block == 0) {
+        const size_t length = (last - first + 1) << shift;
+        return pwrite(vol->fd, vol->image + (first << shift), length, vol->offset + (first << shift)) == (ssize_t) length ? 0 : -1;
+    }
+
+    int page = first;
+    while (page <= last) {
+        /* Group the consecutive pages that are all zeroed, or all not zeroed */
+        const int zero = page_is_zero(vol, page);
+        int end = page;
+        while (end + 1 <= last && page_is_zero(vol, end + 1) == zero) {
+            end++;
+        }
+
+        int start = page;
+        if (zero) {
+            while ((vol->offset + (start << shift)) % vol->sparse_block && start > 0 && page_is_zero(vol, start - 1)) {
+                start--;
+            }
+            while ((vol->offset + ((end + 1) << shift)) % vol->sparse_block && end + 1 < pages && page_is_zero(vol, end + 1)) {
+                end++;
+            }
+        }
+
+        const size_t length = (end - start + 1) << shift;
+        const off_t offset = vol->offset + (start << shift);
+        /* Fall back to writing the zeros if the file system cannot punch holes */
+        const int punched = zero && fallocate(vol->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                              offset, length) == 0;
+        if (!punched && pwrite(vol->fd, vol->image + (start << shift), length, offset) != (ssize_t) length) {
+            return -1;
+        }
+        page = end + 1;
+    }
+    return 0;
+}
+
+
+int volume_flush(zealfs_volume* vol)
+{
+    const int pages = vol->size >> vol->page_shift;
+    int err = 0;
+
+    if (vol->flush) {
+        err = vol->flush(vol, vol->flush_arg);
+        if (err == 0) {
+            memset(vol->dirty, 0, sizeof(vol->dirty));
+        }
+        return err;
+    }
+
+    for (int page = 0; page < pages; page++) {
+        if (!volume_is_dirty(vol, page)) {
+            continue;
+        }
+        /* Coalesce the contiguous dirty pages */
+        int last = page;
+        while (last + 1 < pages && volume_is_dirty(vol, last + 1)) {
+            last++;
+        }
+        if (write_run(vol, page, last)) {
+            err = -1;
+        } else {
+            for (int i = page; i <= last; i++) {
+                vol->dirty[i / 8] &= ~(1 << (i % 8));
+            }
+        }
+        page = last;
+    }
+
+    return err;
+}
+
+
+/* Run of dirty pages of a volume, part of a write of volume_flush_group */
+typedef struct {
+    zealfs_volume* vol;
+    int first;
+    int last;
+} dirty_run;
+
+
+/**
+ * @brief Write runs of dirty pages contiguous in the file, and mark them clean on success.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int write_runs(const dirty_run* runs, struct iovec* iov, int count)
+{
+    const zealfs_volume* vol = runs[0].vol;
+    const off_t offset = vol->offset + (runs[0].first << vol->page_shift);
+    ssize_t length = 0;
+    for (int i = 0; i < count; i++) {
+        length += iov[i].iov_len;
+    }
+    if (pwritev(vol->fd, iov, count, offset) != length) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        for (int page = runs[i].first; page <= runs[i].last; page++) {
+            runs[i].vol->dirty[page / 8] &= ~(1 << (page % 8));
+        }
+    }
+    return 0;
+}
+
+
+int volume_flush_group(zealfs_volume* const* vols, int count)
+{
+    /* A write holds at most one run per volume: the runs of a volume are separated by clean pages */
+    dirty_run runs[count];
+    struct iovec iov[count];
+    int pending = 0;
+    off_t end = 0;
+    int err = 0;
+
+    for (int i = 0; i < count; i++) {
+        zealfs_volume* vol = vols[i];
+        if (vol->flush || vol->sparse_block) {
+            err |= volume_flush(vol);
+            continue;
+        }
+        const int shift = vol->page_shift;
+        const int pages = vol->size >> shift;
+        for (int page = 0; page < pages; page++) {
+            if (!volume_is_dirty(vol, page)) {
+                continue;
+            }
+            int last = page;
+            while (last + 1 < pages && volume_is_dirty(vol, last + 1)) {
+                last++;
+            }
+            /* Append the run to the pending write if it follows it in the file */
+            const off_t offset = vol->offset + (page << shift);
+            if (pending && (offset != end || vol->fd != runs[0].vol->fd)) {
+                err |= write_runs(runs, iov, pending);
+                pending = 0;
+            }
+            runs[pending] = (dirty_run) { vol, page, last };
+            iov[pending].iov_base = vol->image + (page << shift);
+            iov[pending].iov_len = (last - page + 1) << shift;
+            end = offset + iov[pending].iov_len;
+            pending++;
+            page = last;
+        }
+    }
+    if (pending) {
+        err |= write_runs(runs, iov, pending);
+    }
+    return err;
+}
+
+
+zealfs_volume* volume_rdlock(zealfs_volume* vol)
+{
+    pthread_rwlock_rdlock(&vol->lock);
+    return vol;
+}
+
+
+zealfs_volume* volume_wrlock(zealfs_volume* vol)
+{
+    pthread_rwlock_wrlock(&vol->lock);
+    return vol;
+}
+
+
+void volume_unlock(zealfs_volume* vol)
+{
+    /* Only a writer can have modified the generation, and it is the only one holding the lock */
+    if (vol->event_fd >= 0 && vol->signaled != vol->generation) {
+        vol->signaled = vol->generation;
+        const uint64_t one = 1;
+        if (write(vol->event_fd, &one, sizeof(one)) < 0) {
+            /* The counter can only overflow if nobody reads it, nothing to do */
+        }
+    }
+    pthread_rwlock_unlock(&vol->lock);
+}
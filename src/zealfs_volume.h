@@ -0,0 +1,182 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/* A volume has at most 256 pages, as page numbers are 8-bit values */
+#define VOLUME_MAX_PAGES 256
+
+/* Size of the biggest volume, made of 1KB pages. The cache is always allocated for it, so that a
+ * volume can grow without moving its content. */
+#define VOLUME_MAX_SIZE  (VOLUME_MAX_PAGES * 1024)
+
+struct zealfs_volume;
+
+/**
+ * @brief Function writing the dirty pages of a volume to a storage other than a plain file.
+ *
+ * @return 0 on success, -1 on error.
+ */
+typedef int (*volume_flush_fn)(struct zealfs_volume* vol, void* arg);
+
+/**
+ * @brief Function loading pages of a volume into the cache, the first time one of them is
+ *        accessed.
+ *
+ * @param first First page to load.
+ * @param count Number of pages to load.
+ *
+ * @return 0 on success, -1 on error.
+ */
+typedef int (*volume_fault_fn)(struct zealfs_volume* vol, int first, int count, void* arg);
+
+/* In-memory cache of a disk image, shared by the FUSE operations and the page server */
+typedef struct zealfs_volume {
+    /* File descriptor of the opened image */
+    int fd;
+    /* Offset of the image in the file, not 0 when the image is part of an archive */
+    off_t offset;
+    /* Size of the image in bytes, at most VOLUME_MAX_SIZE */
+    int size;
+    /* Pages are (1 << page_shift) bytes big, 256 by default */
+    int page_shift;
+    /* Content of the image, `size` bytes, followed by zeros up to VOLUME_MAX_SIZE */
+    uint8_t* image;
+    /* Held for reading by operations that only read the cache, for writing by the others */
+    pthread_rwlock_t lock;
+    /* Incremented each time a page is modified */
+    uint32_t generation;
+    /* Generation of the last modification of each page */
+    uint32_t page_gen[VOLUME_MAX_PAGES];
+    /* Pages modified since the last flush, one bit per page */
+    uint8_t dirty[VOLUME_MAX_PAGES / 8];
+    /* When not -1, eventfd signaled each time the write lock is released after a modification */
+    int event_fd;
+    /* Generation when `event_fd` was last signaled */
+    uint32_t signaled;
+    /* When not 0, dirty pages full of zeros are punched out of the file instead of being written,
+     * the holes are extended to this allocation unit of the file system, in bytes */
+    int sparse_block;
+    /* When not NULL, called by `volume_flush` instead of writing the dirty pages to `fd` */
+    volume_flush_fn flush;
+    void* flush_arg;
+    /* When not NULL, the cache is filled lazily: the pages are loaded by groups of `fault_pages`
+     * the first time one of them is accessed through `volume_page` */
+    volume_fault_fn fault;
+    void* fault_arg;
+    int fault_pages;
+    /* Pages already loaded, one bit per page, only used when `fault` is set */
+    _Atomic uint8_t loaded[VOLUME_MAX_PAGES / 8];
+    /* Serializes the loads, as readers can access the cache concurrently */
+    pthread_mutex_t fault_lock;
+} zealfs_volume;
+
+
+/**
+ * @brief Initialize a volume and allocate its cache, filled with zeros.
+ *
+ * @param vol Volume to initialize.
+ * @param fd File descriptor of the opened image.
+ * @param size Size of the image in bytes.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int volume_init(zealfs_volume* vol, int fd, int size);
+
+/**
+ * @brief Read the whole image file into the cache.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int volume_load(zealfs_volume* vol);
+
+/**
+ * @brief Load the group of pages containing the given page, if not loaded yet.
+ *        Must be called with the lock held.
+ */
+void volume_fault(zealfs_volume* vol, int page);
+
+/**
+ * @brief Check whether a page is in the cache, i.e. whether accessing it won't load it.
+ */
+static inline int volume_is_loaded(zealfs_volume* vol, int page) {
+    return vol->fault == NULL ||
+           ((atomic_load_explicit(&vol->loaded[page / 8], memory_order_acquire) >> (page % 8)) & 1);
+}
+
+/**
+ * @brief Get the address of a page in the cache, loading it first if needed.
+ */
+static inline uint8_t* volume_page(zealfs_volume* vol, int page) {
+    if (!volume_is_loaded(vol, page)) {
+        volume_fault(vol, page);
+    }
+    return vol->image + (page << vol->page_shift);
+}
+
+/**
+ * @brief Mark a page of the cache as modified. Must be called with the write lock held.
+ */
+void volume_mark_dirty(zealfs_volume* vol, int page);
+
+/**
+ * @brief Check whether a page is marked as modified since the last flush.
+ */
+static inline int volume_is_dirty(const zealfs_volume* vol, int page) {
+    return (vol->dirty[page / 8] >> (page % 8)) & 1;
+}
+
+/**
+ * @brief Write all the modified pages back to the image file. Contiguous dirty pages are
+ *        written with a single call, except the runs of zeroed pages when the volume is sparse.
+ *        Must be called with the lock held.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int volume_flush(zealfs_volume* vol);
+
+/**
+ * @brief Write the modified pages of several volumes stored in the same file, such as the
+ *        partitions of an image. The runs of dirty pages that are contiguous in the file are
+ *        written with a single call, even across volumes. The volumes that are sparse or have
+ *        their own flush function are flushed separately. Must be called with the locks of all
+ *        the volumes held.
+ *
+ * @param vols Volumes to flush, ordered by offset in the file.
+ * @param count Number of volumes.
+ *
+ * @return 0 on success, -1 if any write failed.
+ */
+int volume_flush_group(zealfs_volume* const* vols, int count);
+
+/**
+ * @brief Lock the volume for reading or writing. The functions return the volume itself,
+ *        which makes them usable for scoped locks (see `volume_unlock_scope`).
+ */
+zealfs_volume* volume_rdlock(zealfs_volume* vol);
+zealfs_volume* volume_wrlock(zealfs_volume* vol);
+
+/**
+ * @brief Release the lock of the volume. If the volume was modified, its `event_fd` is signaled.
+ */
+void volume_unlock(zealfs_volume* vol);
+
+/**
+ * @brief Cleanup function for scoped locks, to use with `__attribute__((cleanup))`.
+ */
+static inline void volume_unlock_scope(zealfs_volume** vol) {
+    volume_unlock(*vol);
+}
+
+/* Lock the volume until the end of the current scope */
+#define VOLUME_READ_LOCK(vol) \
+    zealfs_volume* _scoped_lock __attribute__((cleanup(volume_unlock_scope))) = volume_rdlock(vol)
+#define VOLUME_WRITE_LOCK(vol) \
+    zealfs_volume* _scoped_lock __attribute__((cleanup(volume_unlock_scope))) = volume_wrlock(vol)
@@ -0,0 +1,545 @@
+/* SPDX-FileCopyrightText: 2022 Zeal 8-bit Computer <contact@zeal8bit.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Differential test of the file system, built and run by `make check` against libzealfs.a.
+ * Random operations are done on an image through the embedding API and on an in-memory model of
+ * the tree. After each of them, the image must pass the integrity check without leaking any page,
+ * and its whole content must match the model. At the end, the image is mounted again to check
+ * what was stored, and the number of pages followed and allocated by each kind of operation must
+ * be within the bounds of the image.
+ *
+ * Usage: zealfs-check [-s size_kb] [-p page_size] [-P] [-c] [seed] [steps]
+ *        -P packs the small files, -c compresses the files written. A small image fills up, the
+ *        operations failing with -ENOSPC are then checked to leave the image consistent.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../src/zealfs_embed.h"
+#include "../src/zealfs_cost.h"
+
+#define DEFAULT_IMAGE_KB    64
+/* Each directory level has the same few names, so that the operations often collide */
+#define NAMES           4
+#define DEPTH           3
+/* Number of paths: NAMES + NAMES^2 + NAMES^3 */
+#define NODES           84
+#define FILE_MAX        1536
+#define DEFAULT_STEPS       2000
+
+/* Expected state of a path, they are numbered level by level: "/a" is 0, "/d/d/d" is 83 */
+typedef struct {
+    int exists;
+    int is_dir;
+    int size;
+    uint8_t data[FILE_MAX];
+} model_node;
+
+static model_node s_model[NODES];
+static const char s_names[] = "abcd";
+/* First node of each level */
+static const int s_level_first[DEPTH + 1] = { 0, NAMES, NAMES + NAMES * NAMES, NODES };
+
+static int s_step;
+static const char* s_op;
+/* Number of pages of the image */
+static int s_pages;
+/* Number of operations which failed because the image was full */
+static int s_full;
+
+
+static int node_depth(int node)
+{
+    int depth = 1;
+    while (node >= s_level_first[depth]) {
+        depth++;
+    }
+    return depth;
+}
+
+
+static int node_make(int depth, int code)
+{
+    return s_level_first[depth - 1] + code;
+}
+
+
+/**
+ * @brief Get the parent of a node, -1 for the root directory.
+ */
+static int node_parent(int node)
+{
+    const int depth = node_depth(node);
+    return depth == 1 ? -1 : node_make(depth - 1, (node - s_level_first[depth - 1]) / NAMES);
+}
+
+
+static const char* node_path(int node, char* path)
+{
+    const int depth = node_depth(node);
+    int code = node - s_level_first[depth - 1];
+    for (int i = depth - 1; i >= 0; i--) {
+        path[2 * i] = '/';
+        path[2 * i + 1] = s_names[code % NAMES];
+        code /= NAMES;
+    }
+    path[2 * depth] = 0;
+    return path;
+}
+
+
+static int node_is_dir(int node)
+{
+    return node == -1 || (s_model[node].exists && s_model[node].is_dir);
+}
+
+
+static int node_is_file(int node)
+{
+    return s_model[node].exists && !s_model[node].is_dir;
+}
+
+
+/**
+ * @brief Check whether `node` is `ancestor` or is below it.
+ */
+static int node_below(int node, int ancestor)
+{
+    for (; node != -1; node = node_parent(node)) {
+        if (node == ancestor) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static int node_children(int node)
+{
+    int count = 0;
+    for (int i = 0; i < NODES; i++) {
+        count += s_model[i].exists && node_parent(i) == node;
+    }
+    return count;
+}
+
+
+/**
+ * @brief Get the node `node` becomes when `from` is renamed to `to`, -1 if it is too deep.
+ */
+static int node_renamed(int node, int from, int to)
+{
+    const int levels = node_depth(node) - node_depth(from);
+    int span = 1;
+    for (int i = 0; i < levels; i++) {
+        span *= NAMES;
+    }
+    const int depth = node_depth(to) + levels;
+    if (depth > DEPTH) {
+        return -1;
+    }
+    const int to_code = to - s_level_first[node_depth(to) - 1];
+    const int node_code = node - s_level_first[node_depth(node) - 1];
+    return node_make(depth, to_code * span + node_code % span);
+}
+
+
+static void fail(const char* fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+static void fail(const char* fmt, ...)
+{
+    va_list ap;
+    fprintf(stderr, "step %d, %s: ", s_step, s_op);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+/**
+ * @brief Compare the result of an operation with the model. An operation which should succeed
+ *        may only fail because the image is full, `full` is then set.
+ */
+static void check_result(int expected, int err, const char* path, int* full)
+{
+    *full = 0;
+    if (expected && err == -ENOSPC) {
+        *full = 1;
+        s_full++;
+    } else if (expected && err < 0) {
+        fail("%s failed with %s", path, strerror(-err));
+    } else if (!expected && err >= 0) {
+        fail("%s succeeded", path);
+    }
+}
+
+
+/**
+ * @brief Read a whole file from the image.
+ *
+ * @return Size of the file, negative error code on failure.
+ */
+static int image_read(const char* path, uint8_t* data)
+{
+    const int handle = zealfs_embed_open(path, O_RDONLY);
+    if (handle < 0) {
+        return handle;
+    }
+    int size = 0;
+    int rd;
+    while ((rd = zealfs_embed_read(handle, data + size, FILE_MAX + 1 - size)) > 0) {
+        size += rd;
+    }
+    zealfs_embed_close(handle);
+    return rd < 0 ? rd : size;
+}
+
+
+/**
+ * @brief Check a directory of the image, and recursively its subdirectories, against the model.
+ */
+static void check_directory(int dir)
+{
+    char path[2 * DEPTH + 1] = "/";
+    const int handle = zealfs_embed_opendir(dir == -1 ? "/" : node_path(dir, path));
+    zealfs_embed_dirent dirent;
+    int count = 0;
+    int rd;
+
+    if (handle < 0) {
+        fail("opening directory %s: %s", path, strerror(-handle));
+    }
+    while ((rd = zealfs_embed_readdir(handle, &dirent)) > 0) {
+        /* Hidden virtual entries are not part of the image */
+        if (dirent.name[0] == '.') {
+            continue;
+        }
+        const char* name = strchr(s_names, dirent.name[0]);
+        const int depth = dir == -1 ? 1 : node_depth(dir) + 1;
+        const int parent_code = dir == -1 ? 0 : dir - s_level_first[depth - 2];
+        const int node = name ? node_make(depth, parent_code * NAMES + (name - s_names)) : -1;
+        if (name == NULL || dirent.name[1] || depth > DEPTH || !s_model[node].exists) {
+            fail("unexpected entry %s in %s", dirent.name, path);
+        }
+        if (dirent.is_dir != s_model[node].is_dir ||
+            (!dirent.is_dir && (int) dirent.size != s_model[node].size)) {
+            fail("entry %s in %s is %s of %u bytes", dirent.name, path,
+                 dirent.is_dir ? "a directory" : "a file", dirent.size);
+        }
+        count++;
+    }
+    zealfs_embed_close(handle);
+    if (rd < 0) {
+        fail("reading directory %s: %s", path, strerror(-rd));
+    }
+    if (count != node_children(dir)) {
+        fail("%s has %d entries instead of %d", path, count, node_children(dir));
+    }
+}
+
+
+/**
+ * @brief Check the integrity of the image and that its whole content matches the model.
+ */
+static void check_image(void)
+{
+    static uint8_t data[FILE_MAX + 1];
+    char path[2 * DEPTH + 1];
+
+    const int leaked = zealfs_embed_check();
+    if (leaked) {
+        fail("integrity check returned %d", leaked);
+    }
+    check_directory(-1);
+    for (int i = 0; i < NODES; i++) {
+        if (node_is_dir(i)) {
+            check_directory(i);
+        } else if (s_model[i].exists) {
+            const int size = image_read(node_path(i, path), data);
+            if (size != s_model[i].size || memcmp(data, s_model[i].data, size)) {
+                fail("content of %s differs, %d bytes instead of %d", path, size, s_model[i].size);
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Check the number of pages followed and allocated by the operations done so far.
+ */
+static void check_costs(void)
+{
+    for (const op_cost* cost = cost_list(); cost != NULL; cost = cost->next) {
+        if (cost->max_hops > 2 * (uint64_t) s_pages || cost->max_allocs > (uint64_t) s_pages) {
+            fail("%s followed %lu pages and allocated %lu", cost->name,
+                 (unsigned long) cost->max_hops, (unsigned long) cost->max_allocs);
+        }
+    }
+}
+
+
+/**
+ * @brief Reload a file from the image after an operation ran out of space, it may have been
+ *        partially modified.
+ */
+static void sync_file(int node, const char* path)
+{
+    static uint8_t data[FILE_MAX + 1];
+    const int size = image_read(path, data);
+    if (size < 0 || size > FILE_MAX) {
+        fail("reading %s after running out of space: %d", path, size);
+    }
+    s_model[node].size = size;
+    memcpy(s_model[node].data, data, size);
+}
+
+
+/**
+ * @brief Pick the node an operation is done on. Most of the time, it exists, or it can be created
+ *        when `creating`, else the operation would mostly fail.
+ */
+static int pick_node(int creating)
+{
+    int nodes[NODES];
+    int count = 0;
+    for (int i = 0; i < NODES; i++) {
+        if (creating ? node_is_dir(node_parent(i)) && !s_model[i].exists : s_model[i].exists) {
+            nodes[count++] = i;
+        }
+    }
+    return (count && rand() % 4) ? nodes[rand() % count] : rand() % NODES;
+}
+
+
+static int op_write(int node, const char* path, int offset, int len, int truncate)
+{
+    static uint8_t data[FILE_MAX];
+    for (int i = 0; i < len; i++) {
+        data[i] = rand();
+    }
+    int handle = zealfs_embed_open(path, truncate ? O_RDWR | O_TRUNC : O_RDWR);
+    if (handle < 0) {
+        return handle;
+    }
+    int err = zealfs_embed_seek(handle, offset, SEEK_SET);
+    if (err >= 0) {
+        err = zealfs_embed_write(handle, data, len);
+        if (err >= 0 && err != len) {
+            fail("%s: wrote %d bytes instead of %d", path, err, len);
+        }
+    }
+    const int close_err = zealfs_embed_close(handle);
+    err = err < 0 ? err : close_err;
+
+    if (err >= 0) {
+        model_node* file = &s_model[node];
+        if (truncate) {
+            file->size = 0;
+        }
+        if (offset > file->size) {
+            memset(file->data + file->size, 0, offset - file->size);
+        }
+        memcpy(file->data + offset, data, len);
+        file->size = offset + len > file->size ? offset + len : file->size;
+    }
+    return err;
+}
+
+
+static void step(void)
+{
+    static uint8_t data[FILE_MAX + 1];
+    char path[2 * DEPTH + 1];
+    char to_path[2 * DEPTH + 1];
+    const int op = rand() % 9;
+    /* create and mkdir need a node which doesn't exist yet */
+    const int node = pick_node(op == 0 || op == 8);
+    model_node* model = &s_model[node];
+    int full = 0;
+    int err;
+
+    node_path(node, path);
+    switch (op) {
+        case 0: {
+            s_op = "create";
+            const int handle = zealfs_embed_open(path, O_RDWR | O_CREAT);
+            err = handle < 0 ? handle : zealfs_embed_close(handle);
+            check_result(node_is_dir(node_parent(node)) && !node_is_dir(node), err, path, &full);
+            if (err == 0 && !model->exists) {
+                model->exists = 1;
+                model->is_dir = 0;
+                model->size = 0;
+            }
+            break;
+        }
+        case 1:
+        case 2: {
+            s_op = "write";
+            const int offset = rand() % (model->size + 64);
+            const int len = rand() % 512;
+            if (offset + len > FILE_MAX) {
+                return;
+            }
+            err = op_write(node, path, offset, len, rand() % 8 == 0);
+            check_result(node_is_file(node), err, path, &full);
+            if (full) {
+                sync_file(node, path);
+            }
+            break;
+        }
+        case 3: {
+            s_op = "read";
+            err = image_read(path, data);
+            check_result(node_is_file(node), err, path, &full);
+            break;
+        }
+        case 4: {
+            s_op = "truncate";
+            const int size = rand() % FILE_MAX;
+            err = zealfs_embed_truncate(path, size);
+            check_result(node_is_file(node), err, path, &full);
+            if (err == 0) {
+                if (size > model->size) {
+                    memset(model->data + model->size, 0, size - model->size);
+                }
+                model->size = size;
+            } else if (full) {
+                sync_file(node, path);
+            }
+            break;
+        }
+        case 5: {
+            s_op = "rename";
+            const int to = pick_node(1);
+            /* The whole directory moves, it must not go deeper than the model */
+            for (int i = 0; i < NODES; i++) {
+                if (s_model[i].exists && node_below(i, node) && node_renamed(i, node, to) == -1) {
+                    return;
+                }
+            }
+            node_path(to, to_path);
+            err = zealfs_embed_rename(path, to_path);
+            const int replaced = s_model[to].exists;
+            const int expected = model->exists && node_is_dir(node_parent(to)) &&
+                                 (to == node || !node_below(to, node)) &&
+                                 (!replaced || to == node || (node_is_file(to) && !model->is_dir));
+            check_result(expected, err, path, &full);
+            if (err == 0 && to != node) {
+                static model_node moved[NODES];
+                memset(moved, 0, sizeof(moved));
+                for (int i = 0; i < NODES; i++) {
+                    if (s_model[i].exists && node_below(i, node)) {
+                        moved[node_renamed(i, node, to)] = s_model[i];
+                        s_model[i].exists = 0;
+                    }
+                }
+                for (int i = 0; i < NODES; i++) {
+                    if (moved[i].exists) {
+                        s_model[i] = moved[i];
+                    }
+                }
+            }
+            break;
+        }
+        case 6: {
+            s_op = "unlink";
+            err = zealfs_embed_unlink(path);
+            check_result(node_is_file(node), err, path, &full);
+            if (err == 0) {
+                model->exists = 0;
+            }
+            break;
+        }
+        case 7: {
+            s_op = "rmdir";
+            err = zealfs_embed_rmdir(path);
+            check_result(node_is_dir(node) && node_children(node) == 0, err, path, &full);
+            if (err == 0) {
+                model->exists = 0;
+            }
+            break;
+        }
+        case 8: {
+            s_op = "mkdir";
+            err = zealfs_embed_mkdir(path);
+            check_result(node_is_dir(node_parent(node)) && !model->exists, err, path, &full);
+            if (err == 0) {
+                model->exists = 1;
+                model->is_dir = 1;
+            }
+            break;
+        }
+    }
+    check_image();
+}
+
+
+int main(int argc, char** argv)
+{
+    zealfs_embed_options opts = { .page_size = 256 };
+    int size_kb = DEFAULT_IMAGE_KB;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:Pc")) != -1) {
+        switch (opt) {
+            case 's': size_kb = atoi(optarg); break;
+            case 'p': opts.page_size = atoi(optarg); break;
+            case 'P': opts.pack = 1; break;
+            case 'c': opts.compress = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-s size_kb] [-p page_size] [-P] [-c] [seed] [steps]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    const unsigned seed = optind < argc ? strtoul(argv[optind], NULL, 0) : 1;
+    const int steps = optind + 1 < argc ? atoi(argv[optind + 1]) : DEFAULT_STEPS;
+    char image[] = "/tmp/zealfs-check-XXXXXX";
+    s_pages = size_kb * 1024 / opts.page_size;
+
+    /* The image is created by the file system, only a unique name is needed */
+    const int fd = mkstemp(image);
+    if (fd < 0) {
+        perror("Could not create the image");
+        return 1;
+    }
+    close(fd);
+    unlink(image);
+
+    srand(seed);
+    s_op = "mount";
+    int err = zealfs_embed_mount_options(image, size_kb, &opts);
+    if (err) {
+        fail("%s", strerror(-err));
+    }
+    for (s_step = 0; s_step < steps; s_step++) {
+        step();
+    }
+
+    /* Everything must have been stored in the image */
+    s_op = "mount again";
+    zealfs_embed_unmount();
+    err = zealfs_embed_mount_options(image, size_kb, &opts);
+    if (err) {
+        fail("%s", strerror(-err));
+    }
+    check_image();
+    s_op = "costs";
+    check_costs();
+    zealfs_embed_unmount();
+    unlink(image);
+
+    printf("%d steps passed with seed %u, %dKB image of %d-byte pages%s%s, %d ran out of space\n",
+           steps, seed, size_kb, opts.page_size, opts.pack ? ", packed" : "",
+           opts.compress ? ", compressed" : "", s_full);
+    return 0;
+}